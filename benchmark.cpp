@@ -3,6 +3,7 @@
 #include <chrono>
 #include <cassert>
 #include <cstring>
+#include <cstdio> // remove()
 #include <algorithm>
 #include <memory>
 #include <bitset>
@@ -612,6 +613,26 @@ void benchmark_large(uint32_t n_samples, uint32_t n_variants, std::vector<uint32
             // PRINT("storm-blocked",b);
         }
 
+        // Thread scaling: 1, 2, 4, ... threads and finally all available cores.
+        const uint32_t n_cores = STORM_get_n_threads();
+        for (uint32_t t = 1; t <= n_cores; t = (t < n_cores && 2*t > n_cores) ? n_cores : 2*t) {
+            PERF_PRE
+            uint64_t total = STORM_pairw_intersect_cardinality_blocked_threads(twk2,0,t);
+            PERF_POST
+            std::cout << "storm-blocked-threads-" << t << "\t" << n_alts[a] << "\t" << storm_size << "\t" ;
+            b.PrintPretty();
+        }
+
+        // Out-of-core with a budget of a quarter of the file.
+        if (STORM_write_file(twk2, "storm_benchmark.storm") == 1) {
+            PERF_PRE
+            uint64_t total = STORM_pairw_intersect_cardinality_file("storm_benchmark.storm", STORM_file_size(twk2) / 4, 0, NULL, NULL, 0);
+            PERF_POST
+            std::cout << "storm-file-threads-" << STORM_get_n_threads() << "\t" << n_alts[a] << "\t" << storm_size << "\t" ;
+            b.PrintPretty();
+            remove("storm_benchmark.storm");
+        }
+
 
 #ifdef USE_ROARING
             uint64_t roaring_bytes_used = 0;
@@ -620,7 +641,7 @@ void benchmark_large(uint32_t n_samples, uint32_t n_variants, std::vector<uint32
             }
             // std::cerr << "[MEMORY][ROARING][" << n_alts[a] << "] Memory for Roaring=" << roaring_bytes_used << "b" << std::endl;
 
-            uint32_t roaring_optimal_b = STORM_CACHE_BLOCK_SIZE / (roaring_bytes_used / n_variants);
+            uint32_t roaring_optimal_b = STORM_get_cache_block_size(0) / (roaring_bytes_used / n_variants);
             roaring_optimal_b = roaring_optimal_b < 5 ? 5 : roaring_optimal_b;
 
             bench_t m8_2_block = froarwrapper_blocked(n_variants, n_ints_sample, roaring, roaring_optimal_b);
@@ -820,7 +841,7 @@ void intersect_test(uint32_t n_samples, uint32_t n_variants, std::vector<uint32_
             // std::cerr << "Total integer comparisons=" << n_total_integer_cmps << std::endl;
             //
 
-            uint32_t optimal_b = STORM_CACHE_BLOCK_SIZE/(n_ints_sample*8);
+            uint32_t optimal_b = STORM_get_cache_block_size(n_ints_sample)/(n_ints_sample*8);
             optimal_b = optimal_b < 5 ? 5 : optimal_b;
 
             const std::vector<uint32_t> block_range = {3,5,10,25,50,100,200,400,600,800, optimal_b }; // last one is auto
@@ -849,6 +870,14 @@ void intersect_test(uint32_t n_samples, uint32_t n_variants, std::vector<uint32_
                     b.PrintPretty();
                     // PRINT("storm-blocked",b);
                 }
+
+                {
+                    PERF_PRE
+                    uint64_t total = STORM_pairw_intersect_cardinality_total(twk2);
+                    PERF_POST
+                    std::cout << "storm-total\t" << n_alts[a] << "\t" ;
+                    b.PrintPretty();
+                }
             }
 
             // {
@@ -903,6 +932,14 @@ void intersect_test(uint32_t n_samples, uint32_t n_variants, std::vector<uint32_
                 // PRINT("STORM-contig",b);
             }
 
+            {
+                PERF_PRE
+                uint64_t total = STORM_contig_pairw_intersect_cardinality_total(twk_cont);
+                PERF_POST
+                std::cout << "STORM-contig-total\t" << n_alts[a] << "\t" ;
+                b.PrintPretty();
+            }
+
             {
                 // for (int i = 0; i < block_range.size(); ++i) {
                     PERF_PRE
@@ -917,6 +954,44 @@ void intersect_test(uint32_t n_samples, uint32_t n_variants, std::vector<uint32_
                 // }
             }
 
+            const uint32_t n_cores = STORM_get_n_threads();
+            for (uint32_t t = 1; t <= n_cores; t = (t < n_cores && 2*t > n_cores) ? n_cores : 2*t) {
+                PERF_PRE
+                uint64_t total = STORM_contig_pairw_intersect_cardinality_blocked_threads(twk_cont, optimal_b, t);
+                PERF_POST
+                std::string name = "STORM-contig-threads-" + std::to_string(t) + "-" + std::to_string(optimal_b);
+                std::cout << name << "\t" << n_alts[a] << "\t" ;
+                b.PrintPretty();
+            }
+
+            if (STORM_contig_pack_panels(twk_cont) == 1) {
+                PERF_PRE
+                uint64_t total = STORM_contig_pairw_intersect_cardinality_blocked(twk_cont, optimal_b);
+                PERF_POST
+                std::string name = "STORM-contig-panels-" + std::to_string(optimal_b);
+                std::cout << name << "\t" << n_alts[a] << "\t" ;
+                b.PrintPretty();
+            }
+
+            // Narrow rows take precedence over panels once packed.
+            if (STORM_contig_pack_narrow(twk_cont) == 1) {
+                {
+                    PERF_PRE
+                    uint64_t total = STORM_contig_pairw_intersect_cardinality(twk_cont);
+                    PERF_POST
+                    std::cout << "STORM-contig-narrow\t" << n_alts[a] << "\t" ;
+                    b.PrintPretty();
+                }
+
+                {
+                    PERF_PRE
+                    uint64_t total = STORM_contig_pairw_intersect_cardinality_lut(twk_cont, 0);
+                    PERF_POST
+                    std::cout << "STORM-contig-lut\t" << n_alts[a] << "\t" ;
+                    b.PrintPretty();
+                }
+            }
+
             // {
             //     PERF_PRE
             //     uint64_t total = bcont2.intersect_cont_auto();
@@ -982,7 +1057,7 @@ void intersect_test(uint32_t n_samples, uint32_t n_variants, std::vector<uint32_
             }
             // std::cerr << "[MEMORY][ROARING][" << n_alts[a] << "] Memory for Roaring=" << roaring_bytes_used << "b" << std::endl;
 
-            uint32_t roaring_optimal_b = STORM_CACHE_BLOCK_SIZE / (roaring_bytes_used / n_variants);
+            uint32_t roaring_optimal_b = STORM_get_cache_block_size(0) / (roaring_bytes_used / n_variants);
             roaring_optimal_b = roaring_optimal_b < 5 ? 5 : roaring_optimal_b;
 
             bench_t m8_2_block = froarwrapper_blocked(n_variants, n_ints_sample, roaring, roaring_optimal_b);
@@ -1088,6 +1163,15 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    // Tile sizes come from the tuning profile at $STORM_TUNING_PROFILE
+    // if set. The profile is measured and saved on the first run.
+    const char* profile = std::getenv("STORM_TUNING_PROFILE");
+    if (profile != nullptr) {
+        int ret = STORM_tune_profile(profile);
+        if (ret < 0) std::cerr << "Cannot use tuning profile " << profile << " (" << ret << ")" << std::endl;
+        else std::cerr << (ret == 1 ? "Loaded" : "Tuned") << " profile: cache block " << STORM_get_cache_block_size(0) << " bytes" << std::endl;
+    }
+
     std::vector<uint32_t>* loads = nullptr;
 
     if (argc > 3) {
@@ -1,10 +1,32 @@
 #include "storm.h"
 #include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE
-
-uint64_t STORM_intersect_vector16_cardinality(const uint16_t* STORM_RESTRICT v1, 
-                                              const uint16_t* STORM_RESTRICT v2, 
-                                              const uint32_t len1, 
-                                              const uint32_t len2) 
+#include <stdio.h> // FILE
+#include <time.h> // clock
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h> // __cpuid_count
+#define STORM_HAVE_CACHE_CPUID
+#define STORM_cpuid_leaf(leaf, sub, r) __cpuid_count(leaf, sub, r[0], r[1], r[2], r[3])
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h> // __cpuidex
+#define STORM_HAVE_CACHE_CPUID
+#define STORM_cpuid_leaf(leaf, sub, r) __cpuidex((int*)r, leaf, sub)
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h> // sysconf
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#endif
+
+static uint64_t STORM_intersect_vector16_cardinality_sse4(const uint16_t* STORM_RESTRICT v1, 
+                                                         const uint16_t* STORM_RESTRICT v2, 
+                                                         const uint32_t len1, 
+                                                         const uint32_t len2) 
 {
     size_t count = 0;
     size_t i_a = 0, i_b = 0;
@@ -72,20 +94,30 @@ uint64_t STORM_intersect_vector16_cardinality(const uint16_t* STORM_RESTRICT v1,
     return (uint64_t)count;
 }
 
-uint64_t STORM_intersect_vector32_unsafe(const uint32_t* STORM_RESTRICT v1, 
-                                   const uint32_t* STORM_RESTRICT v2, 
-                                   const uint32_t len1, 
-                                   const uint32_t len2, 
-                                   uint32_t* STORM_RESTRICT out)
+/* *************************************
+*  Block-id joins
+*
+*  Emit the index pairs (A,B) of equal values in two sorted lists of block
+*  ids. Balanced lists are merged 4x4 at a time by comparing a block of v1
+*  against the four rotations of a block of v2. When one list is much
+*  longer the short list gallops through it instead.
+***************************************/
+
+// Lists whose lengths differ by more than this factor are galloped.
+#ifndef STORM_GALLOP_RATIO
+#define STORM_GALLOP_RATIO 32
+#endif
+
+static uint64_t STORM_intersect_vector32_scalar(const uint32_t* STORM_RESTRICT v1, 
+                                                const uint32_t* STORM_RESTRICT v2, 
+                                                const uint32_t len1, 
+                                                const uint32_t len2, 
+                                                uint32_t* STORM_RESTRICT out)
 {
-    if (out == NULL) return 0;
-    if (v1  == NULL) return 0;
-    if (v2  == NULL) return 0;
     if (len1 == 0 || len2 == 0) return 0;
     uint64_t answer = 0;
     uint32_t A = 0, B = 0;
 
-    uint32_t offset = 0;
     while (1) {
         while (v1[A] < v2[B]) {
             SKIP_FIRST_COMPARE:
@@ -105,27 +137,442 @@ uint64_t STORM_intersect_vector32_unsafe(const uint32_t* STORM_RESTRICT v1,
     return answer; // NOTREACHED
 }
 
+// Gallops every element of small through large. Pairs are written as
+// (small, large) indices, or (large, small) if swap is set.
+static uint64_t STORM_intersect_vector32_gallop(const uint32_t* STORM_RESTRICT small, 
+                                                const uint32_t* STORM_RESTRICT large, 
+                                                const uint32_t n_small, 
+                                                const uint32_t n_large, 
+                                                const int swap,
+                                                uint32_t* STORM_RESTRICT out)
+{
+    uint64_t answer = 0;
+    uint32_t lo = 0;
+    for (uint32_t i = 0; i < n_small && lo < n_large; ++i) {
+        const uint32_t x = small[i];
+        if (large[lo] < x) {
+            uint32_t step = 1, hi = lo + 1;
+            while (hi < n_large && large[hi] < x) {
+                lo = hi;
+                step <<= 1;
+                hi = lo + step;
+            }
+            hi = hi < n_large ? hi : n_large;
+            while (lo + 1 < hi) {
+                const uint32_t mid = (lo + hi) / 2;
+                if (large[mid] < x) lo = mid;
+                else hi = mid;
+            }
+            lo = hi;
+            if (lo == n_large) break;
+        }
+        if (large[lo] == x) {
+            out[answer++] = swap ? lo : i;
+            out[answer++] = swap ? i : lo;
+        }
+    }
+    return answer;
+}
+
+static uint64_t STORM_intersect_vector32_sse(const uint32_t* STORM_RESTRICT v1, 
+                                             const uint32_t* STORM_RESTRICT v2, 
+                                             const uint32_t len1, 
+                                             const uint32_t len2, 
+                                             uint32_t* STORM_RESTRICT out)
+{
+    const uint32_t st_a = (len1 / 4) * 4, st_b = (len2 / 4) * 4;
+    uint32_t i_a = 0, i_b = 0;
+    uint64_t answer = 0;
+
+    if (i_a < st_a && i_b < st_b) {
+        __m128i v_a = _mm_loadu_si128((const __m128i*)&v1[i_a]);
+        __m128i v_b = _mm_loadu_si128((const __m128i*)&v2[i_b]);
+        while (1) {
+            // Lane k of rotation r is compared against v2[i_b + (k+r)%4].
+            const int m0 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v_a, v_b)));
+            const int m1 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v_a, _mm_shuffle_epi32(v_b, _MM_SHUFFLE(0,3,2,1)))));
+            const int m2 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v_a, _mm_shuffle_epi32(v_b, _MM_SHUFFLE(1,0,3,2)))));
+            const int m3 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v_a, _mm_shuffle_epi32(v_b, _MM_SHUFFLE(2,1,0,3)))));
+            if (m0 | m1 | m2 | m3) {
+                for (int k = 0; k < 4; ++k) {
+                    const int r = (m0 >> k & 1) ? 0 : (m1 >> k & 1) ? 1 : (m2 >> k & 1) ? 2 : (m3 >> k & 1) ? 3 : -1;
+                    if (r < 0) continue;
+                    out[answer++] = i_a + k;
+                    out[answer++] = i_b + ((k + r) & 3);
+                }
+            }
+
+            const uint32_t a_max = v1[i_a + 3];
+            const uint32_t b_max = v2[i_b + 3];
+            if (a_max <= b_max) {
+                i_a += 4;
+                if (i_a == st_a) break;
+                v_a = _mm_loadu_si128((const __m128i*)&v1[i_a]);
+            }
+            if (b_max <= a_max) {
+                i_b += 4;
+                if (i_b == st_b) break;
+                v_b = _mm_loadu_si128((const __m128i*)&v2[i_b]);
+            }
+        }
+    }
+
+    // Finish with the scalar merge. Values already matched in the last
+    // blocks are strictly smaller than the remaining ones in the other list.
+    const uint64_t n = STORM_intersect_vector32_scalar(&v1[i_a], &v2[i_b], len1 - i_a, len2 - i_b, &out[answer]);
+    for (uint64_t i = answer; i < answer + n; i += 2) {
+        out[i+0] += i_a;
+        out[i+1] += i_b;
+    }
+    return answer + n;
+}
+
+uint64_t STORM_intersect_vector32_unsafe(const uint32_t* STORM_RESTRICT v1, 
+                                   const uint32_t* STORM_RESTRICT v2, 
+                                   const uint32_t len1, 
+                                   const uint32_t len2, 
+                                   uint32_t* STORM_RESTRICT out)
+{
+    if (out == NULL) return 0;
+    if (v1  == NULL) return 0;
+    if (v2  == NULL) return 0;
+    if (len1 == 0 || len2 == 0) return 0;
+    // Disjoint ranges.
+    if (v1[len1-1] < v2[0] || v2[len2-1] < v1[0]) return 0;
+
+    if ((uint64_t)len1 * STORM_GALLOP_RATIO < len2) return STORM_intersect_vector32_gallop(v1, v2, len1, len2, 0, out);
+    if ((uint64_t)len2 * STORM_GALLOP_RATIO < len1) return STORM_intersect_vector32_gallop(v2, v1, len2, len1, 1, out);
+    return STORM_intersect_vector32_sse(v1, v2, len1, len2, out);
+}
+
+/* *************************************
+*  Scalar-bitmap probes
+*
+*  Count how many positions of a sorted list are set in a bitmap. The
+*  SIMD versions view the bitmap as 32-bit words, gather the words for
+*  8 (AVX2) or 16 (AVX-512) positions at once and test the bits with a
+*  variable shift.
+***************************************/
+#ifndef STORM_TARGET
+#if defined(__GNUC__) || defined(__clang__)
+#define STORM_TARGET(x) __attribute__ ((target (x)))
+#else
+#define STORM_TARGET(x)
+#endif
+#endif
+
+typedef uint64_t (*STORM_probe16_func)(const uint64_t* STORM_RESTRICT data, const uint16_t* STORM_RESTRICT list, const uint32_t n);
+typedef uint64_t (*STORM_probe32_func)(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT list, const uint32_t n);
+
+static uint64_t STORM_probe16_scalar(const uint64_t* STORM_RESTRICT data, const uint16_t* STORM_RESTRICT list, const uint32_t n) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        count += (data[list[i] >> 6] >> (list[i] & 63)) & 1;
+    }
+    return count;
+}
+
+static uint64_t STORM_probe32_scalar(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT list, const uint32_t n) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        count += (data[list[i] >> 6] >> (list[i] & 63)) & 1;
+    }
+    return count;
+}
+
+#if defined(STORM_HAVE_AVX2)
+// Returns the number of set bits of the gathered 32-bit words selected by
+// the positions in v.
+STORM_TARGET("avx2")
+static __m256i STORM_probe_avx2(const int* data, const __m256i v) {
+    const __m256i words = _mm256_i32gather_epi32(data, _mm256_srli_epi32(v, 5), 4);
+    const __m256i bits  = _mm256_srlv_epi32(words, _mm256_and_si256(v, _mm256_set1_epi32(31)));
+    return _mm256_and_si256(bits, _mm256_set1_epi32(1));
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_hsum_avx2(const __m256i v) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2,3,0,1)));
+    return (uint32_t)_mm_cvtsi128_si32(sum);
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_probe16_avx2(const uint64_t* STORM_RESTRICT data, const uint16_t* STORM_RESTRICT list, const uint32_t n) {
+    const int* base = (const int*)data;
+    __m256i counts = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (/**/; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&list[i]));
+        counts = _mm256_add_epi32(counts, STORM_probe_avx2(base, v));
+    }
+    return STORM_hsum_avx2(counts) + STORM_probe16_scalar(data, &list[i], n - i);
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_probe32_avx2(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT list, const uint32_t n) {
+    const int* base = (const int*)data;
+    __m256i counts = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (/**/; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)&list[i]);
+        counts = _mm256_add_epi32(counts, STORM_probe_avx2(base, v));
+    }
+    return STORM_hsum_avx2(counts) + STORM_probe32_scalar(data, &list[i], n - i);
+}
+#endif
+
+#if defined(STORM_HAVE_AVX512)
+STORM_TARGET("avx512bw")
+static uint32_t STORM_probe_avx512(const int* data, const __m512i v) {
+    const __m512i words = _mm512_i32gather_epi32(_mm512_srli_epi32(v, 5), data, 4);
+    const __m512i mask  = _mm512_sllv_epi32(_mm512_set1_epi32(1), _mm512_and_si512(v, _mm512_set1_epi32(31)));
+    return _mm_popcnt_u32(_mm512_test_epi32_mask(words, mask));
+}
+
+STORM_TARGET("avx512bw")
+static uint64_t STORM_probe16_avx512(const uint64_t* STORM_RESTRICT data, const uint16_t* STORM_RESTRICT list, const uint32_t n) {
+    const int* base = (const int*)data;
+    uint64_t count = 0;
+    uint32_t i = 0;
+    for (/**/; i + 16 <= n; i += 16) {
+        const __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)&list[i]));
+        count += STORM_probe_avx512(base, v);
+    }
+    return count + STORM_probe16_scalar(data, &list[i], n - i);
+}
+
+STORM_TARGET("avx512bw")
+static uint64_t STORM_probe32_avx512(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT list, const uint32_t n) {
+    const int* base = (const int*)data;
+    uint64_t count = 0;
+    uint32_t i = 0;
+    for (/**/; i + 16 <= n; i += 16) {
+        const __m512i v = _mm512_loadu_si512((const void*)&list[i]);
+        count += STORM_probe_avx512(base, v);
+    }
+    return count + STORM_probe32_scalar(data, &list[i], n - i);
+}
+#endif
+
+// Runtime CPU features, looked up once.
+static int STORM_cpuid_cached(void) {
+#if defined(STORM_HAVE_CPUID)
+    static volatile int cpuid = -1;
+    if (cpuid == -1) cpuid = STORM_get_cpuid();
+    return cpuid;
+#else
+    return 0;
+#endif
+}
+
+static STORM_probe16_func STORM_get_probe16_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX512)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX512BW) return &STORM_probe16_avx512;
+#endif
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_probe16_avx2;
+#endif
+    return &STORM_probe16_scalar;
+}
+
+static STORM_probe32_func STORM_get_probe32_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX512)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX512BW) return &STORM_probe32_avx512;
+#endif
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_probe32_avx2;
+#endif
+    return &STORM_probe32_scalar;
+}
+
 uint64_t STORM_intersect_bitmaps_scalar_list(const uint64_t* STORM_RESTRICT b1, 
     const uint64_t* STORM_RESTRICT b2, 
     const uint32_t* l1, const uint32_t* l2,
     const uint32_t  n1, const uint32_t  n2)
 {
-    uint64_t count = 0;
+    const STORM_probe32_func probe = STORM_get_probe32_func();
+    if (n1 < n2) return (*probe)(b2, l1, n1);
+    return (*probe)(b1, l2, n2);
+}
 
-#define MOD(x) (( (x) * 64 ) >> 6)
-    if(n1 < n2) {
-        for(int i = 0; i < n1; ++i) {
-            count += ((b2[l1[i] >> 6] & (1L << MOD(l1[i]))) != 0);
-            // __builtin_prefetch(&b2[l1[i] >> 6], 0, _MM_HINT_T0);
-        }
-    } else {
-        for(int i = 0; i < n2; ++i) {
-            count += ((b1[l2[i] >> 6] & (1L << MOD(l2[i]))) != 0);
-            // __builtin_prefetch(&b1[l2[i] >> 6], 0, _MM_HINT_T0);
+/* *************************************
+*  Block-occupancy signatures
+*
+*  Every container keeps a STORM_SIGNATURE_BITS-wide bitmap of the block
+*  ids it holds. Ids below STORM_SIGNATURE_BITS map to their own bit; the
+*  high part of larger ids is hashed into the bit index so that wide
+*  universes fold evenly. Containers with disjoint signatures share no
+*  block and their intersection is empty.
+***************************************/
+#if STORM_SIGNATURE_WORDS != 4 && STORM_SIGNATURE_WORDS != 8
+#error "STORM_SIGNATURE_WORDS must be 4 or 8"
+#endif
+
+// Candidate masks cover at most this many containers.
+#define STORM_SIGNATURE_BATCH 64
+
+static inline uint32_t STORM_signature_bit(const uint32_t id) {
+    const uint32_t h = (uint32_t)((id / STORM_SIGNATURE_BITS) * 0x9E3779B1u) >> 16;
+    return (id ^ h) % STORM_SIGNATURE_BITS;
+}
+
+static inline void STORM_signature_add(uint64_t* signature, const uint32_t id) {
+    const uint32_t bit = STORM_signature_bit(id);
+    signature[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline int STORM_signature_disjoint(const uint64_t* STORM_RESTRICT s1, const uint64_t* STORM_RESTRICT s2) {
+    uint64_t any = 0;
+    for (int i = 0; i < STORM_SIGNATURE_WORDS; ++i) any |= s1[i] & s2[i];
+    return any == 0;
+}
+
+// Returns a mask with bit k set if conts[k] may intersect the signature
+// (n <= STORM_SIGNATURE_BATCH).
+typedef uint64_t (*STORM_signature_func)(const uint64_t* STORM_RESTRICT signature, const STORM_bitmap_cont_t* STORM_RESTRICT conts, const uint32_t n);
+
+static uint64_t STORM_signature_candidates_scalar(const uint64_t* STORM_RESTRICT signature, const STORM_bitmap_cont_t* STORM_RESTRICT conts, const uint32_t n) {
+    uint64_t mask = 0;
+    for (uint32_t k = 0; k < n; ++k) {
+        mask |= (uint64_t)!STORM_signature_disjoint(signature, conts[k].signature) << k;
+    }
+    return mask;
+}
+
+#if defined(STORM_HAVE_AVX2)
+STORM_TARGET("avx2")
+static uint64_t STORM_signature_candidates_avx2(const uint64_t* STORM_RESTRICT signature, const STORM_bitmap_cont_t* STORM_RESTRICT conts, const uint32_t n) {
+    const __m256i s0 = _mm256_loadu_si256((const __m256i*)&signature[0]);
+#if STORM_SIGNATURE_WORDS == 8
+    const __m256i s1 = _mm256_loadu_si256((const __m256i*)&signature[4]);
+#endif
+    uint64_t mask = 0;
+    for (uint32_t k = 0; k < n; ++k) {
+        __m256i x = _mm256_and_si256(s0, _mm256_loadu_si256((const __m256i*)&conts[k].signature[0]));
+#if STORM_SIGNATURE_WORDS == 8
+        x = _mm256_or_si256(x, _mm256_and_si256(s1, _mm256_loadu_si256((const __m256i*)&conts[k].signature[4])));
+#endif
+        mask |= (uint64_t)!_mm256_testz_si256(x, x) << k;
+    }
+    return mask;
+}
+#endif
+
+static STORM_signature_func STORM_get_signature_func(void) {
+#if defined(STORM_HAVE_AVX2)
+    if (STORM_cpuid_cached() & STORM_CPUID_runtime_bit_AVX2) return &STORM_signature_candidates_avx2;
+#endif
+    return &STORM_signature_candidates_scalar;
+}
+
+/* *************************************
+*  Sorted uint16 set intersection
+*
+*  Balanced lists are merged with SSE4.2 string compares, which compare
+*  8x8 elements per instruction. When one list is much longer than the
+*  other the merge mostly streams over the long list, so instead every
+*  element of the short list skips ahead over whole vectors of the long
+*  list (32 elements with AVX-512BW, 16 with AVX2) and finishes with one
+*  broadcast compare. Without AVX2 the short list gallops.
+***************************************/
+
+// Lists whose lengths differ by more than this factor use the skip kernels.
+#ifndef STORM_SKIP_RATIO
+#define STORM_SKIP_RATIO 32
+#endif
+
+typedef uint64_t (*STORM_intersect16_func)(const uint16_t* STORM_RESTRICT small, const uint16_t* STORM_RESTRICT large, const uint32_t n_small, const uint32_t n_large);
+
+// For every element of the short list, gallop forwards in the long list.
+static uint64_t STORM_intersect16_gallop(const uint16_t* STORM_RESTRICT small, const uint16_t* STORM_RESTRICT large, const uint32_t n_small, const uint32_t n_large) {
+    uint64_t count = 0;
+    uint32_t lo = 0;
+    for (uint32_t i = 0; i < n_small && lo < n_large; ++i) {
+        const uint16_t x = small[i];
+        if (large[lo] < x) {
+            uint32_t step = 1, hi = lo + 1;
+            while (hi < n_large && large[hi] < x) {
+                lo = hi;
+                step <<= 1;
+                hi = lo + step;
+            }
+            hi = hi < n_large ? hi : n_large;
+            // large[lo] < x <= large[hi] (or hi == n_large)
+            while (lo + 1 < hi) {
+                const uint32_t mid = (lo + hi) / 2;
+                if (large[mid] < x) lo = mid;
+                else hi = mid;
+            }
+            lo = hi;
+            if (lo == n_large) break;
         }
+        count += large[lo] == x;
+    }
+    return count;
+}
+
+#if defined(STORM_HAVE_AVX2)
+STORM_TARGET("avx2")
+static uint64_t STORM_intersect16_skip_avx2(const uint16_t* STORM_RESTRICT small, const uint16_t* STORM_RESTRICT large, const uint32_t n_small, const uint32_t n_large) {
+    const uint32_t st = (n_large / 16) * 16;
+    uint32_t i = 0, j = 0;
+    uint64_t count = 0;
+
+    for (/**/; i < n_small; ++i) {
+        const uint16_t x = small[i];
+        while (j < st && large[j + 15] < x) j += 16;
+        if (j == st) break;
+        const __m256i eq = _mm256_cmpeq_epi16(_mm256_set1_epi16(x), _mm256_loadu_si256((const __m256i*)&large[j]));
+        count += _mm256_movemask_epi8(eq) != 0;
+    }
+    return count + STORM_intersect16_gallop(&small[i], &large[j], n_small - i, n_large - j);
+}
+#endif
+
+#if defined(STORM_HAVE_AVX512)
+STORM_TARGET("avx512bw")
+static uint64_t STORM_intersect16_skip_avx512(const uint16_t* STORM_RESTRICT small, const uint16_t* STORM_RESTRICT large, const uint32_t n_small, const uint32_t n_large) {
+    const uint32_t st = (n_large / 32) * 32;
+    uint32_t i = 0, j = 0;
+    uint64_t count = 0;
+
+    for (/**/; i < n_small; ++i) {
+        const uint16_t x = small[i];
+        while (j < st && large[j + 31] < x) j += 32;
+        if (j == st) break;
+        count += _mm512_cmpeq_epi16_mask(_mm512_set1_epi16(x), _mm512_loadu_si512((const void*)&large[j])) != 0;
     }
-#undef MOD
-    return(count);
+    return count + STORM_intersect16_gallop(&small[i], &large[j], n_small - i, n_large - j);
+}
+#endif
+
+static STORM_intersect16_func STORM_get_intersect16_skip_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX512)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX512BW) return &STORM_intersect16_skip_avx512;
+#endif
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_intersect16_skip_avx2;
+#endif
+    return &STORM_intersect16_gallop;
+}
+
+uint64_t STORM_intersect_vector16_cardinality(const uint16_t* STORM_RESTRICT v1, 
+                                              const uint16_t* STORM_RESTRICT v2, 
+                                              const uint32_t len1, 
+                                              const uint32_t len2) 
+{
+    if (len1 == 0 || len2 == 0) return 0;
+    if ((uint64_t)len1 * STORM_SKIP_RATIO < len2) return (*STORM_get_intersect16_skip_func())(v1, v2, len1, len2);
+    if ((uint64_t)len2 * STORM_SKIP_RATIO < len1) return (*STORM_get_intersect16_skip_func())(v2, v1, len2, len1);
+    return STORM_intersect_vector16_cardinality_sse4(v1, v2, len1, len2);
 }
 //
 
@@ -219,6 +666,47 @@ uint64_t STORM_wrapper_diag_list(const uint32_t n_vectors,
 }
 
 
+// Lower bound on the length of a word panel: shorter panels spend more in
+// per-call overhead than they save in cache misses.
+#ifndef STORM_MIN_PANEL_WORDS
+#define STORM_MIN_PANEL_WORDS 64
+#endif
+
+/**
+ * Number of words of each row to process at a time such that n_rows rows
+ * fit in the cache block size. Panels are whole multiples of 512 bits to
+ * keep the vector loads aligned. Returns n_words if whole rows fit.
+ */
+static uint32_t STORM_word_panel(const uint32_t n_words, const uint32_t n_rows) {
+    uint64_t panel = STORM_get_cache_block_size(n_words) / ((uint64_t)(n_rows == 0 ? 1 : n_rows) * sizeof(uint64_t));
+    panel -= panel % 8;
+    if (panel < STORM_MIN_PANEL_WORDS) panel = STORM_MIN_PANEL_WORDS;
+    return panel >= n_words ? n_words : panel;
+}
+
+// Sums f over the pairs of rows [i_start, i_end) x [j_start, j_end), or over
+// the pairs i < j in [i_start, i_end) if diag is set, one word panel at a
+// time.
+static uint64_t STORM_wrapper_tile(const uint64_t* vals, 
+                                   const uint32_t n_ints, 
+                                   const STORM_compute_func f,
+                                   const uint32_t i_start, const uint32_t i_end,
+                                   const uint32_t j_start, const uint32_t j_end,
+                                   const int diag, const uint32_t panel)
+{
+    uint64_t total = 0;
+    for (uint32_t k = 0; k < n_ints; k += panel) {
+        const uint32_t n = n_ints - k < panel ? n_ints - k : panel;
+        for (uint32_t i = i_start; i < i_end; ++i) {
+            const uint64_t* left = &vals[(uint64_t)i*n_ints + k];
+            for (uint32_t j = diag ? i + 1 : j_start; j < j_end; ++j) {
+                total += (*f)(left, &vals[(uint64_t)j*n_ints + k], n);
+            }
+        }
+    }
+    return total;
+}
+
 uint64_t STORM_wrapper_diag_blocked(const uint32_t n_vectors, 
                                     const uint64_t* vals, 
                                     const uint32_t n_ints, 
@@ -228,50 +716,17 @@ uint64_t STORM_wrapper_diag_blocked(const uint32_t n_vectors,
     uint64_t total = 0;
 
     block_size = (block_size == 0 ? 3 : block_size);
-    const uint32_t n_blocks1 = n_vectors / block_size;
-    const uint32_t n_blocks2 = n_vectors / block_size;
+    const uint32_t panel = STORM_word_panel(n_ints, 2*block_size);
 
-    uint32_t i  = 0;
-    uint32_t tt = 0;
-    for (/**/; i + block_size <= n_vectors; i += block_size) {
+    for (uint32_t i = 0; i < n_vectors; i += block_size) {
+        const uint32_t i_end = n_vectors - i < block_size ? n_vectors : i + block_size;
         // diagonal component
-        uint32_t left = i*n_ints;
-        uint32_t right = 0;
-        for (uint32_t j = 0; j < block_size; ++j, left += n_ints) {
-            right = left + n_ints;
-            for (uint32_t jj = j + 1; jj < block_size; ++jj, right += n_ints) {
-                total += (*f)(&vals[left], &vals[right], n_ints);
-            }
-        }
-
-        // square component
-        uint32_t curi = i;
-        uint32_t j = curi + block_size;
-        for (/**/; j + block_size <= n_vectors; j += block_size) {
-            left = curi*n_ints;
-            for (uint32_t ii = 0; ii < block_size; ++ii, left += n_ints) {
-                right = j*n_ints;
-                for (uint32_t jj = 0; jj < block_size; ++jj, right += n_ints) {
-                    total += (*f)(&vals[left], &vals[right], n_ints);
-                }
-            }
-        }
+        total += STORM_wrapper_tile(vals, n_ints, f, i, i_end, i, i_end, 1, panel);
 
-        // residual
-        right = j*n_ints;
-        for (/**/; j < n_vectors; ++j, right += n_ints) {
-            left = curi*n_ints;
-            for (uint32_t jj = 0; jj < block_size; ++jj, left += n_ints) {
-                total += (*f)(&vals[left], &vals[right], n_ints);
-            }
-        }
-    }
-    // residual tail
-    uint32_t left = i*n_ints;
-    for (/**/; i < n_vectors; ++i, left += n_ints) {
-        uint32_t right = left + n_ints;
-        for (uint32_t j = i + 1; j < n_vectors; ++j, right += n_ints) {
-            total += (*f)(&vals[left], &vals[right], n_ints);
+        // square component and residual
+        for (uint32_t j = i_end; j < n_vectors; j += block_size) {
+            const uint32_t j_end = n_vectors - j < block_size ? n_vectors : j + block_size;
+            total += STORM_wrapper_tile(vals, n_ints, f, i, i_end, j, j_end, 0, panel);
         }
     }
 
@@ -367,981 +822,6240 @@ uint64_t STORM_wrapper_diag_list_blocked(const uint32_t n_vectors,
 
     return total;
 }
-//
- 
-uint32_t STORM_bitmap_serialized_size(STORM_bitmap_t* bitmap) {
-    uint32_t total = 0;
-    total += sizeof(uint64_t) * bitmap->n_bitmap;
-    if (bitmap->n_scalar_set) {
-        total += sizeof(uint16_t) * bitmap->n_scalar;
-    }
-    total += 4*sizeof(uint32_t);
-    return total;
+/* *************************************
+*  Threading and tile scheduling
+*
+*  The upper-triangular N x N comparison is broken into bsize x bsize
+*  tiles. Tiles are dealt out to per-thread queues ordered by descending
+*  cost and idle workers steal from the tail of other queues. Every
+*  worker keeps its own scratch memory and partial sum.
+***************************************/
+#if defined(_WIN32)
+typedef HANDLE STORM_thread_t;
+typedef CRITICAL_SECTION STORM_mutex_t;
+#define STORM_mutex_init(m)    InitializeCriticalSection(m)
+#define STORM_mutex_destroy(m) DeleteCriticalSection(m)
+#define STORM_mutex_lock(m)    EnterCriticalSection(m)
+#define STORM_mutex_unlock(m)  LeaveCriticalSection(m)
+// Both versions evaluate to 0 on success.
+#define STORM_thread_create(t, func, arg) (((t) = CreateThread(NULL, 0, func, arg, 0, NULL)) == NULL)
+#define STORM_thread_join(t)   (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define STORM_THREAD_FUNC(name) static DWORD WINAPI name(LPVOID arg)
+#define STORM_THREAD_RETURN 0
+#else
+typedef pthread_t STORM_thread_t;
+typedef pthread_mutex_t STORM_mutex_t;
+#define STORM_mutex_init(m)    pthread_mutex_init(m, NULL)
+#define STORM_mutex_destroy(m) pthread_mutex_destroy(m)
+#define STORM_mutex_lock(m)    pthread_mutex_lock(m)
+#define STORM_mutex_unlock(m)  pthread_mutex_unlock(m)
+#define STORM_thread_create(t, func, arg) pthread_create(&(t), NULL, func, arg)
+#define STORM_thread_join(t)   pthread_join(t, NULL)
+#define STORM_THREAD_FUNC(name) static void* name(void* arg)
+#define STORM_THREAD_RETURN NULL
+#endif
+
+uint32_t STORM_get_n_threads(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (uint32_t)n : 1;
+#endif
 }
 
- 
-uint32_t STORM_bitmap_cont_serialized_size(STORM_bitmap_cont_t* bitmap) {
-    uint32_t total = 0;
-    if (bitmap->bitmaps != NULL) {
-        for (int i = 0; i < bitmap->n_bitmaps; ++i) {
-            STORM_bitmap_t* x = (STORM_bitmap_t*)&bitmap->bitmaps[i];
-            total += STORM_bitmap_serialized_size(x);
-        }
+/* *************************************
+*  Tuning
+*
+*  The tile sizes of the blocked drivers and the scalar cutoffs of new
+*  contiguous bitmaps are read from the active profile. Until a profile is
+*  set they are STORM_CACHE_BLOCK_SIZE and the rule of STORM_contig_new.
+***************************************/
+
+// Word operations per calibration run.
+#ifndef STORM_TUNING_WORDS
+#define STORM_TUNING_WORDS (1 << 26)
+#endif
+
+static STORM_tuning_t STORM_tuning_active;
+static volatile int STORM_tuning_ready = 0;
+
+static uint32_t STORM_tuning_class(uint32_t n_words) {
+    uint32_t c = 0;
+    while (n_words > 1 && c + 1 < STORM_TUNING_WIDTHS) {
+        n_words >>= 1;
+        ++c;
     }
-    total += sizeof(uint32_t) * bitmap->n_bitmaps;
-    total += 3*sizeof(uint32_t);
-    return total;
+    return c;
 }
 
-//
+// Parses sizes such as "48K" or "105M" as written by sysfs.
+static uint64_t STORM_parse_size(const char* s) {
+    char* end;
+    uint64_t size = strtoull(s, &end, 10);
+    if (*end == 'K') size <<= 10;
+    else if (*end == 'M') size <<= 20;
+    else if (*end == 'G') size <<= 30;
+    return size;
+}
 
-STORM_bitmap_t* STORM_bitmap_new() {
-    STORM_bitmap_t* all = (STORM_bitmap_t*)malloc(sizeof(STORM_bitmap_t));
-    if (all == NULL) return NULL;
-    uint32_t alignment = STORM_get_alignment();
-    all->data = NULL;
-    all->scalar = NULL;
-    all->n_bitmap = 0;
-    all->own_data = 1;
-    all->own_scalar = 1;
-    all->n_scalar = 0;
-    all->n_scalar_set = 0;
-    all->n_missing = 0;
-    all->m_scalar = 0;
-    all->id = 0;
-    all->n_bits_set = 0;
-    return all;
+static int STORM_read_line(const char* path, char* buf, const int n) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return 0;
+    const int ok = fgets(buf, n, f) != NULL;
+    fclose(f);
+    return ok;
 }
 
+static int STORM_detect_cache_sysfs(uint64_t* sizes) {
+    int found = 0;
+    for (int i = 0; i < 16; ++i) {
+        char path[128], buf[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        if (!STORM_read_line(path, buf, sizeof(buf))) break;
+        const int level = atoi(buf);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        if (!STORM_read_line(path, buf, sizeof(buf))) continue;
+        if (strncmp(buf, "Instruction", 11) == 0) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        if (!STORM_read_line(path, buf, sizeof(buf))) continue;
+        if (level < 1 || level > 3) continue;
+        sizes[level - 1] = STORM_parse_size(buf);
+        found = 1;
+    }
+    return found;
+}
 
-void STORM_bitmap_init(STORM_bitmap_t* all) {
-    uint32_t alignment = STORM_get_alignment();
-    uint32_t n_bitmap = ceil(STORM_DEFAULT_BLOCK_SIZE / 64.0);
-    all->data = NULL;
-    all->scalar = NULL;
-    all->n_bitmap = 0;
-    all->own_data = 1;
-    all->own_scalar = 1;
-    all->n_scalar = 0;
-    all->n_scalar_set = 0;
-    all->n_missing = 0;
-    all->m_scalar = 0;
-    all->id = 0;
-    all->n_bits_set = 0;    
+/**
+ * Walks the deterministic cache parameters of cpuid leaf 4 (Intel) or
+ * 0x8000001D (AMD). Each subleaf describes one cache until the type is 0.
+ */
+static int STORM_detect_cache_cpuid(uint64_t* sizes) {
+#if defined(STORM_HAVE_CACHE_CPUID)
+    const uint32_t leaves[2] = {4, 0x8000001D};
+    uint32_t r[4];
+    int found = 0;
+    for (int l = 0; l < 2 && !found; ++l) {
+        STORM_cpuid_leaf(leaves[l] & 0x80000000, 0, r);
+        if (r[0] < leaves[l]) continue;
+        for (uint32_t sub = 0; sub < 16; ++sub) {
+            STORM_cpuid_leaf(leaves[l], sub, r);
+            const uint32_t type  = r[0] & 0x1F;
+            const uint32_t level = (r[0] >> 5) & 0x7;
+            if (type == 0) break;
+            if (type == 2 || level < 1 || level > 3) continue; // instruction cache
+            sizes[level - 1] = (uint64_t)((r[1] >> 22) + 1) * (((r[1] >> 12) & 0x3FF) + 1) * ((r[1] & 0xFFF) + 1) * ((uint64_t)r[2] + 1);
+            found = 1;
+        }
+    }
+    return found;
+#else
+    (void)sizes;
+    return 0;
+#endif
 }
 
+int STORM_detect_cache_sizes(uint64_t* l1_size, uint64_t* l2_size, uint64_t* l3_size) {
+    uint64_t sizes[3] = {0, 0, 0};
+    const int found = STORM_detect_cache_sysfs(sizes) || STORM_detect_cache_cpuid(sizes);
+    if (l1_size != NULL) *l1_size = sizes[0];
+    if (l2_size != NULL) *l2_size = sizes[1];
+    if (l3_size != NULL) *l3_size = sizes[2];
+    return found;
+}
 
-void STORM_bitmap_free(STORM_bitmap_t* bitmap) {
-    if (bitmap == NULL) return;
-    if (bitmap->own_data) STORM_aligned_free(bitmap->data);
-    if (bitmap->own_scalar) STORM_aligned_free(bitmap->scalar);
-    free(bitmap);
+void STORM_tuning_init(STORM_tuning_t* tuning) {
+    if (tuning == NULL) return;
+    memset(tuning, 0, sizeof(STORM_tuning_t));
+    tuning->cpuid = STORM_cpuid_cached();
+    STORM_detect_cache_sizes(&tuning->l1_size, &tuning->l2_size, &tuning->l3_size);
+    tuning->cache_block_size = STORM_CACHE_BLOCK_SIZE;
 }
 
- 
-int STORM_bitmap_add(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
-    if (bitmap == NULL) return -1;
-    if (values == NULL) return -2;
-    if (n_values == 0)  return -3;
+void STORM_set_tuning(const STORM_tuning_t* tuning) {
+    if (tuning == NULL) STORM_tuning_init(&STORM_tuning_active);
+    else STORM_tuning_active = *tuning;
+    STORM_tuning_ready = 1;
+}
 
-    uint32_t adjust = bitmap->id * STORM_DEFAULT_BLOCK_SIZE;
+const STORM_tuning_t* STORM_get_tuning(void) {
+    if (!STORM_tuning_ready) STORM_set_tuning(NULL);
+    return &STORM_tuning_active;
+}
 
-    if (bitmap->data == NULL) {
-        uint32_t n_bitmap = ceil(STORM_DEFAULT_BLOCK_SIZE / 64.0);
-        uint32_t alignment = STORM_get_alignment();
-        bitmap->data = (uint64_t*)STORM_aligned_malloc(alignment, n_bitmap*sizeof(uint64_t));
-        memset(bitmap->data, 0, n_bitmap*sizeof(uint64_t));
+// Called from the tile kernels: does not initialize the profile so that
+// workers never race on it.
+uint64_t STORM_get_cache_block_size(const uint32_t n_words) {
+    if (!STORM_tuning_ready) return STORM_CACHE_BLOCK_SIZE;
+    const uint64_t size = n_words ? STORM_tuning_active.block_size[STORM_tuning_class(n_words)] : 0;
+    return size ? size : STORM_tuning_active.cache_block_size;
+}
+
+uint32_t STORM_get_scalar_cutoff(const uint64_t vector_length) {
+    if (STORM_tuning_ready) {
+        const uint32_t cutoff = STORM_tuning_active.scalar_cutoff[STORM_tuning_class(ceil(vector_length / 64.0))];
+        if (cutoff) return cutoff;
     }
-    bitmap->n_bitmap = ceil(STORM_DEFAULT_BLOCK_SIZE / 64.0);
+    return vector_length / 200 > 200 ? 200 : vector_length / 200;
+}
 
-    for (int i = 0; i < n_values; ++i) {
-        assert(adjust <= values[i]);
-        uint32_t v = values[i] - adjust;
-        assert(v < STORM_DEFAULT_BLOCK_SIZE);
-        bitmap->n_bits_set += (bitmap->data[v / 64] & 1ULL << (v % 64)) == 0;
-        bitmap->data[v / 64] |= 1ULL << (v % 64);
+// Random vectors of n_words words with about one bit in eight set.
+static STORM_contiguous_t* STORM_tuning_sample(const uint32_t n_words, const uint32_t n_vectors, uint64_t* state) {
+    STORM_contiguous_t* bitmap = STORM_contig_new(64*n_words);
+    uint32_t* values = (uint32_t*)malloc(64*n_words*sizeof(uint32_t));
+    if (bitmap == NULL || values == NULL) {
+        STORM_contig_free(bitmap);
+        free(values);
+        return NULL;
     }
-    return n_values;
+
+    for (uint32_t i = 0; i < n_vectors; ++i) {
+        uint32_t n_values = 0;
+        for (uint32_t w = 0; w < n_words; ++w) {
+            uint64_t bits = ~0ULL;
+            for (int k = 0; k < 3; ++k) {
+                // xorshift64
+                *state ^= *state << 13;
+                *state ^= *state >> 7;
+                *state ^= *state << 17;
+                bits &= *state;
+            }
+            for (/**/; bits; bits &= bits - 1) {
+                values[n_values++] = 64*w + _mm_popcnt_u64((bits & -bits) - 1);
+            }
+        }
+        if (STORM_contig_add(bitmap, values, n_values) < 0) {
+            STORM_contig_free(bitmap);
+            free(values);
+            return NULL;
+        }
+    }
+    free(values);
+    return bitmap;
 }
 
- 
-int STORM_bitmap_add_with_scalar(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
-    if (bitmap == NULL) return -1;
-    if (values == NULL) return -3;
-    if (n_values == 0) return -4;
+// Best of two runs of the serial blocked driver in seconds.
+static double STORM_tuning_time(STORM_contiguous_t* bitmap) {
+    double best = 0;
+    for (int r = 0; r < 2; ++r) {
+        const clock_t t0 = clock();
+        STORM_contig_pairw_intersect_cardinality_blocked(bitmap, STORM_get_cache_block_size(bitmap->n_bitmaps_vector) / (bitmap->n_bitmaps_vector * sizeof(uint64_t)));
+        const double t = (double)(clock() - t0) / CLOCKS_PER_SEC;
+        best = (r == 0 || t < best) ? t : best;
+    }
+    return best;
+}
 
-    if (bitmap->data == NULL) {
-        uint32_t n_bitmap = ceil(STORM_DEFAULT_BLOCK_SIZE / 64.0);
-        uint32_t alignment = STORM_get_alignment();
-        bitmap->data = (uint64_t*)STORM_aligned_malloc(alignment, n_bitmap*sizeof(uint64_t));
-        memset(bitmap->data, 0, n_bitmap*sizeof(uint64_t));
+/**
+ * Number of list probes that cost as much as one bitmap intersection of
+ * the width of bitmap. Capped at twice the number of words so that lists
+ * never take more memory than the bitmaps.
+ */
+static uint32_t STORM_tuning_cutoff(const STORM_contiguous_t* bitmap) {
+    const uint32_t n_words = bitmap->n_bitmaps_vector;
+    const uint64_t n_pairs = STORM_TUNING_WORDS / 16 / n_words + 1;
+    const uint64_t n_lists = STORM_TUNING_WORDS / 16 / 64 + 1;
+    uint32_t list[64];
+    for (uint32_t k = 0; k < 64; ++k) list[k] = (k * 2654435761u) % (64*n_words);
+
+    volatile uint64_t sink = 0;
+    clock_t t0 = clock();
+    for (uint64_t r = 0; r < n_pairs; ++r) {
+        sink += (*bitmap->intsec_func)(bitmap->bitmaps[r % bitmap->n_data].data, bitmap->bitmaps[(r + 1) % bitmap->n_data].data, n_words);
     }
-    
-    if (bitmap->scalar == NULL) {
-        uint32_t new_m = 256 < n_values ? n_values + 256 : 256;
-        uint32_t alignment = STORM_get_alignment();
-        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
-        bitmap->m_scalar = new_m;
-        bitmap->own_scalar = 1;
+    const double t_pair = (double)(clock() - t0) / n_pairs;
+    t0 = clock();
+    for (uint64_t r = 0; r < n_lists; ++r) {
+        sink += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[r % bitmap->n_data].data, bitmap->bitmaps[(r + 1) % bitmap->n_data].data, list, list, 64, 64);
     }
+    const double t_probe = (double)(clock() - t0) / (n_lists * 64);
+    (void)sink;
 
-    if (bitmap->n_scalar >= bitmap->m_scalar) {
-        uint32_t new_m = bitmap->n_scalar + n_values + 1024;
-        bitmap->m_scalar = new_m;
-        uint16_t* old = bitmap->scalar;
-        uint32_t alignment = STORM_get_alignment();
-        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
-        memcpy(bitmap->scalar, old, bitmap->n_scalar*sizeof(uint16_t));
-        STORM_aligned_free(old);
-        bitmap->own_scalar = 1;
+    if (t_probe <= 0) return 2*n_words;
+    const double cutoff = t_pair / t_probe;
+    return cutoff < 1 ? 1 : (cutoff > 2*n_words ? 2*n_words : (uint32_t)cutoff);
+}
+
+int STORM_tune(STORM_tuning_t* tuning) {
+    if (tuning == NULL) return -1;
+    STORM_tuning_init(tuning);
+    const STORM_tuning_t saved = *STORM_get_tuning();
+
+    // The untuned size and fractions of the detected caches.
+    uint64_t candidates[6];
+    uint32_t n_candidates = 0;
+    candidates[n_candidates++] = STORM_CACHE_BLOCK_SIZE;
+    if (tuning->l1_size) candidates[n_candidates++] = tuning->l1_size;
+    if (tuning->l2_size) {
+        candidates[n_candidates++] = tuning->l2_size / 4;
+        candidates[n_candidates++] = tuning->l2_size / 2;
+        candidates[n_candidates++] = tuning->l2_size;
+        if (tuning->l3_size > 2*tuning->l2_size) candidates[n_candidates++] = 2*tuning->l2_size;
     }
-    bitmap->n_bitmap = ceil(STORM_DEFAULT_BLOCK_SIZE / 64.0);
 
-    uint32_t adjust = bitmap->id * STORM_DEFAULT_BLOCK_SIZE;
-    bitmap->n_scalar_set = 1;
+    STORM_tuning_t trial = *tuning;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    int ret = 1;
+    for (uint32_t c = 2; c < STORM_TUNING_WIDTHS; c += 2) {
+        const uint32_t n_words = 1u << c;
+        uint32_t n_vectors = sqrt(2.0 * STORM_TUNING_WORDS / n_words);
+        n_vectors = n_vectors < 16 ? 16 : n_vectors;
+        STORM_contiguous_t* bitmap = STORM_tuning_sample(n_words, n_vectors, &state);
+        if (bitmap == NULL) {
+            ret = -2;
+            break;
+        }
 
-    for (int i = 0; i < n_values; ++i) {
-        assert(adjust <= values[i]);
-        uint32_t v = values[i] - adjust;
-        assert(v < STORM_DEFAULT_BLOCK_SIZE);
-        
-        int is_unique = (bitmap->data[v / 64] & 1ULL << (v % 64)) == 0;
-        bitmap->data[v / 64] |= 1ULL << (v % 64);
-    
-        if (is_unique) {
-            bitmap->scalar[bitmap->n_scalar] = v;
-            ++bitmap->n_scalar;
-            ++bitmap->n_bits_set;
+        double best = 0;
+        for (uint32_t k = 0; k < n_candidates; ++k) {
+            trial.cache_block_size = candidates[k];
+            STORM_set_tuning(&trial);
+            const double t = STORM_tuning_time(bitmap);
+            if (k == 0 || t < best) {
+                best = t;
+                tuning->block_size[c] = candidates[k];
+            }
         }
+        tuning->scalar_cutoff[c] = STORM_tuning_cutoff(bitmap);
+        STORM_contig_free(bitmap);
     }
-    return n_values;
+    STORM_set_tuning(&saved);
+    if (ret != 1) return ret;
+
+    // Classes in between take the values of the class below.
+    for (uint32_t c = 0; c < STORM_TUNING_WIDTHS; ++c) {
+        const uint32_t src = c < 2 ? 2 : (c & ~1u);
+        tuning->block_size[c] = tuning->block_size[src];
+        tuning->scalar_cutoff[c] = tuning->scalar_cutoff[src];
+    }
+    return 1;
 }
 
+// Reads the machine type of a "profile" line into key.
+static int STORM_tuning_parse_key(const char* line, STORM_tuning_t* key) {
+    unsigned long long l1, l2, l3, block;
+    unsigned int cpuid;
+    if (sscanf(line, "profile %u %llu %llu %llu %llu", &cpuid, &l1, &l2, &l3, &block) != 5) return 0;
+    key->cpuid = cpuid;
+    key->l1_size = l1;
+    key->l2_size = l2;
+    key->l3_size = l3;
+    key->cache_block_size = block;
+    return 1;
+}
 
-int STORM_bitmap_add_scalar_only(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
-    if (bitmap == NULL) return -1;
-    if (values == NULL) return -3;
-    if (n_values == 0) return -4;
+static int STORM_tuning_same_machine(const STORM_tuning_t* a, const STORM_tuning_t* b) {
+    return a->cpuid == b->cpuid && a->l1_size == b->l1_size && a->l2_size == b->l2_size && a->l3_size == b->l3_size;
+}
 
-    if (bitmap->scalar == NULL) {
-        uint32_t new_m = 256 < n_values ? n_values + 256 : 256;
-        uint32_t alignment = STORM_get_alignment();
-        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
-        bitmap->m_scalar = new_m;
-        bitmap->own_scalar = 1;
+int STORM_tuning_load(STORM_tuning_t* tuning, const char* path) {
+    if (tuning == NULL) return -1;
+    if (path == NULL) return -1;
+    STORM_tuning_init(tuning);
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return -2;
+
+    char line[256];
+    int ret = 0, in_section = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        STORM_tuning_t key;
+        if (!in_section) {
+            if (STORM_tuning_parse_key(line, &key) && STORM_tuning_same_machine(&key, tuning)) {
+                tuning->cache_block_size = key.cache_block_size;
+                in_section = 1;
+            }
+            continue;
+        }
+
+        unsigned int c, cutoff;
+        unsigned long long block;
+        if (strncmp(line, "end", 3) == 0) ret = 1;
+        else if (sscanf(line, "width %u %llu %u", &c, &block, &cutoff) == 3 && c < STORM_TUNING_WIDTHS) {
+            tuning->block_size[c] = block;
+            tuning->scalar_cutoff[c] = cutoff;
+        } else ret = -3;
     }
+    fclose(f);
+    if (in_section && ret == 0) ret = -3; // truncated
+    if (ret != 1) STORM_tuning_init(tuning);
+    return ret;
+}
 
-    if (bitmap->n_scalar >= bitmap->m_scalar) {
-        uint32_t new_m = bitmap->n_scalar + n_values + 1024;
-        bitmap->m_scalar = new_m;
-        uint16_t* old = bitmap->scalar;
-        uint32_t alignment = STORM_get_alignment();
-        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
-        memcpy(bitmap->scalar, old, bitmap->n_scalar*sizeof(uint16_t));
-        STORM_aligned_free(old);
-        bitmap->own_scalar = 1;
+int STORM_tuning_save(const STORM_tuning_t* tuning, const char* path) {
+    if (tuning == NULL) return -1;
+    if (path == NULL) return -1;
+
+    // Keep the sections of other machine types.
+    char* kept = NULL;
+    size_t n_kept = 0, m_kept = 0;
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        char line[256];
+        int skip = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            STORM_tuning_t key;
+            if (STORM_tuning_parse_key(line, &key)) skip = STORM_tuning_same_machine(&key, tuning);
+            const size_t len = strlen(line);
+            if (!skip && line[0] != '#') {
+                if (n_kept + len + 1 > m_kept) {
+                    m_kept = (n_kept + len + 1) * 2;
+                    char* old = kept;
+                    kept = (char*)realloc(kept, m_kept);
+                    if (kept == NULL) {
+                        free(old);
+                        fclose(f);
+                        return -3;
+                    }
+                }
+                memcpy(&kept[n_kept], line, len);
+                n_kept += len;
+            }
+            if (skip && strncmp(line, "end", 3) == 0) skip = 0;
+        }
+        fclose(f);
     }
 
-    uint32_t adjust = bitmap->id * STORM_DEFAULT_BLOCK_SIZE;
-    bitmap->n_scalar_set = 1;
+    // Write a temporary file next to the profile and move it into place so
+    // that readers never see a partly written profile.
+    const size_t len = strlen(path);
+    char* tmp_path = (char*)malloc(len + 32);
+    if (tmp_path == NULL) {
+        free(kept);
+        return -3;
+    }
+#if defined(_WIN32)
+    snprintf(tmp_path, len + 32, "%s.tmp.%lu", path, (unsigned long)GetCurrentProcessId());
+#else
+    snprintf(tmp_path, len + 32, "%s.tmp.%lu", path, (unsigned long)getpid());
+#endif
+    f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        free(tmp_path);
+        free(kept);
+        return -2;
+    }
+    int ret = 1;
+    if (fprintf(f, "# STORM tuning profiles: cpuid, L1, L2, L3, cache block size\n# and per width class: log2(words), cache block size, scalar cutoff\n") < 0) ret = -4;
+    if (n_kept && fwrite(kept, 1, n_kept, f) != n_kept) ret = -4;
+    if (fprintf(f, "profile %u %llu %llu %llu %llu\n", tuning->cpuid,
+                (unsigned long long)tuning->l1_size, (unsigned long long)tuning->l2_size,
+                (unsigned long long)tuning->l3_size, (unsigned long long)tuning->cache_block_size) < 0) ret = -4;
+    for (uint32_t c = 0; c < STORM_TUNING_WIDTHS; ++c) {
+        if (fprintf(f, "width %u %llu %u\n", c, (unsigned long long)tuning->block_size[c], tuning->scalar_cutoff[c]) < 0) ret = -4;
+    }
+    if (fprintf(f, "end\n") < 0) ret = -4;
+    if (fclose(f) != 0 && ret == 1) ret = -4;
+#if defined(_WIN32)
+    if (ret == 1 && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) == 0) ret = -4;
+#else
+    if (ret == 1 && rename(tmp_path, path) != 0) ret = -4;
+#endif
+    if (ret != 1) remove(tmp_path);
+    free(tmp_path);
+    free(kept);
+    return ret;
+}
 
-    for (int i = 0; i < n_values; ++i) {
-        assert(adjust <= values[i]);
-        uint32_t v = values[i] - adjust;
-        assert(v < STORM_DEFAULT_BLOCK_SIZE);
+int STORM_tune_profile(const char* path) {
+    if (path == NULL) return -1;
 
-        bitmap->scalar[bitmap->n_scalar] = v;
-        ++bitmap->n_scalar;
-        ++bitmap->n_bits_set;
+    STORM_tuning_t tuning;
+    int ret = STORM_tuning_load(&tuning, path);
+    if (ret == 1) {
+        STORM_set_tuning(&tuning);
+        return 1;
     }
-    return n_values;
+    // Do not overwrite a file we cannot read.
+    if (ret != 0 && ret != -2) return ret;
+
+    ret = STORM_tune(&tuning);
+    if (ret != 1) return ret;
+    STORM_set_tuning(&tuning);
+    return STORM_tuning_save(&tuning, path) == 1 ? 2 : 3;
 }
 
- 
-int STORM_bitmap_clear(STORM_bitmap_t* bitmap) {
-    if (bitmap == NULL) return -1;
-    if (bitmap->data != NULL)
-        memset(bitmap->data, 0, sizeof(uint64_t)*bitmap->n_bitmap);
-    bitmap->n_scalar = 0;
-    bitmap->n_bits_set = 0;
-    bitmap->n_bitmap = 0;
-    return 1;
+typedef struct STORM_tile_s {
+    uint32_t i_start, i_end; // rows [i_start, i_end)
+    uint32_t j_start, j_end; // columns [j_start, j_end)
+    uint32_t diag; // only pairs with j > i are visited
+    uint64_t cost; // estimated work used for load balancing
+} STORM_tile_t;
+
+typedef struct STORM_tile_queue_s {
+    STORM_tile_t** tiles;
+    uint32_t head, tail; // owner pops at head, thieves steal at tail
+    uint64_t load; // total cost assigned to this queue
+    STORM_mutex_t lock;
+} STORM_tile_queue_t;
+
+typedef struct STORM_job_s STORM_job_t;
+typedef struct STORM_worker_s STORM_worker_t;
+
+// Computes every pair in a tile and returns the sum total. If the worker
+// has a counts buffer then the count of each pair (i,j) is additionally
+// stored at counts[(i - i_start) * (j_end - j_start) + (j - j_start)].
+typedef uint64_t (*STORM_tile_func)(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker);
+// Consumes the counts of a finished tile while it is still in cache.
+// Returning non-zero stops the job.
+typedef int (*STORM_tile_visit_func)(const STORM_job_t* job, const STORM_tile_t* tile, const STORM_worker_t* worker);
+// Replaces the pair-count cost of each tile with an estimate of its work.
+typedef void (*STORM_tile_cost_func)(const STORM_job_t* job, STORM_tile_t* tiles, const uint32_t n_tiles);
+
+struct STORM_job_s {
+    const void* left;  // row source
+    const void* right; // column source (same as left for pairwise)
+    STORM_compute_func func;
+    STORM_tile_func kernel;
+    STORM_tile_visit_func visit; // optional
+    void* visit_data;
+    STORM_tile_cost_func cost; // optional
+    const void* cost_data;
+    volatile int abort; // set when a visitor requests the job to stop
+    int error; // set when tiles or worker buffers could not be allocated
+    STORM_tile_queue_t* queues;
+    uint32_t n_queues;
+    uint32_t n_out; // number of elements in each worker scratch buffer
+    uint64_t n_counts; // number of elements in each worker tile buffer
+    uint32_t row_offset, col_offset; // global position of the sources
+};
+
+struct STORM_worker_s {
+    STORM_job_t* job;
+    uint32_t id;
+    uint32_t* out; // scratch for block-id joins
+    uint64_t* counts; // tile of pair counts (only when visiting)
+    uint64_t total; // partial sum
+};
+
+static int STORM_tile_cost_cmp(const void* aa, const void* bb) {
+    const STORM_tile_t* a = (const STORM_tile_t*)aa;
+    const STORM_tile_t* b = (const STORM_tile_t*)bb;
+    return (a->cost < b->cost) - (a->cost > b->cost);
 }
 
+// Upper bound on the number of tile descriptors held in memory at once.
+#ifndef STORM_TILE_BATCH
+#define STORM_TILE_BATCH 65536
+#endif
 
-uint64_t STORM_bitmap_intersect_cardinality(STORM_bitmap_t* STORM_RESTRICT bitmap1, 
-                                          STORM_bitmap_t* STORM_RESTRICT bitmap2)
-{
-    if (bitmap1 == NULL) return 0;
-    if (bitmap2 == NULL) return 0;
+/**
+ * Breaks the upper triangle of an N x N comparison into tiles of
+ * bsize x bsize vectors, restricted to the row panels [panel_begin,
+ * panel_end). The last row and column of tiles may be narrower if bsize
+ * does not divide N. The cost of each tile is initialized to its number
+ * of pairs.
+ */
+static STORM_tile_t* STORM_tiles_triangle(const uint32_t n, const uint32_t bsize, const uint64_t panel_begin, const uint64_t panel_end, uint32_t* n_tiles) {
+    const uint64_t n_blocks = (n + (uint64_t)bsize - 1) / bsize;
+    uint64_t total = 0;
+    for (uint64_t p = panel_begin; p < panel_end; ++p) total += n_blocks - p;
+    *n_tiles = total;
+    if (*n_tiles == 0) return NULL;
+
+    STORM_tile_t* tiles = (STORM_tile_t*)malloc(*n_tiles * sizeof(STORM_tile_t));
+    if (tiles == NULL) return NULL;
+
+    uint32_t t = 0;
+    for (uint32_t i = panel_begin * bsize; i < n && i < panel_end * bsize; i += bsize) {
+        const uint32_t i_end = i + bsize < n ? i + bsize : n;
+        for (uint32_t j = i; j < n; j += bsize, ++t) {
+            const uint32_t j_end = j + bsize < n ? j + bsize : n;
+            tiles[t].i_start = i;
+            tiles[t].i_end   = i_end;
+            tiles[t].j_start = j;
+            tiles[t].j_end   = j_end;
+            tiles[t].diag    = (i == j);
+            const uint64_t rows = i_end - i;
+            tiles[t].cost = tiles[t].diag ? (rows * (rows - 1)) / 2 : rows * (j_end - j);
+        }
+    }
+    assert(t == *n_tiles);
+    return tiles;
+}
 
-    // printf("blocks %u and %u\n",bitmap1->id,bitmap2->id);
+/**
+ * One tile per row i covering the pairs (i, j > i). This mirrors the
+ * unblocked drivers where each row is compared against all later rows.
+ */
+static STORM_tile_t* STORM_tiles_strips(const uint32_t n, uint32_t* n_tiles) {
+    *n_tiles = n > 1 ? n - 1 : 0;
+    if (*n_tiles == 0) return NULL;
+
+    STORM_tile_t* tiles = (STORM_tile_t*)malloc(*n_tiles * sizeof(STORM_tile_t));
+    if (tiles == NULL) return NULL;
+
+    for (uint32_t i = 0; i < *n_tiles; ++i) {
+        tiles[i].i_start = i;
+        tiles[i].i_end   = i + 1;
+        tiles[i].j_start = i;
+        tiles[i].j_end   = n;
+        tiles[i].diag    = 1;
+        tiles[i].cost    = n - i - 1;
+    }
+    return tiles;
+}
 
-    if (bitmap1->id != bitmap2->id) 
-        return 0;
+/**
+ * Retrieve the next tile for a worker: first from its own queue and
+ * otherwise by stealing from the tail of the other queues.
+ */
+static const STORM_tile_t* STORM_tile_next(STORM_job_t* job, const uint32_t id) {
+    STORM_tile_queue_t* q = &job->queues[id];
+    const STORM_tile_t* tile = NULL;
+    if (job->abort) return NULL;
+
+    STORM_mutex_lock(&q->lock);
+    if (q->head < q->tail) tile = q->tiles[q->head++];
+    STORM_mutex_unlock(&q->lock);
+    if (tile != NULL) return tile;
+
+    for (uint32_t k = 1; k < job->n_queues; ++k) {
+        STORM_tile_queue_t* victim = &job->queues[(id + k) % job->n_queues];
+        STORM_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) tile = victim->tiles[--victim->tail];
+        STORM_mutex_unlock(&victim->lock);
+        if (tile != NULL) return tile;
+    }
+    return NULL;
+}
 
-    if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap == 0) {
-        // scalar-scalar comparison
-       return STORM_intersect_vector16_cardinality(bitmap1->scalar, 
-                                                 bitmap2->scalar, 
-                                                 bitmap1->n_scalar, 
-                                                 bitmap2->n_scalar);
-        
-    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap == 0) {
-        // bitmap-scalar comparison
-        uint64_t count = 0;
-        for (uint32_t i = 0; i < bitmap2->n_scalar; ++i) {
-            count += bitmap1->data[bitmap2->scalar[i] / 64] & (1ULL << (bitmap2->scalar[i] % 64)) != 0;
+STORM_THREAD_FUNC(STORM_tile_worker) {
+    STORM_worker_t* worker = (STORM_worker_t*)arg;
+    const STORM_tile_t* tile;
+    while ((tile = STORM_tile_next(worker->job, worker->id)) != NULL) {
+        worker->total += (*worker->job->kernel)(worker->job, tile, worker);
+        if (worker->job->visit != NULL) {
+            if ((*worker->job->visit)(worker->job, tile, worker))
+                worker->job->abort = 1;
         }
-        return count;
+    }
+    return STORM_THREAD_RETURN;
+}
 
-    } else if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap) {
-        // scalar-bitmap comparison
-        uint64_t count = 0;
-        for (uint32_t i = 0; i < bitmap1->n_scalar; ++i) {
-            count += bitmap2->data[bitmap1->scalar[i] / 64] & (1ULL << (bitmap1->scalar[i] % 64)) != 0;
+// Allocates the scratch buffers of a worker. Returns 0 on failure.
+static int STORM_worker_init(STORM_worker_t* worker, STORM_job_t* job, const uint32_t id) {
+    worker->job    = job;
+    worker->id     = id;
+    worker->total  = 0;
+    worker->out    = job->n_out ? (uint32_t*)calloc(job->n_out, sizeof(uint32_t)) : NULL;
+    worker->counts = job->n_counts ? (uint64_t*)malloc(job->n_counts * sizeof(uint64_t)) : NULL;
+    if ((job->n_out && worker->out == NULL) || (job->n_counts && worker->counts == NULL)) {
+        free(worker->out);
+        free(worker->counts);
+        worker->out = NULL;
+        worker->counts = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Runs all tiles on the calling thread when the queues cannot be set up.
+static uint64_t STORM_run_tiles_serial(STORM_job_t* job, const STORM_tile_t* tiles, const uint32_t n_tiles) {
+    STORM_worker_t worker;
+    if (STORM_worker_init(&worker, job, 0) == 0) {
+        job->error = 1;
+        return 0;
+    }
+    for (uint32_t t = 0; t < n_tiles && job->abort == 0; ++t) {
+        worker.total += (*job->kernel)(job, &tiles[t], &worker);
+        if (job->visit != NULL && (*job->visit)(job, &tiles[t], &worker)) job->abort = 1;
+    }
+    free(worker.out);
+    free(worker.counts);
+    return worker.total;
+}
+
+/**
+ * Schedules all tiles over n_threads workers and reduces their partial
+ * sums. Tiles are sorted by descending cost and greedily assigned to the
+ * least loaded queue (longest processing time first). The tiles array is
+ * reordered in place. Workers whose buffers or threads cannot be set up
+ * do not run and their queues are drained by the others; if no worker
+ * can run, job->error is set.
+ */
+static uint64_t STORM_run_tiles(STORM_job_t* job, STORM_tile_t* tiles, const uint32_t n_tiles, uint32_t n_threads) {
+    if (n_tiles == 0) return 0;
+    n_threads = n_threads == 0 ? STORM_get_n_threads() : n_threads;
+    n_threads = n_threads > n_tiles ? n_tiles : n_threads;
+
+    qsort(tiles, n_tiles, sizeof(STORM_tile_t), STORM_tile_cost_cmp);
+
+    job->queues = (STORM_tile_queue_t*)calloc(n_threads, sizeof(STORM_tile_queue_t));
+    STORM_tile_t** slots = (STORM_tile_t**)malloc(n_tiles * sizeof(STORM_tile_t*));
+    uint32_t* owner = (uint32_t*)malloc(n_tiles * sizeof(uint32_t));
+    STORM_worker_t* workers = (STORM_worker_t*)calloc(n_threads, sizeof(STORM_worker_t));
+    STORM_thread_t* threads = (STORM_thread_t*)malloc(n_threads * sizeof(STORM_thread_t));
+    if (job->queues == NULL || slots == NULL || owner == NULL || workers == NULL || threads == NULL) {
+        free(threads);
+        free(workers);
+        free(owner);
+        free(slots);
+        free(job->queues);
+        job->queues = NULL;
+        return STORM_run_tiles_serial(job, tiles, n_tiles);
+    }
+    job->n_queues = n_threads;
+
+    for (uint32_t t = 0; t < n_tiles; ++t) {
+        uint32_t best = 0;
+        for (uint32_t q = 1; q < n_threads; ++q) {
+            if (job->queues[q].load < job->queues[best].load) best = q;
         }
-        return count;
+        owner[t] = best;
+        job->queues[best].load += tiles[t].cost + 1;
+        ++job->queues[best].tail;
+    }
 
-    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap) {
-        // bitmap-bitmap comparison
-        const uint32_t n_bitmaps = ceil(STORM_DEFAULT_BLOCK_SIZE / 64.0);
-        const STORM_compute_func f = STORM_get_intersect_count_func(n_bitmaps);
-        return (*f)(bitmap1->data, bitmap2->data, n_bitmaps);
-    } else {
-        exit(EXIT_FAILURE);
+    for (uint32_t q = 0, offset = 0; q < n_threads; ++q) {
+        job->queues[q].tiles = &slots[offset];
+        offset += job->queues[q].tail;
+        job->queues[q].tail = 0;
+        STORM_mutex_init(&job->queues[q].lock);
     }
 
-    return 0;
+    for (uint32_t t = 0; t < n_tiles; ++t) {
+        STORM_tile_queue_t* q = &job->queues[owner[t]];
+        q->tiles[q->tail++] = &tiles[t];
+    }
+
+    // A worker with a NULL job did not run.
+    for (uint32_t w = 0; w < n_threads; ++w) {
+        if (STORM_worker_init(&workers[w], job, w) == 0) workers[w].job = NULL;
+    }
+
+    // The calling thread acts as worker 0.
+    uint32_t n_running = 0;
+    for (uint32_t w = 1; w < n_threads; ++w) {
+        if (workers[w].job == NULL) continue;
+        if (STORM_thread_create(threads[w], STORM_tile_worker, &workers[w]) != 0) workers[w].job = NULL;
+        else ++n_running;
+    }
+    if (workers[0].job != NULL) {
+        STORM_tile_worker(&workers[0]);
+        ++n_running;
+    }
+
+    uint64_t total = workers[0].total;
+    for (uint32_t w = 1; w < n_threads; ++w) {
+        if (workers[w].job == NULL) continue;
+        STORM_thread_join(threads[w]);
+        total += workers[w].total;
+    }
+    if (n_running == 0) job->error = 1;
+
+    for (uint32_t w = 0; w < n_threads; ++w) {
+        free(workers[w].out);
+        free(workers[w].counts);
+    }
+    for (uint32_t q = 0; q < n_threads; ++q) STORM_mutex_destroy(&job->queues[q].lock);
+    free(threads);
+    free(workers);
+    free(owner);
+    free(slots);
+    free(job->queues);
+    job->queues = NULL;
+    job->n_queues = 0;
+
+    return total;
 }
 
-uint64_t STORM_bitmap_intersect_cardinality_func(STORM_bitmap_t* STORM_RESTRICT bitmap1, 
-                                               STORM_bitmap_t* STORM_RESTRICT bitmap2, 
-                                               const STORM_compute_func func)
-{
-    if (bitmap1 == NULL) return 0;
-    if (bitmap2 == NULL) return 0;
+/**
+ * Runs a job over the upper triangle of an N x N comparison. Tiles are
+ * generated in batches of whole row panels so that at most
+ * STORM_TILE_BATCH descriptors (or one row panel) are held in memory.
+ */
+static uint64_t STORM_run_triangle(STORM_job_t* job, const uint32_t n, uint32_t bsize, const uint32_t n_threads) {
+    bsize = bsize == 0 ? 1 : bsize;
+    const uint64_t n_blocks = (n + (uint64_t)bsize - 1) / bsize;
 
-    if (bitmap1->id != bitmap2->id) 
-        return 0;
+    uint64_t total = 0;
+    uint64_t begin = 0;
+    while (begin < n_blocks && job->abort == 0 && job->error == 0) {
+        uint64_t end = begin + 1;
+        uint64_t batch = n_blocks - begin;
+        while (end < n_blocks && batch + (n_blocks - end) <= STORM_TILE_BATCH) {
+            batch += n_blocks - end;
+            ++end;
+        }
 
-    if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap == 0) {
-        // scalar-scalar comparison
-        return STORM_intersect_vector16_cardinality(bitmap1->scalar, bitmap2->scalar, bitmap1->n_scalar, bitmap2->n_scalar);
-        
-    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap == 0) {
-        // bitmap-scalar comparison
-        uint64_t count = 0;
-        for (uint32_t i = 0; i < bitmap2->n_scalar; ++i) {
-            count += bitmap1->data[bitmap2->scalar[i] / 64] & (1ULL << (bitmap2->scalar[i] % 64)) != 0;
+        uint32_t n_tiles = 0;
+        STORM_tile_t* tiles = STORM_tiles_triangle(n, bsize, begin, end, &n_tiles);
+        if (tiles == NULL) {
+            job->error = n_tiles != 0;
+            break;
         }
-        return count;
+        if (job->cost != NULL) (*job->cost)(job, tiles, n_tiles);
+        total += STORM_run_tiles(job, tiles, n_tiles, n_threads);
+        free(tiles);
+        begin = end;
+    }
 
-    } else if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap) {
-        // scalar-bitmap comparison
-        uint64_t count = 0;
-        for (uint32_t i = 0; i < bitmap1->n_scalar; ++i) {
-            count += bitmap2->data[bitmap1->scalar[i] / 64] & (1ULL << (bitmap1->scalar[i] % 64)) != 0;
+    return job->error ? (uint64_t)-1 : total;
+}
+
+/**
+ * Breaks the rows [row_begin, row_end) of an n_rows x n_cols rectangular
+ * comparison into tiles of bsize x bsize vectors.
+ */
+static STORM_tile_t* STORM_tiles_rect(const uint32_t n_cols, const uint32_t bsize, const uint32_t row_begin, const uint32_t row_end, uint32_t* n_tiles) {
+    const uint64_t n_row_blocks = (row_end - row_begin + (uint64_t)bsize - 1) / bsize;
+    const uint64_t n_col_blocks = (n_cols + (uint64_t)bsize - 1) / bsize;
+    *n_tiles = n_row_blocks * n_col_blocks;
+    if (*n_tiles == 0) return NULL;
+
+    STORM_tile_t* tiles = (STORM_tile_t*)malloc(*n_tiles * sizeof(STORM_tile_t));
+    if (tiles == NULL) return NULL;
+
+    uint32_t t = 0;
+    for (uint32_t i = row_begin; i < row_end; i += bsize) {
+        const uint32_t i_end = i + bsize < row_end ? i + bsize : row_end;
+        for (uint32_t j = 0; j < n_cols; j += bsize, ++t) {
+            const uint32_t j_end = j + bsize < n_cols ? j + bsize : n_cols;
+            tiles[t].i_start = i;
+            tiles[t].i_end   = i_end;
+            tiles[t].j_start = j;
+            tiles[t].j_end   = j_end;
+            tiles[t].diag    = 0;
+            tiles[t].cost    = (uint64_t)(i_end - i) * (j_end - j);
         }
-        return count;
+    }
+    assert(t == *n_tiles);
+    return tiles;
+}
 
-    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap) {
-        // bitmap-bitmap comparison
-        return (*func)(bitmap1->data, bitmap2->data, bitmap1->n_bitmap);
-    } else {
-        exit(EXIT_FAILURE);
+// Runs a job over all n_rows x n_cols pairs of two distinct sources.
+static uint64_t STORM_run_rect(STORM_job_t* job, const uint32_t n_rows, const uint32_t n_cols, uint32_t bsize, const uint32_t n_threads) {
+    bsize = bsize == 0 ? 1 : bsize;
+    const uint64_t n_col_blocks = (n_cols + (uint64_t)bsize - 1) / bsize;
+    uint64_t rows_per_batch = n_col_blocks == 0 ? n_rows : (STORM_TILE_BATCH / n_col_blocks) * bsize;
+    rows_per_batch = rows_per_batch < bsize ? bsize : rows_per_batch;
+
+    uint64_t total = 0;
+    for (uint64_t begin = 0; begin < n_rows && job->abort == 0 && job->error == 0; begin += rows_per_batch) {
+        const uint32_t end = begin + rows_per_batch < n_rows ? begin + rows_per_batch : n_rows;
+        uint32_t n_tiles = 0;
+        STORM_tile_t* tiles = STORM_tiles_rect(n_cols, bsize, begin, end, &n_tiles);
+        if (tiles == NULL) {
+            job->error = n_tiles != 0;
+            break;
+        }
+        if (job->cost != NULL) (*job->cost)(job, tiles, n_tiles);
+        total += STORM_run_tiles(job, tiles, n_tiles, n_threads);
+        free(tiles);
     }
 
-    return 0;
+    return job->error ? (uint64_t)-1 : total;
 }
 
-// container
-STORM_bitmap_cont_t* STORM_bitmap_cont_new() {
-    STORM_bitmap_cont_t* all = (STORM_bitmap_cont_t*)malloc(sizeof(STORM_bitmap_cont_t));
-    if (all == NULL) return NULL;
-    all->bitmaps   = NULL;
-    all->block_ids = NULL;
-    all->n_bitmaps = 0;
-    all->m_bitmaps = 0;
-    all->prev_inserted_value = 0;
-    return all;
+/* *************************************
+*  Result matrix
+***************************************/
+
+uint32_t STORM_result_width(const uint64_t max_count) {
+    if (max_count <= UINT16_MAX) return sizeof(uint16_t);
+    if (max_count <= UINT32_MAX) return sizeof(uint32_t);
+    return sizeof(uint64_t);
 }
 
-void STORM_bitmap_cont_init(STORM_bitmap_cont_t* bitmap) {
-    if (bitmap == NULL) return;
-    bitmap->bitmaps   = NULL;
-    bitmap->block_ids = NULL;
-    bitmap->n_bitmaps = 0;
-    bitmap->m_bitmaps = 0;
-    bitmap->prev_inserted_value = 0;
+uint64_t STORM_result_size(const uint32_t n_vectors, const uint32_t width, const uint32_t layout) {
+    const uint64_t n = n_vectors;
+    if (layout == STORM_LAYOUT_PACKED) return ((n * (n + 1)) / 2) * width;
+    return n * n * width;
 }
 
-void STORM_bitmap_cont_free(STORM_bitmap_cont_t* bitmap) {
-    if (bitmap == NULL) return;
-    if (bitmap->bitmaps != NULL) {
-        // for (uint32_t i = 0; i < bitmap->n_bitmaps; ++i) {
-        //     STORM_bitmap_free(&bitmap->bitmaps[i]);
-        // }
-        free(bitmap->bitmaps);
-    }
-    free(bitmap->block_ids);
-    free(bitmap);
+int STORM_result_matrix_init(STORM_result_matrix_t* matrix, void* data, const uint32_t n_vectors, const uint64_t max_count, const uint32_t layout) {
+    if (matrix == NULL) return -1;
+    if (data == NULL) return -2;
+    if (layout != STORM_LAYOUT_PACKED && layout != STORM_LAYOUT_FULL) return -3;
+
+    matrix->data   = data;
+    matrix->n_rows = n_vectors;
+    matrix->n_cols = n_vectors;
+    matrix->ld     = n_vectors;
+    matrix->width  = STORM_result_width(max_count);
+    matrix->layout = layout;
+    return 1;
 }
 
+int STORM_result_matrix_init_rect(STORM_result_matrix_t* matrix, void* data, const uint32_t n_rows, const uint32_t n_cols, const uint64_t max_count) {
+    if (matrix == NULL) return -1;
+    if (data == NULL) return -2;
 
-int STORM_bitmap_cont_add(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values) {
-    if (bitmap == NULL) return -1;
-    if (values == NULL) return -2;
-    if (n_values == 0)  return 0; 
+    matrix->data   = data;
+    matrix->n_rows = n_rows;
+    matrix->n_cols = n_cols;
+    matrix->ld     = n_cols;
+    matrix->width  = STORM_result_width(max_count);
+    matrix->layout = STORM_LAYOUT_FULL;
+    return 1;
+}
 
-    if (bitmap->bitmaps == NULL) {
-        bitmap->m_bitmaps = 2;
-        bitmap->bitmaps = (STORM_bitmap_t*)malloc(sizeof(STORM_bitmap_t) * bitmap->m_bitmaps);
-        for (int i = 0; i < bitmap->m_bitmaps; ++i) {
-            STORM_bitmap_init(&bitmap->bitmaps[i]);
-        }
+// Offset of cell (i,j) with i <= j in the packed layout. Packing is by
+// column (LAPACK 'U' order) so that appending vectors only appends cells.
+#define STORM_PACKED_OFFSET(i, j) (((uint64_t)(j) * ((j) + 1)) / 2 + (i))
+
+static void STORM_result_set(const STORM_result_matrix_t* matrix, const uint64_t offset, const uint64_t value) {
+    switch (matrix->width) {
+    case 2: ((uint16_t*)matrix->data)[offset] = value; break;
+    case 4: ((uint32_t*)matrix->data)[offset] = value; break;
+    default: ((uint64_t*)matrix->data)[offset] = value; break;
     }
+}
 
-    if (bitmap->block_ids == NULL) {
-        bitmap->block_ids = (uint32_t*)malloc(sizeof(uint32_t) * bitmap->m_bitmaps);
+static uint64_t STORM_result_get(const STORM_result_matrix_t* matrix, const uint64_t offset) {
+    switch (matrix->width) {
+    case 2: return ((const uint16_t*)matrix->data)[offset];
+    case 4: return ((const uint32_t*)matrix->data)[offset];
+    default: return ((const uint64_t*)matrix->data)[offset];
     }
+}
 
-    // Input data must be guaranteed to be in sorted order.
-    uint32_t start = 0, stop = 0;
-    uint32_t target_block = values[0] / STORM_DEFAULT_BLOCK_SIZE;
+// Offset of cell (i,j) in either layout.
+static uint64_t STORM_result_offset(const STORM_result_matrix_t* matrix, const uint32_t i, const uint32_t j) {
+    if (matrix->layout == STORM_LAYOUT_PACKED) return i <= j ? STORM_PACKED_OFFSET(i, j) : STORM_PACKED_OFFSET(j, i);
+    return (uint64_t)i * matrix->ld + j;
+}
 
-    while (stop < n_values) {
-        // printf("1: %u,%u/%u with %u,%u\n",start,stop,n_values,values[start],values[stop]);
-        for (/**/; stop < n_values; ++stop) {
-             if ((values[stop] / STORM_DEFAULT_BLOCK_SIZE) != target_block) {
-                //  printf("start,stop: %u->%u/%u. block %u->%u\n",start,stop,n_values,target_block,values[stop] / STORM_DEFAULT_BLOCK_SIZE);
-                 break;
-             }
+/**
+ * Writes a finished tile into the result matrix. The tile is emitted in
+ * the order of the destination memory: each destination row (full layout)
+ * or column (packed layout) receives one contiguous run of cells per tile,
+ * so results stream out without evicting the operands of the next tile.
+ * Mirrored cells of the full layout are written in a second pass over the
+ * transposed tile. Tile positions are relative to the row and column
+ * offsets of the job; tiles below the diagonal (incremental updates) are
+ * stored transposed in the packed layout.
+ */
+static void STORM_result_store_tile(const STORM_result_matrix_t* matrix, const STORM_tile_t* tile, const uint64_t* counts, const uint32_t symmetric, const uint32_t row_offset, const uint32_t col_offset) {
+    const uint32_t ld = tile->j_end - tile->j_start;
+
+    if (matrix->layout == STORM_LAYOUT_PACKED) {
+        if (row_offset > col_offset) {
+            // Global row > column: row i holds the cells (j, i) contiguously.
+            for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+                const uint64_t base = STORM_PACKED_OFFSET(0, row_offset + i) + col_offset;
+                for (uint32_t j = tile->j_start; j < tile->j_end; ++j) {
+                    STORM_result_set(matrix, base + j, counts[(i - tile->i_start) * ld + (j - tile->j_start)]);
+                }
+            }
+            return;
         }
-        // printf("2: %u,%u/%u with %u,%u\n",start,stop,n_values,values[start],values[stop]);
-        // const uint32_t debug = target_block;
-        const uint32_t new_block = values[stop] / STORM_DEFAULT_BLOCK_SIZE;
-
-        // Resize if required.
-        // printf("bitmaps: %u/%u\n",bitmap->n_bitmaps,bitmap->m_bitmaps);
-        if (bitmap->n_bitmaps == bitmap->m_bitmaps) {
-            // printf("Resizing container %u->%u\n", bitmap->m_bitmaps, bitmap->m_bitmaps+8);
-            uint32_t old_m = bitmap->m_bitmaps;
-            bitmap->m_bitmaps += 8;
-            bitmap->bitmaps = (STORM_bitmap_t*)realloc(bitmap->bitmaps, sizeof(STORM_bitmap_t) * bitmap->m_bitmaps);
-            for (int i = old_m; i < bitmap->m_bitmaps; ++i) {
-                STORM_bitmap_init(&bitmap->bitmaps[i]);
+        // Column j holds rows i <= j contiguously.
+        for (uint32_t j = tile->j_start; j < tile->j_end; ++j) {
+            const uint32_t i_end = tile->diag ? j : tile->i_end;
+            const uint64_t base  = STORM_PACKED_OFFSET(0, col_offset + j) + row_offset;
+            for (uint32_t i = tile->i_start; i < i_end; ++i) {
+                STORM_result_set(matrix, base + i, counts[(i - tile->i_start) * ld + (j - tile->j_start)]);
             }
-            bitmap->block_ids = (uint32_t*)realloc(bitmap->block_ids, sizeof(uint32_t) * bitmap->m_bitmaps);
         }
-        // printf("Adding new bitmap for value %u to %u\n", values[i], target_block);
+        return;
+    }
 
-        assert(stop != start);
-        assert(stop - start > 0);
-        STORM_bitmap_t* x = (STORM_bitmap_t*)&bitmap->bitmaps[bitmap->n_bitmaps];
-        x->id = target_block;
-        bitmap->block_ids[bitmap->n_bitmaps] = target_block;
+    for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+        const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+        const uint64_t base = (uint64_t)(row_offset + i) * matrix->ld + col_offset;
+        for (uint32_t j = j_start; j < tile->j_end; ++j) {
+            STORM_result_set(matrix, base + j, counts[(i - tile->i_start) * ld + (j - tile->j_start)]);
+        }
+    }
 
-        if (stop - start < STORM_DEFAULT_SCALAR_THRESHOLD) {
-            STORM_bitmap_add_scalar_only(x, &values[start], stop - start);
-        } else {
-            STORM_bitmap_add(x, &values[start], stop - start);
+    if (symmetric == 0) return;
+    for (uint32_t j = tile->j_start; j < tile->j_end; ++j) {
+        const uint32_t i_end = tile->diag ? j : tile->i_end;
+        const uint64_t base = (uint64_t)(col_offset + j) * matrix->ld + row_offset;
+        for (uint32_t i = tile->i_start; i < i_end; ++i) {
+            STORM_result_set(matrix, base + i, counts[(i - tile->i_start) * ld + (j - tile->j_start)]);
+        }
+    }
+}
+
+static int STORM_tile_visit_matrix(const STORM_job_t* job, const STORM_tile_t* tile, const STORM_worker_t* worker) {
+    STORM_result_store_tile((const STORM_result_matrix_t*)job->visit_data, tile, worker->counts, 1, job->row_offset, job->col_offset);
+    return 0;
+}
+
+// Rectangular A x B results have no mirrored cells.
+static int STORM_tile_visit_matrix_rect(const STORM_job_t* job, const STORM_tile_t* tile, const STORM_worker_t* worker) {
+    STORM_result_store_tile((const STORM_result_matrix_t*)job->visit_data, tile, worker->counts, 0, job->row_offset, job->col_offset);
+    return 0;
+}
+
+// Writes the diagonal |Xi| of XX^T.
+static void STORM_result_store_diagonal(const STORM_result_matrix_t* matrix, const uint32_t i, const uint64_t value) {
+    if (matrix->layout == STORM_LAYOUT_PACKED) STORM_result_set(matrix, STORM_PACKED_OFFSET(i, i), value);
+    else STORM_result_set(matrix, (uint64_t)i * matrix->ld + i, value);
+}
+
+/**
+ * Side of the tiles of a job that keeps per-tile counts. Each worker holds
+ * a side x side buffer of counts, so the side is capped by the number of
+ * vectors n and by an eighth of the L2 cache (STORM_CACHE_BLOCK_SIZE if
+ * no profile is active) rather than following the tile guess, which can
+ * run into the thousands for sparse vectors.
+ */
+static uint32_t STORM_counts_bsize(uint32_t bsize, const uint32_t n) {
+    const uint64_t l2_size = STORM_tuning_ready && STORM_tuning_active.l2_size ? STORM_tuning_active.l2_size : STORM_CACHE_BLOCK_SIZE;
+    const uint32_t max_side = sqrt((double)(l2_size / 8) / sizeof(uint64_t));
+    bsize = bsize > max_side ? max_side : bsize;
+    bsize = bsize > n && n != 0 ? n : bsize;
+    return bsize == 0 ? 1 : bsize;
+}
+
+// Prepares a job for writing into a result matrix. Returns the tile side
+// to run the job with (see STORM_counts_bsize).
+static uint32_t STORM_job_set_matrix(STORM_job_t* job, STORM_result_matrix_t* matrix, uint32_t bsize, const uint32_t n) {
+    bsize = STORM_counts_bsize(bsize, n);
+    job->visit      = &STORM_tile_visit_matrix;
+    job->visit_data = matrix;
+    job->n_counts   = (uint64_t)bsize * bsize;
+    return bsize;
+}
+
+static uint32_t STORM_job_set_matrix_rect(STORM_job_t* job, STORM_result_matrix_t* matrix, uint32_t bsize, const uint32_t n) {
+    bsize = STORM_counts_bsize(bsize, n);
+    job->visit      = &STORM_tile_visit_matrix_rect;
+    job->visit_data = matrix;
+    job->n_counts   = (uint64_t)bsize * bsize;
+    return bsize;
+}
+
+int STORM_incremental_init(STORM_incremental_t* inc, STORM_result_matrix_t* out) {
+    if (inc == NULL) return -1;
+    if (out != NULL && out->n_rows != out->n_cols) return -2;
+    inc->total     = 0;
+    inc->n_vectors = 0;
+    inc->out       = out;
+    return 1;
+}
+
+// Sum of the off-diagonal cells of row k over the first n vectors.
+static uint64_t STORM_result_row_sum(const STORM_result_matrix_t* matrix, const uint32_t k, const uint32_t n) {
+    uint64_t total = 0;
+    for (uint32_t j = 0; j < n; ++j) {
+        if (j != k) total += STORM_result_get(matrix, STORM_result_offset(matrix, k, j));
+    }
+    return total;
+}
+
+// Moves the row and column of vector last into position k.
+static void STORM_result_move(const STORM_result_matrix_t* matrix, const uint32_t k, const uint32_t last) {
+    for (uint32_t j = 0; j < last; ++j) {
+        if (j == k) continue;
+        const uint64_t value = STORM_result_get(matrix, STORM_result_offset(matrix, last, j));
+        STORM_result_set(matrix, STORM_result_offset(matrix, k, j), value);
+        if (matrix->layout == STORM_LAYOUT_FULL) STORM_result_set(matrix, STORM_result_offset(matrix, j, k), value);
+    }
+    STORM_result_set(matrix, STORM_result_offset(matrix, k, k), STORM_result_get(matrix, STORM_result_offset(matrix, last, last)));
+}
+
+/* *************************************
+*  Tile visitor
+***************************************/
+
+typedef struct STORM_visitor_s {
+    STORM_tile_callback callback;
+    void* user_data;
+} STORM_visitor_t;
+
+static int STORM_tile_visit_callback(const STORM_job_t* job, const STORM_tile_t* tile, const STORM_worker_t* worker) {
+    const STORM_visitor_t* visitor = (const STORM_visitor_t*)job->visit_data;
+    STORM_tile_result_t result;
+    result.counts     = worker->counts;
+    result.row_offset = job->row_offset + tile->i_start;
+    result.col_offset = job->col_offset + tile->j_start;
+    result.n_rows     = tile->i_end - tile->i_start;
+    result.n_cols     = tile->j_end - tile->j_start;
+    result.diag       = tile->diag;
+    result.thread_id  = worker->id;
+    return (*visitor->callback)(&result, visitor->user_data);
+}
+
+// Prepares a job for streaming tiles to a user callback. Returns the tile
+// side to run the job with (see STORM_counts_bsize).
+static uint32_t STORM_job_set_callback(STORM_job_t* job, STORM_visitor_t* visitor, uint32_t bsize, const uint32_t n) {
+    bsize = STORM_counts_bsize(bsize, n);
+    job->visit      = &STORM_tile_visit_callback;
+    job->visit_data = visitor;
+    job->n_counts   = (uint64_t)bsize * bsize;
+    return bsize;
+}
+
+// Raw contiguous input for the STORM_wrapper_diag* family.
+typedef struct STORM_raw_s {
+    const uint64_t* vals;
+    uint32_t n_ints;
+    const uint32_t* n_alts; // optional
+    const uint32_t* alt_positions;
+    const uint32_t* alt_offsets;
+    STORM_compute_lfunc fl;
+    uint32_t cutoff;
+} STORM_raw_t;
+
+static uint64_t STORM_tile_kernel_raw(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_raw_t* raw = (const STORM_raw_t*)job->left;
+    const uint64_t n_ints = raw->n_ints;
+    uint64_t* counts = worker->counts;
+    const uint32_t ld = tile->j_end - tile->j_start;
+    // List pairs are counted in a single pass.
+    const uint32_t panel = raw->n_alts != NULL ? n_ints : STORM_word_panel(n_ints, (tile->i_end - tile->i_start) + ld);
+
+    uint64_t count = 0;
+    for (uint32_t k = 0; k < n_ints; k += panel) {
+        const uint32_t n = n_ints - k < panel ? n_ints - k : panel;
+        for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+            const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+            for (uint32_t j = j_start; j < tile->j_end; ++j) {
+                uint64_t c;
+                if (raw->n_alts != NULL && (raw->n_alts[i] < raw->cutoff || raw->n_alts[j] < raw->cutoff)) {
+                    c = (*raw->fl)(&raw->vals[i*n_ints], &raw->vals[j*n_ints], 
+                        &raw->alt_positions[raw->alt_offsets[i]], &raw->alt_positions[raw->alt_offsets[j]], 
+                        raw->n_alts[i], raw->n_alts[j]);
+                } else {
+                    c = (*job->func)(&raw->vals[i*n_ints + k], &raw->vals[j*n_ints + k], n);
+                }
+                count += c;
+                if (counts != NULL) {
+                    uint64_t* dst = &counts[(i - tile->i_start) * ld + (j - tile->j_start)];
+                    *dst = (k == 0 ? 0 : *dst) + c;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+static uint64_t STORM_wrapper_engine(const uint32_t n_vectors, const STORM_raw_t* raw, const STORM_compute_func f, uint32_t block_size, STORM_result_matrix_t* out, const uint32_t n_threads) {
+    if (raw->vals == NULL || f == NULL) return -1;
+    if (raw->n_alts != NULL && (raw->fl == NULL || raw->alt_positions == NULL || raw->alt_offsets == NULL)) return -1;
+    if (out == NULL) return -2;
+    if (out->n_rows < n_vectors) return -3;
+
+    if (block_size == 0) block_size = STORM_get_cache_block_size(raw->n_ints) / ((raw->n_ints ? raw->n_ints : 1) * sizeof(uint64_t));
+    block_size = block_size < 5 ? 5 : block_size;
+
+    for (uint32_t i = 0; i < n_vectors; ++i) {
+        const uint64_t* v = &raw->vals[(uint64_t)i*raw->n_ints];
+        STORM_result_store_diagonal(out, i, (*f)(v, v, raw->n_ints));
+    }
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    job.left   = raw;
+    job.right  = raw;
+    job.func   = f;
+    job.kernel = &STORM_tile_kernel_raw;
+    block_size = STORM_job_set_matrix(&job, out, block_size, n_vectors);
+
+    return STORM_run_triangle(&job, n_vectors, block_size, n_threads);
+}
+
+uint64_t STORM_wrapper_diag_matrix(const uint32_t n_vectors, 
+                                   const uint64_t* vals, 
+                                   const uint32_t n_ints, 
+                                   const STORM_compute_func f,
+                                   uint32_t block_size,
+                                   STORM_result_matrix_t* out,
+                                   const uint32_t n_threads)
+{
+    STORM_raw_t raw;
+    memset(&raw, 0, sizeof(STORM_raw_t));
+    raw.vals   = vals;
+    raw.n_ints = n_ints;
+    return STORM_wrapper_engine(n_vectors, &raw, f, block_size, out, n_threads);
+}
+
+uint64_t STORM_wrapper_diag_list_matrix(const uint32_t n_vectors, 
+                                        const uint64_t* STORM_RESTRICT vals,
+                                        const uint32_t n_ints,
+                                        const uint32_t* STORM_RESTRICT n_alts,
+                                        const uint32_t* STORM_RESTRICT alt_positions,
+                                        const uint32_t* STORM_RESTRICT alt_offsets, 
+                                        const STORM_compute_func f, 
+                                        const STORM_compute_lfunc fl, 
+                                        const uint32_t cutoff,
+                                        uint32_t block_size,
+                                        STORM_result_matrix_t* out,
+                                        const uint32_t n_threads)
+{
+    STORM_raw_t raw;
+    raw.vals          = vals;
+    raw.n_ints        = n_ints;
+    raw.n_alts        = n_alts;
+    raw.alt_positions = alt_positions;
+    raw.alt_offsets   = alt_offsets;
+    raw.fl            = fl;
+    raw.cutoff        = cutoff;
+    return STORM_wrapper_engine(n_vectors, &raw, f, block_size, out, n_threads);
+}
+
+//
+ 
+uint32_t STORM_bitmap_serialized_size(STORM_bitmap_t* bitmap) {
+    uint32_t total = 0;
+    total += sizeof(uint64_t) * bitmap->n_bitmap;
+    if (bitmap->n_scalar_set) {
+        total += sizeof(uint16_t) * bitmap->n_scalar;
+    }
+    total += 2*sizeof(uint16_t) * bitmap->n_runs;
+    total += 4*sizeof(uint32_t);
+    return total;
+}
+
+ 
+uint32_t STORM_bitmap_cont_serialized_size(STORM_bitmap_cont_t* bitmap) {
+    uint32_t total = 0;
+    if (bitmap->bitmaps != NULL) {
+        for (int i = 0; i < bitmap->n_bitmaps; ++i) {
+            STORM_bitmap_t* x = (STORM_bitmap_t*)&bitmap->bitmaps[i];
+            total += STORM_bitmap_serialized_size(x);
         }
+    }
+    total += sizeof(uint32_t) * bitmap->n_bitmaps;
+    total += 3*sizeof(uint32_t);
+    return total;
+}
+
+//
+
+STORM_bitmap_t* STORM_bitmap_new() {
+    STORM_bitmap_t* all = (STORM_bitmap_t*)malloc(sizeof(STORM_bitmap_t));
+    if (all == NULL) return NULL;
+    uint32_t alignment = STORM_get_alignment();
+    all->data = NULL;
+    all->scalar = NULL;
+    all->n_bitmap = 0;
+    all->own_data = 1;
+    all->own_scalar = 1;
+    all->n_scalar = 0;
+    all->n_scalar_set = 0;
+    all->n_missing = 0;
+    all->m_scalar = 0;
+    all->n_runs = 0;
+    all->id = 0;
+    all->block_size = STORM_DEFAULT_BLOCK_SIZE;
+    all->n_bits_set = 0;
+    return all;
+}
+
+
+void STORM_bitmap_init(STORM_bitmap_t* all) {
+    all->data = NULL;
+    all->scalar = NULL;
+    all->n_bitmap = 0;
+    all->own_data = 1;
+    all->own_scalar = 1;
+    all->n_scalar = 0;
+    all->n_scalar_set = 0;
+    all->n_missing = 0;
+    all->m_scalar = 0;
+    all->n_runs = 0;
+    all->id = 0;
+    all->block_size = STORM_DEFAULT_BLOCK_SIZE;
+    all->n_bits_set = 0;    
+}
+
+
+void STORM_bitmap_free(STORM_bitmap_t* bitmap) {
+    if (bitmap == NULL) return;
+    if (bitmap->own_data) STORM_aligned_free(bitmap->data);
+    if (bitmap->own_scalar) STORM_aligned_free(bitmap->scalar);
+    free(bitmap);
+}
+
+ 
+int STORM_bitmap_add(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -2;
+    if (n_values == 0)  return -3;
+
+    uint32_t adjust = bitmap->id * bitmap->block_size;
+
+    if (bitmap->data == NULL) {
+        uint32_t n_bitmap = bitmap->block_size / 64;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->data = (uint64_t*)STORM_aligned_malloc(alignment, n_bitmap*sizeof(uint64_t));
+        memset(bitmap->data, 0, n_bitmap*sizeof(uint64_t));
+    }
+    bitmap->n_bitmap = bitmap->block_size / 64;
+
+    for (int i = 0; i < n_values; ++i) {
+        assert(adjust <= values[i]);
+        uint32_t v = values[i] - adjust;
+        assert(v < bitmap->block_size);
+        bitmap->n_bits_set += (bitmap->data[v / 64] & 1ULL << (v % 64)) == 0;
+        bitmap->data[v / 64] |= 1ULL << (v % 64);
+    }
+    return n_values;
+}
+
+ 
+int STORM_bitmap_add_with_scalar(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -3;
+    if (n_values == 0) return -4;
+
+    if (bitmap->data == NULL) {
+        uint32_t n_bitmap = bitmap->block_size / 64;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->data = (uint64_t*)STORM_aligned_malloc(alignment, n_bitmap*sizeof(uint64_t));
+        memset(bitmap->data, 0, n_bitmap*sizeof(uint64_t));
+    }
+    
+    if (bitmap->scalar == NULL) {
+        uint32_t new_m = 256 < n_values ? n_values + 256 : 256;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
+        bitmap->m_scalar = new_m;
+        bitmap->own_scalar = 1;
+    }
+
+    if (bitmap->n_scalar + n_values > bitmap->m_scalar) {
+        uint32_t new_m = bitmap->n_scalar + n_values + 1024;
+        bitmap->m_scalar = new_m;
+        uint16_t* old = bitmap->scalar;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
+        memcpy(bitmap->scalar, old, bitmap->n_scalar*sizeof(uint16_t));
+        if (bitmap->own_scalar) STORM_aligned_free(old);
+        bitmap->own_scalar = 1;
+    }
+    bitmap->n_bitmap = bitmap->block_size / 64;
+
+    uint32_t adjust = bitmap->id * bitmap->block_size;
+    bitmap->n_scalar_set = 1;
+
+    for (int i = 0; i < n_values; ++i) {
+        assert(adjust <= values[i]);
+        uint32_t v = values[i] - adjust;
+        assert(v < bitmap->block_size);
         
-        ++bitmap->n_bitmaps;
-        bitmap->prev_inserted_value = values[stop-1];
-        target_block = new_block;
-        start = stop;
-    }    
+        int is_unique = (bitmap->data[v / 64] & 1ULL << (v % 64)) == 0;
+        bitmap->data[v / 64] |= 1ULL << (v % 64);
+    
+        if (is_unique) {
+            bitmap->scalar[bitmap->n_scalar] = v;
+            ++bitmap->n_scalar;
+            ++bitmap->n_bits_set;
+        }
+    }
+    return n_values;
+}
+
+
+int STORM_bitmap_add_scalar_only(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -3;
+    if (n_values == 0) return -4;
+
+    if (bitmap->scalar == NULL) {
+        uint32_t new_m = 256 < n_values ? n_values + 256 : 256;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
+        bitmap->m_scalar = new_m;
+        bitmap->own_scalar = 1;
+    }
+
+    if (bitmap->n_scalar + n_values > bitmap->m_scalar) {
+        uint32_t new_m = bitmap->n_scalar + n_values + 1024;
+        bitmap->m_scalar = new_m;
+        uint16_t* old = bitmap->scalar;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
+        memcpy(bitmap->scalar, old, bitmap->n_scalar*sizeof(uint16_t));
+        if (bitmap->own_scalar) STORM_aligned_free(old);
+        bitmap->own_scalar = 1;
+    }
+
+    uint32_t adjust = bitmap->id * bitmap->block_size;
+    bitmap->n_scalar_set = 1;
+
+    for (int i = 0; i < n_values; ++i) {
+        assert(adjust <= values[i]);
+        uint32_t v = values[i] - adjust;
+        assert(v < bitmap->block_size);
+
+        bitmap->scalar[bitmap->n_scalar] = v;
+        ++bitmap->n_scalar;
+        ++bitmap->n_bits_set;
+    }
+    return n_values;
+}
+
+ 
+// Number of runs of consecutive integers in a sorted array.
+static uint32_t STORM_count_runs(const uint32_t* values, const uint32_t n_values) {
+    uint32_t n_runs = n_values != 0;
+    for (uint32_t i = 1; i < n_values; ++i) {
+        n_runs += values[i] > values[i-1] + 1;
+    }
+    return n_runs;
+}
+
+int STORM_bitmap_add_runs(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -3;
+    if (n_values == 0) return -4;
+    if (bitmap->n_bitmap || bitmap->n_scalar) return -5;
+
+    const uint32_t new_m = 2*(bitmap->n_runs + STORM_count_runs(values, n_values));
+    if (new_m > bitmap->m_scalar) {
+        uint16_t* old = bitmap->scalar;
+        uint32_t alignment = STORM_get_alignment();
+        bitmap->scalar = (uint16_t*)STORM_aligned_malloc(alignment, new_m*sizeof(uint16_t));
+        if (old != NULL) memcpy(bitmap->scalar, old, 2*bitmap->n_runs*sizeof(uint16_t));
+        if (bitmap->own_scalar) STORM_aligned_free(old);
+        bitmap->m_scalar = new_m;
+        bitmap->own_scalar = 1;
+    }
+
+    uint32_t adjust = bitmap->id * bitmap->block_size;
+    uint16_t* runs = bitmap->scalar;
+
+    for (uint32_t i = 0; i < n_values; ++i) {
+        assert(adjust <= values[i]);
+        uint32_t v = values[i] - adjust;
+        assert(v < bitmap->block_size);
+
+        if (bitmap->n_runs) {
+            const uint32_t end = runs[2*bitmap->n_runs - 2] + runs[2*bitmap->n_runs - 1];
+            assert(v >= end);
+            if (v == end) continue; // duplicate
+            if (v == end + 1) {
+                ++runs[2*bitmap->n_runs - 1];
+                ++bitmap->n_bits_set;
+                continue;
+            }
+        }
+        runs[2*bitmap->n_runs + 0] = v;
+        runs[2*bitmap->n_runs + 1] = 0;
+        ++bitmap->n_runs;
+        ++bitmap->n_bits_set;
+    }
+    return n_values;
+}
+
+int STORM_bitmap_clear(STORM_bitmap_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    if (bitmap->own_data == 0) {
+        // Borrowed (e.g. memory-mapped) data is read-only: detach from it.
+        bitmap->data = NULL;
+        bitmap->own_data = 1;
+    } else if (bitmap->data != NULL)
+        memset(bitmap->data, 0, sizeof(uint64_t)*bitmap->n_bitmap);
+    if (bitmap->own_scalar == 0) {
+        bitmap->scalar = NULL;
+        bitmap->m_scalar = 0;
+        bitmap->own_scalar = 1;
+    }
+    bitmap->n_scalar_set = 0;
+    bitmap->n_runs = 0;
+    bitmap->n_scalar = 0;
+    bitmap->n_bits_set = 0;
+    bitmap->n_bitmap = 0;
+    return 1;
+}
+
+
+// Number of set bits in positions [start, end] of a dense block.
+static uint64_t STORM_popcount_range(const uint64_t* data, const uint32_t start, const uint32_t end) {
+    const uint32_t first = start / 64, last = end / 64;
+    const uint64_t mask_first = ~0ULL << (start % 64);
+    const uint64_t mask_last  = ~0ULL >> (63 - end % 64);
+    if (first == last) return _mm_popcnt_u64(data[first] & mask_first & mask_last);
+
+    uint64_t count = _mm_popcnt_u64(data[first] & mask_first) + _mm_popcnt_u64(data[last] & mask_last);
+    if (last - first > 1) count += STORM_popcnt(&data[first + 1], (last - first - 1) * sizeof(uint64_t));
+    return count;
+}
+
+// Runs are stored as [start, length - 1] pairs.
+static uint64_t STORM_intersect_runs_runs(const uint16_t* STORM_RESTRICT r1, const uint32_t n1, const uint16_t* STORM_RESTRICT r2, const uint32_t n2) {
+    uint64_t count = 0;
+    uint32_t i = 0, j = 0;
+    while (i < n1 && j < n2) {
+        const uint32_t s1 = r1[2*i], e1 = s1 + r1[2*i+1];
+        const uint32_t s2 = r2[2*j], e2 = s2 + r2[2*j+1];
+        const uint32_t s = s1 > s2 ? s1 : s2;
+        const uint32_t e = e1 < e2 ? e1 : e2;
+        if (s <= e) count += e - s + 1;
+        if (e1 < e2) ++i;
+        else ++j;
+    }
+    return count;
+}
+
+static uint64_t STORM_intersect_runs_bitmap(const uint16_t* STORM_RESTRICT runs, const uint32_t n_runs, const uint64_t* STORM_RESTRICT data) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < n_runs; ++i) {
+        count += STORM_popcount_range(data, runs[2*i], runs[2*i] + runs[2*i+1]);
+    }
+    return count;
+}
+
+static uint64_t STORM_intersect_runs_scalar(const uint16_t* STORM_RESTRICT runs, const uint32_t n_runs, const uint16_t* STORM_RESTRICT scalar, const uint32_t n_scalar) {
+    uint64_t count = 0;
+    uint32_t i = 0;
+    for (uint32_t j = 0; j < n_scalar && i < n_runs; ++j) {
+        while (i < n_runs && (uint32_t)runs[2*i] + runs[2*i+1] < scalar[j]) ++i;
+        count += i < n_runs && scalar[j] >= runs[2*i];
+    }
+    return count;
+}
+
+// Comparisons where at least one of the blocks is run-encoded.
+static uint64_t STORM_bitmap_intersect_cardinality_runs(const STORM_bitmap_t* STORM_RESTRICT bitmap1, const STORM_bitmap_t* STORM_RESTRICT bitmap2) {
+    if (bitmap1->n_runs == 0) {
+        const STORM_bitmap_t* tmp = bitmap1;
+        bitmap1 = bitmap2;
+        bitmap2 = tmp;
+    }
+
+    if (bitmap2->n_runs) return STORM_intersect_runs_runs(bitmap1->scalar, bitmap1->n_runs, bitmap2->scalar, bitmap2->n_runs);
+    if (bitmap2->n_bitmap) return STORM_intersect_runs_bitmap(bitmap1->scalar, bitmap1->n_runs, bitmap2->data);
+    return STORM_intersect_runs_scalar(bitmap1->scalar, bitmap1->n_runs, bitmap2->scalar, bitmap2->n_scalar);
+}
+
+uint64_t STORM_bitmap_intersect_cardinality(STORM_bitmap_t* STORM_RESTRICT bitmap1, 
+                                          STORM_bitmap_t* STORM_RESTRICT bitmap2)
+{
+    if (bitmap1 == NULL) return 0;
+    if (bitmap2 == NULL) return 0;
+
+    // printf("blocks %u and %u\n",bitmap1->id,bitmap2->id);
+
+    if (bitmap1->id != bitmap2->id) 
+        return 0;
+
+    if (bitmap1->n_runs || bitmap2->n_runs) {
+        // run-encoded comparison
+        return STORM_bitmap_intersect_cardinality_runs(bitmap1, bitmap2);
+
+    } else if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap == 0) {
+        // scalar-scalar comparison
+       return STORM_intersect_vector16_cardinality(bitmap1->scalar, 
+                                                 bitmap2->scalar, 
+                                                 bitmap1->n_scalar, 
+                                                 bitmap2->n_scalar);
+        
+    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap == 0) {
+        // bitmap-scalar comparison
+        return (*STORM_get_probe16_func())(bitmap1->data, bitmap2->scalar, bitmap2->n_scalar);
+
+    } else if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap) {
+        // scalar-bitmap comparison
+        return (*STORM_get_probe16_func())(bitmap2->data, bitmap1->scalar, bitmap1->n_scalar);
+
+    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap) {
+        // bitmap-bitmap comparison
+        const STORM_compute_func f = STORM_get_intersect_count_func(bitmap1->n_bitmap);
+        return (*f)(bitmap1->data, bitmap2->data, bitmap1->n_bitmap);
+    } else {
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+uint64_t STORM_bitmap_intersect_cardinality_func(STORM_bitmap_t* STORM_RESTRICT bitmap1, 
+                                               STORM_bitmap_t* STORM_RESTRICT bitmap2, 
+                                               const STORM_compute_func func)
+{
+    if (bitmap1 == NULL) return 0;
+    if (bitmap2 == NULL) return 0;
+
+    if (bitmap1->id != bitmap2->id) 
+        return 0;
+
+    if (bitmap1->n_runs || bitmap2->n_runs) {
+        // run-encoded comparison
+        return STORM_bitmap_intersect_cardinality_runs(bitmap1, bitmap2);
+
+    } else if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap == 0) {
+        // scalar-scalar comparison
+        return STORM_intersect_vector16_cardinality(bitmap1->scalar, bitmap2->scalar, bitmap1->n_scalar, bitmap2->n_scalar);
+        
+    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap == 0) {
+        // bitmap-scalar comparison
+        return (*STORM_get_probe16_func())(bitmap1->data, bitmap2->scalar, bitmap2->n_scalar);
+
+    } else if (bitmap1->n_bitmap == 0 && bitmap2->n_bitmap) {
+        // scalar-bitmap comparison
+        return (*STORM_get_probe16_func())(bitmap2->data, bitmap1->scalar, bitmap1->n_scalar);
+
+    } else if (bitmap1->n_bitmap && bitmap2->n_bitmap) {
+        // bitmap-bitmap comparison
+        return (*func)(bitmap1->data, bitmap2->data, bitmap1->n_bitmap);
+    } else {
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+/* *************************************
+*  Arena
+*
+*  Optional bump allocator for the block payloads of a STORM_t. Dense
+*  blocks and the small scalar/run arrays are carved out of separate
+*  pools of large 64-byte aligned slabs, so dense blocks of consecutive
+*  containers sit next to each other in memory. Payloads taken from the
+*  arena are marked as not owned by their bitmaps and are released all at
+*  once with the arena.
+***************************************/
+
+#ifndef STORM_ARENA_SLAB_SIZE
+#define STORM_ARENA_SLAB_SIZE (1 << 20)
+#endif
+#define STORM_ARENA_ALIGNMENT 64
+
+typedef struct STORM_slab_s STORM_slab_t;
+struct STORM_slab_s {
+    STORM_slab_t* next;
+    uint8_t* data;
+    uint64_t size, used;
+};
+
+typedef struct STORM_pool_s {
+    STORM_slab_t* head; // slab being filled, followed by the full ones
+    uint64_t slab_size;
+} STORM_pool_t;
+
+struct STORM_arena_s {
+    STORM_pool_t dense; // block_size / 8 byte dense blocks
+    STORM_pool_t small; // scalar and run arrays
+};
+
+static STORM_arena_t* STORM_arena_new(uint64_t slab_size) {
+    STORM_arena_t* arena = (STORM_arena_t*)malloc(sizeof(STORM_arena_t));
+    if (arena == NULL) return NULL;
+    slab_size = slab_size == 0 ? STORM_ARENA_SLAB_SIZE : slab_size;
+    arena->dense.head = NULL;
+    arena->dense.slab_size = slab_size;
+    arena->small.head = NULL;
+    arena->small.slab_size = slab_size;
+    return arena;
+}
+
+static void STORM_pool_clear(STORM_pool_t* pool) {
+    STORM_slab_t* slab = pool->head;
+    while (slab != NULL) {
+        STORM_slab_t* next = slab->next;
+        STORM_aligned_free(slab->data);
+        free(slab);
+        slab = next;
+    }
+    pool->head = NULL;
+}
+
+// Releases every payload handed out by the arena.
+static void STORM_arena_clear(STORM_arena_t* arena) {
+    if (arena == NULL) return;
+    STORM_pool_clear(&arena->dense);
+    STORM_pool_clear(&arena->small);
+}
+
+static void STORM_arena_free(STORM_arena_t* arena) {
+    STORM_arena_clear(arena);
+    free(arena);
+}
+
+static void* STORM_pool_alloc(STORM_pool_t* pool, uint64_t size) {
+    size = (size + STORM_ARENA_ALIGNMENT - 1) & ~(uint64_t)(STORM_ARENA_ALIGNMENT - 1);
+    STORM_slab_t* slab = pool->head;
+    if (slab == NULL || slab->used + size > slab->size) {
+        slab = (STORM_slab_t*)malloc(sizeof(STORM_slab_t));
+        if (slab == NULL) return NULL;
+        slab->size = size > pool->slab_size ? size : pool->slab_size;
+        slab->used = 0;
+        slab->data = (uint8_t*)STORM_aligned_malloc(STORM_ARENA_ALIGNMENT, slab->size);
+        if (slab->data == NULL) {
+            free(slab);
+            return NULL;
+        }
+        slab->next = pool->head;
+        pool->head = slab;
+    }
+    void* ptr = slab->data + slab->used;
+    slab->used += size;
+    return ptr;
+}
+
+// Gives an empty bitmap a zeroed dense block from the arena. On failure the
+// bitmap is left untouched and allocates its own memory. A block kept by
+// STORM_bitmap_clear is already zeroed and is reused.
+static void STORM_arena_dense(STORM_arena_t* arena, STORM_bitmap_t* bitmap) {
+    if (bitmap->own_data && bitmap->data != NULL) return;
+    const uint64_t size = (bitmap->block_size / 64) * sizeof(uint64_t);
+    uint64_t* data = (uint64_t*)STORM_pool_alloc(&arena->dense, size);
+    if (data == NULL) return;
+    memset(data, 0, size);
+    bitmap->data = data;
+    bitmap->own_data = 0;
+}
+
+// Gives an empty bitmap room for n_scalar uint16 values from the arena. An
+// owned array that is large enough is reused, a smaller one is released.
+static void STORM_arena_scalar(STORM_arena_t* arena, STORM_bitmap_t* bitmap, const uint32_t n_scalar) {
+    if (bitmap->own_scalar && bitmap->scalar != NULL && bitmap->m_scalar >= n_scalar) return;
+    uint16_t* scalar = (uint16_t*)STORM_pool_alloc(&arena->small, n_scalar * sizeof(uint16_t));
+    if (scalar == NULL) return;
+    if (bitmap->own_scalar) STORM_aligned_free(bitmap->scalar);
+    bitmap->scalar = scalar;
+    bitmap->m_scalar = n_scalar;
+    bitmap->own_scalar = 0;
+}
+
+// container
+STORM_bitmap_cont_t* STORM_bitmap_cont_new() {
+    STORM_bitmap_cont_t* all = (STORM_bitmap_cont_t*)malloc(sizeof(STORM_bitmap_cont_t));
+    if (all == NULL) return NULL;
+    STORM_bitmap_cont_init(all);
+    return all;
+}
+
+void STORM_bitmap_cont_init(STORM_bitmap_cont_t* bitmap) {
+    if (bitmap == NULL) return;
+    bitmap->bitmaps   = NULL;
+    bitmap->block_ids = NULL;
+    memset(bitmap->signature, 0, sizeof(bitmap->signature));
+    bitmap->n_bitmaps = 0;
+    bitmap->m_bitmaps = 0;
+    bitmap->prev_inserted_value = 0;
+    bitmap->block_size = STORM_DEFAULT_BLOCK_SIZE;
+    bitmap->scalar_threshold = STORM_DEFAULT_SCALAR_THRESHOLD;
+}
+
+// Releases the memory held by a container but not the container itself.
+static void STORM_bitmap_cont_release(STORM_bitmap_cont_t* bitmap) {
+    if (bitmap->bitmaps != NULL) {
+        for (uint32_t i = 0; i < bitmap->m_bitmaps; ++i) {
+            if (bitmap->bitmaps[i].own_data) STORM_aligned_free(bitmap->bitmaps[i].data);
+            if (bitmap->bitmaps[i].own_scalar) STORM_aligned_free(bitmap->bitmaps[i].scalar);
+        }
+        free(bitmap->bitmaps);
+    }
+    free(bitmap->block_ids);
+    STORM_bitmap_cont_init(bitmap);
+}
+
+void STORM_bitmap_cont_free(STORM_bitmap_cont_t* bitmap) {
+    if (bitmap == NULL) return;
+    STORM_bitmap_cont_release(bitmap);
+    free(bitmap);
+}
+
+
+// log2 of a power-of-two block size: block ids are values >> shift.
+static inline uint32_t STORM_block_shift(const uint32_t block_size) {
+    return _mm_popcnt_u64(block_size - 1);
+}
+
+static inline int STORM_valid_block_size(const uint32_t block_size) {
+    return block_size >= STORM_MIN_BLOCK_SIZE && block_size <= STORM_MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
+}
+
+// Stores the sorted values of a single block in an empty bitmap using the
+// smallest encoding: runs take 4 bytes per run, scalars 2 bytes per value
+// and a dense block is fixed in size. Lists are only used below
+// scalar_threshold values.
+static void STORM_bitmap_encode(STORM_bitmap_t* x, const uint32_t* values, const uint32_t n_values, const uint32_t scalar_threshold, STORM_arena_t* arena) {
+    const uint32_t n_runs = STORM_count_runs(values, n_values);
+    const uint64_t run_bytes = 4*(uint64_t)n_runs;
+    if (run_bytes < 2*(uint64_t)n_values && run_bytes < x->block_size / 8) {
+        if (arena != NULL) STORM_arena_scalar(arena, x, 2*n_runs);
+        STORM_bitmap_add_runs(x, values, n_values);
+    } else if (n_values < scalar_threshold) {
+        if (arena != NULL) STORM_arena_scalar(arena, x, n_values);
+        STORM_bitmap_add_scalar_only(x, values, n_values);
+    } else {
+        if (arena != NULL) STORM_arena_dense(arena, x);
+        STORM_bitmap_add(x, values, n_values);
+    }
+}
+
+// Makes room for m_bitmaps bitmaps. Returns -3 if memory cannot be
+// allocated, in which case the container is left unchanged.
+static int STORM_bitmap_cont_reserve(STORM_bitmap_cont_t* bitmap, const uint32_t m_bitmaps) {
+    if (m_bitmaps <= bitmap->m_bitmaps) return 1;
+    STORM_bitmap_t* bitmaps = (STORM_bitmap_t*)realloc(bitmap->bitmaps, sizeof(STORM_bitmap_t) * m_bitmaps);
+    if (bitmaps == NULL) return -3;
+    bitmap->bitmaps = bitmaps;
+    for (uint32_t i = bitmap->m_bitmaps; i < m_bitmaps; ++i) {
+        STORM_bitmap_init(&bitmap->bitmaps[i]);
+    }
+    // Bitmaps past m_bitmaps own nothing, so they can be left over if the
+    // ids cannot be grown.
+    uint32_t* block_ids = (uint32_t*)realloc(bitmap->block_ids, sizeof(uint32_t) * m_bitmaps);
+    if (block_ids == NULL) return -3;
+    bitmap->block_ids = block_ids;
+    bitmap->m_bitmaps = m_bitmaps;
+    return 1;
+}
+
+// Appends the sorted values to a container. Block payloads are taken
+// from arena if it is not NULL. Returns -3 if memory cannot be allocated.
+static int STORM_bitmap_cont_add_arena(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values, STORM_arena_t* arena) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -2;
+    if (n_values == 0)  return 0; 
+
+    // Input data must be guaranteed to be in sorted order. Count the blocks
+    // first so that the bitmaps array grows at most once.
+    const uint32_t shift = STORM_block_shift(bitmap->block_size);
+    uint32_t n_blocks = 1;
+    for (uint32_t i = 1; i < n_values; ++i) {
+        n_blocks += (values[i] >> shift) != (values[i-1] >> shift);
+    }
+
+    if (STORM_bitmap_cont_reserve(bitmap, bitmap->n_bitmaps + n_blocks) < 0) return -3;
+
+    uint32_t start = 0, stop = 0;
+    uint32_t target_block = values[0] >> shift;
+
+    while (stop < n_values) {
+        for (/**/; stop < n_values; ++stop) {
+             if ((values[stop] >> shift) != target_block) {
+                 break;
+             }
+        }
+        const uint32_t new_block = stop < n_values ? values[stop] >> shift : target_block;
+
+        assert(stop != start);
+        assert(stop - start > 0);
+        STORM_bitmap_t* x = (STORM_bitmap_t*)&bitmap->bitmaps[bitmap->n_bitmaps];
+        x->id = target_block;
+        x->block_size = bitmap->block_size;
+        bitmap->block_ids[bitmap->n_bitmaps] = target_block;
+        STORM_signature_add(bitmap->signature, target_block);
+
+        STORM_bitmap_encode(x, &values[start], stop - start, bitmap->scalar_threshold, arena);
+        ++bitmap->n_bitmaps;
+        bitmap->prev_inserted_value = values[stop-1];
+        target_block = new_block;
+        start = stop;
+    }    
+
+    return 1;
+}
+
+int STORM_bitmap_cont_add(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    return STORM_bitmap_cont_add_arena(bitmap, values, n_values, NULL);
+}
+
+/* *************************************
+*  Unsorted input
+*
+*  Values are grouped by block with a stable LSD radix sort on the block
+*  id (v / block_size), one pass per byte, skipping passes where every value
+*  falls in the same bucket. Large groups set their bits directly in a
+*  scratch bitmap, which also removes duplicates, and small groups are
+*  radix-sorted on the offset within the block and deduplicated. Either
+*  way each block is then stored with the smallest encoding.
+***************************************/
+
+// Groups with at most this many values are insertion sorted.
+#ifndef STORM_INSERTION_SORT_MAX
+#define STORM_INSERTION_SORT_MAX 32
+#endif
+
+static void STORM_insertion_sort(uint32_t* values, const uint32_t n_values) {
+    for (uint32_t i = 1; i < n_values; ++i) {
+        const uint32_t v = values[i];
+        uint32_t j = i;
+        for (/**/; j > 0 && values[j-1] > v; --j) values[j] = values[j-1];
+        values[j] = v;
+    }
+}
+
+/**
+ * Stable LSD radix sort of values on the bits [first_bit, last_bit) of
+ * each value, 8 bits per pass, using tmp as a buffer of the same size.
+ * Returns the buffer holding the result (values or tmp).
+ */
+static uint32_t* STORM_radix_sort(uint32_t* values, uint32_t* tmp, const uint32_t n_values, const uint32_t first_bit, const uint32_t last_bit) {
+    uint32_t count[256];
+    if (n_values == 0) return values;
+    for (uint32_t shift = first_bit; shift < last_bit; shift += 8) {
+        memset(count, 0, sizeof(count));
+        for (uint32_t i = 0; i < n_values; ++i) ++count[(values[i] >> shift) & 255];
+        if (count[(values[0] >> shift) & 255] == n_values) continue;
+
+        uint32_t sum = 0;
+        for (uint32_t k = 0; k < 256; ++k) {
+            const uint32_t c = count[k];
+            count[k] = sum;
+            sum += c;
+        }
+        for (uint32_t i = 0; i < n_values; ++i) tmp[count[(values[i] >> shift) & 255]++] = values[i];
+        uint32_t* swap = values; values = tmp; tmp = swap;
+    }
+    return values;
+}
+
+// Sorts and deduplicates the values of a block of 2^shift values in place
+// and returns the number of distinct values.
+static uint32_t STORM_sort_block(uint32_t* values, uint32_t* tmp, const uint32_t n_values, const uint32_t shift) {
+    if (n_values == 0) return 0;
+    if (n_values <= STORM_INSERTION_SORT_MAX) {
+        STORM_insertion_sort(values, n_values);
+    } else {
+        const uint32_t* sorted = STORM_radix_sort(values, tmp, n_values, 0, shift);
+        if (sorted != values) memcpy(values, sorted, n_values*sizeof(uint32_t));
+    }
+    uint32_t n_unique = 1;
+    for (uint32_t i = 1; i < n_values; ++i) {
+        if (values[i] != values[n_unique-1]) values[n_unique++] = values[i];
+    }
+    return n_unique;
+}
+
+// Number of runs of consecutive set bits in a dense block.
+static uint32_t STORM_count_runs_dense(const uint64_t* data, const uint32_t n_words) {
+    uint64_t n_runs = 0, carry = 0;
+    for (uint32_t i = 0; i < n_words; ++i) {
+        n_runs += _mm_popcnt_u64(data[i] & ~((data[i] << 1) | carry));
+        carry = data[i] >> 63;
+    }
+    return n_runs;
+}
+
+static int STORM_bitmap_cont_add_unsorted_arena(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values, STORM_arena_t* arena) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -2;
+    if (n_values == 0)  return 0;
+
+    const uint32_t shift = STORM_block_shift(bitmap->block_size);
+    const uint32_t threshold = bitmap->scalar_threshold;
+    const uint32_t n_words = bitmap->block_size / 64;
+    uint32_t* buffer  = (uint32_t*)malloc(2*(uint64_t)n_values*sizeof(uint32_t));
+    uint64_t* scratch = (uint64_t*)calloc(n_words, sizeof(uint64_t));
+    if (buffer == NULL || scratch == NULL) {
+        free(buffer);
+        free(scratch);
+        return -3;
+    }
+    uint32_t* tmp = &buffer[n_values];
+    memcpy(buffer, values, n_values*sizeof(uint32_t));
+
+    // Group by block: the block id is held in the bits above shift.
+    uint32_t* grouped = STORM_radix_sort(buffer, tmp, n_values, shift, 32);
+    tmp = grouped == buffer ? &buffer[n_values] : buffer;
+
+    uint32_t n_blocks = 1;
+    for (uint32_t i = 1; i < n_values; ++i) {
+        n_blocks += (grouped[i] >> shift) != (grouped[i-1] >> shift);
+    }
+    if (STORM_bitmap_cont_reserve(bitmap, bitmap->n_bitmaps + n_blocks) < 0) {
+        free(buffer);
+        free(scratch);
+        return -3;
+    }
+
+    uint32_t start = 0;
+    while (start < n_values) {
+        const uint32_t block = grouped[start] >> shift;
+        const uint32_t adjust = block << shift;
+        uint32_t stop = start + 1;
+        while (stop < n_values && grouped[stop] >> shift == block) ++stop;
+
+        STORM_bitmap_t* x = &bitmap->bitmaps[bitmap->n_bitmaps];
+        x->id = block;
+        x->block_size = bitmap->block_size;
+        bitmap->block_ids[bitmap->n_bitmaps] = block;
+        STORM_signature_add(bitmap->signature, block);
+
+        uint32_t* group = &grouped[start];
+        uint32_t n_group = stop - start;
+        if (n_group >= threshold) {
+            uint32_t n_unique = 0;
+            for (uint32_t i = 0; i < n_group; ++i) {
+                const uint32_t v = group[i] - adjust;
+                const uint64_t bit = 1ULL << (v % 64);
+                n_unique += (scratch[v / 64] & bit) == 0;
+                scratch[v / 64] |= bit;
+            }
+            const uint64_t run_bytes = 4*(uint64_t)STORM_count_runs_dense(scratch, n_words);
+            if (n_unique >= threshold && !(run_bytes < 2*(uint64_t)n_unique && run_bytes < bitmap->block_size / 8)) {
+                if (arena != NULL) STORM_arena_dense(arena, x);
+                if (x->data == NULL) x->data = (uint64_t*)STORM_aligned_malloc(STORM_get_alignment(), n_words*sizeof(uint64_t));
+                memcpy(x->data, scratch, n_words*sizeof(uint64_t));
+                x->n_bitmap = n_words;
+                x->n_bits_set = n_unique;
+                n_group = 0;
+            } else {
+                // Extract the distinct values in order and encode them below.
+                n_group = 0;
+                for (uint32_t i = 0; i < n_words; ++i) {
+                    uint64_t w = scratch[i];
+                    while (w) {
+                        group[n_group++] = adjust + 64*i + _mm_popcnt_u64((w & -w) - 1);
+                        w &= w - 1;
+                    }
+                }
+            }
+            memset(scratch, 0, n_words*sizeof(uint64_t));
+        } else {
+            n_group = STORM_sort_block(group, tmp, n_group, shift);
+        }
+        if (n_group) STORM_bitmap_encode(x, group, n_group, threshold, arena);
+
+        ++bitmap->n_bitmaps;
+        bitmap->prev_inserted_value = grouped[stop-1];
+        start = stop;
+    }
+
+    free(buffer);
+    free(scratch);
+    return 1;
+}
+
+int STORM_bitmap_cont_add_unsorted(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    return STORM_bitmap_cont_add_unsorted_arena(bitmap, values, n_values, NULL);
+}
+
+uint64_t STORM_bitmap_cont_intersect_cardinality(const STORM_bitmap_cont_t* STORM_RESTRICT bitmap1, 
+                                               const STORM_bitmap_cont_t* STORM_RESTRICT bitmap2)
+{
+    if (bitmap1 == NULL) return 0;
+    if (bitmap2 == NULL) return 0;
+    if (bitmap1->n_bitmaps == 0) return 0;
+    if (bitmap2->n_bitmaps == 0) return 0;
+    if (STORM_signature_disjoint(bitmap1->signature, bitmap2->signature)) return 0;
+
+    if (bitmap1->block_size != bitmap2->block_size) return 0;
+
+    // Move this out to recycle memory.
+    const uint32_t n_out = bitmap1->n_bitmaps < bitmap2->n_bitmaps ? bitmap1->n_bitmaps : bitmap2->n_bitmaps;
+    uint32_t* out = (uint32_t*)malloc(2*n_out*sizeof(uint32_t));
+
+    uint32_t ret = STORM_intersect_vector32_unsafe(bitmap1->block_ids, 
+                                                 bitmap2->block_ids, 
+                                                 bitmap1->n_bitmaps, 
+                                                 bitmap2->n_bitmaps, 
+                                                 out);
+    // Retrieve optimal intersect function.
+    const STORM_compute_func f = STORM_get_intersect_count_func(bitmap1->block_size / 64);
+
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < ret; i += 2) {
+        assert(bitmap1->bitmaps[out[i+0]].id == bitmap2->bitmaps[out[i+1]].id);
+        count += STORM_bitmap_intersect_cardinality_func(&bitmap1->bitmaps[out[i+0]], &bitmap2->bitmaps[out[i+1]], f);
+    }
+
+    free(out);
+
+    return count;
+}
+
+uint64_t STORM_bitmap_cont_intersect_cardinality_premade(const STORM_bitmap_cont_t* STORM_RESTRICT bitmap1, 
+                                                       const STORM_bitmap_cont_t* STORM_RESTRICT bitmap2, 
+                                                       const STORM_compute_func func, 
+                                                       uint32_t* out)
+{
+    if (bitmap1 == NULL) return 0;
+    if (bitmap2 == NULL) return 0;
+    if (bitmap1->n_bitmaps == 0) return 0;
+    if (bitmap2->n_bitmaps == 0) return 0;
+    if (out == NULL) return 0;
+    if (STORM_signature_disjoint(bitmap1->signature, bitmap2->signature)) return 0;
+
+    uint32_t ret = STORM_intersect_vector32_unsafe(bitmap1->block_ids, 
+                                                 bitmap2->block_ids, 
+                                                 bitmap1->n_bitmaps, 
+                                                 bitmap2->n_bitmaps, 
+                                                 out);
+
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < ret; i += 2) {
+        assert(bitmap1->bitmaps[out[i+0]].id == bitmap2->bitmaps[out[i+1]].id);
+        count += STORM_bitmap_intersect_cardinality_func(&bitmap1->bitmaps[out[i+0]], &bitmap2->bitmaps[out[i+1]], func);
+    }
+    
+    return count;
+}
+ 
+int STORM_bitmap_cont_clear(STORM_bitmap_cont_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    for (uint32_t i = 0; i < bitmap->n_bitmaps; ++i) {
+        STORM_bitmap_clear(&bitmap->bitmaps[i]);
+    }
+    bitmap->n_bitmaps = 0;
+    memset(bitmap->signature, 0, sizeof(bitmap->signature));
+    bitmap->prev_inserted_value = 0;
+    return 1;
+}
+
+// cont
+STORM_t* STORM_new() {
+    STORM_t* all = (STORM_t*)malloc(sizeof(STORM_t));
+    if (all == NULL) return NULL;
+    all->conts = NULL;
+    all->n_conts = 0;
+    all->m_conts = 0;
+    all->map = NULL;
+    all->map_size = 0;
+    all->arena = NULL;
+    all->block_size = STORM_DEFAULT_BLOCK_SIZE;
+    all->scalar_threshold = STORM_DEFAULT_SCALAR_THRESHOLD;
+    return all;
+}
+
+STORM_t* STORM_new_arena(uint64_t slab_size) {
+    STORM_t* all = STORM_new();
+    if (all == NULL) return NULL;
+    all->arena = STORM_arena_new(slab_size);
+    if (all->arena == NULL) {
+        free(all);
+        return NULL;
+    }
+    return all;
+}
+
+int STORM_set_block_size(STORM_t* bitmap, uint32_t block_size, uint32_t scalar_threshold) {
+    if (bitmap == NULL) return -1;
+    if (block_size == 0) block_size = STORM_DEFAULT_BLOCK_SIZE;
+    if (STORM_valid_block_size(block_size) == 0) return -2;
+    if (scalar_threshold == 0) {
+        scalar_threshold = ((uint64_t)STORM_DEFAULT_SCALAR_THRESHOLD * block_size) / STORM_DEFAULT_BLOCK_SIZE;
+        scalar_threshold = scalar_threshold == 0 ? 1 : scalar_threshold;
+    }
+    if (scalar_threshold > block_size) return -3;
+    if (bitmap->n_conts) return -4;
+
+    // Cleared containers keep their blocks for reuse: drop them if the
+    // dense blocks no longer have the right size.
+    if (block_size != bitmap->block_size) {
+        for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
+            STORM_bitmap_cont_release(&bitmap->conts[i]);
+        }
+    }
+    bitmap->block_size = block_size;
+    bitmap->scalar_threshold = scalar_threshold;
+    return 1;
+}
+
+static void STORM_unmap(STORM_t* bitmap);
+
+void STORM_free(STORM_t* bitmap) {
+    if (bitmap == NULL) return;
+    for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
+        STORM_bitmap_cont_release(&bitmap->conts[i]);
+    }
+    free(bitmap->conts);
+    STORM_unmap(bitmap);
+    if (bitmap->arena != NULL) STORM_arena_free(bitmap->arena);
+    free(bitmap);
+}
+
+// Returns the next free container, growing the container array as needed.
+static STORM_bitmap_cont_t* STORM_next_cont(STORM_t* bitmap) {
+    if (bitmap->m_conts == 0) {
+        bitmap->m_conts = 1024;
+        bitmap->conts = (STORM_bitmap_cont_t*)malloc(bitmap->m_conts*sizeof(STORM_bitmap_cont_t));
+        bitmap->n_conts = 0;
+        for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
+            STORM_bitmap_cont_init(&bitmap->conts[i]);
+        }
+    }
+
+    if (bitmap->n_conts == bitmap->m_conts) {
+        bitmap->m_conts *= 2;
+        bitmap->conts = (STORM_bitmap_cont_t*)realloc(bitmap->conts, bitmap->m_conts*sizeof(STORM_bitmap_cont_t));
+        for (uint32_t i = bitmap->n_conts; i < bitmap->m_conts; ++i) {
+            STORM_bitmap_cont_init(&bitmap->conts[i]);
+        }
+    }
+
+    STORM_bitmap_cont_t* cont = &bitmap->conts[bitmap->n_conts++];
+    cont->block_size = bitmap->block_size;
+    cont->scalar_threshold = bitmap->scalar_threshold;
+    return cont;
+}
+
+int STORM_add(STORM_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    STORM_bitmap_cont_add_arena(STORM_next_cont(bitmap), values, n_values, bitmap->arena);
+    return 1;
+}
+
+int STORM_add_unsorted(STORM_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL && n_values != 0) return -2;
+    if (STORM_bitmap_cont_add_unsorted_arena(STORM_next_cont(bitmap), values, n_values, bitmap->arena) < 0) return -3;
+    return 1;
+}
+
+/* *************************************
+*  Batch ingest
+*
+*  Vectors are given in CSR form: the sorted values of vector i are
+*  values[offsets[i]] to values[offsets[i+1]-1]. Storage is sized once up
+*  front and the vectors are then built by n_threads workers, each given a
+*  contiguous range of vectors holding about the same number of values.
+***************************************/
+
+typedef struct STORM_batch_s STORM_batch_t;
+// Builds the vectors [begin, end) of a batch on worker id.
+typedef void (*STORM_batch_func)(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id);
+
+struct STORM_batch_s {
+    const uint64_t* offsets;
+    const uint32_t* values;
+    void* target;
+    STORM_batch_func func;
+    STORM_arena_t** arenas; // per-worker arenas (STORM_t with an arena)
+    uint32_t* n_unique; // distinct values per vector (contiguous)
+    uint64_t* scalar_offsets; // list position per vector (contiguous)
+    volatile int error; // set by a worker that failed
+};
+
+typedef struct STORM_batch_worker_s {
+    STORM_batch_t* batch;
+    uint32_t begin, end, id;
+} STORM_batch_worker_t;
+
+STORM_THREAD_FUNC(STORM_batch_worker) {
+    STORM_batch_worker_t* worker = (STORM_batch_worker_t*)arg;
+    (*worker->batch->func)(worker->batch, worker->begin, worker->end, worker->id);
+    return STORM_THREAD_RETURN;
+}
+
+// Returns the number of workers used for a batch of n_vectors.
+static uint32_t STORM_batch_threads(uint32_t n_threads, const uint32_t n_vectors) {
+    n_threads = n_threads == 0 ? STORM_get_n_threads() : n_threads;
+    n_threads = n_threads > n_vectors ? n_vectors : n_threads;
+    return n_threads == 0 ? 1 : n_threads;
+}
+
+// Runs batch->func over n_vectors split between n_threads workers. Work
+// that cannot be given to a thread is done on the calling thread. Returns
+// 1 on success or -1 if a worker set batch->error.
+static int STORM_batch_run(STORM_batch_t* batch, const uint32_t n_vectors, const uint32_t n_threads) {
+    STORM_batch_worker_t* workers = n_threads > 1 ? (STORM_batch_worker_t*)malloc(n_threads * sizeof(STORM_batch_worker_t)) : NULL;
+    STORM_thread_t* threads = n_threads > 1 ? (STORM_thread_t*)malloc(n_threads * sizeof(STORM_thread_t)) : NULL;
+    if (workers == NULL || threads == NULL) {
+        free(workers);
+        free(threads);
+        (*batch->func)(batch, 0, n_vectors, 0);
+        return batch->error ? -1 : 1;
+    }
+
+    // Split on value counts: worker t starts at the first vector whose
+    // offset reaches t/n_threads of all values.
+    const uint64_t first = batch->offsets[0];
+    const uint64_t total = batch->offsets[n_vectors] - first;
+    uint32_t begin = 0;
+    for (uint32_t t = 0; t < n_threads; ++t) {
+        uint32_t end = n_vectors;
+        if (t + 1 < n_threads) {
+            const uint64_t target = first + (total * (t + 1)) / n_threads;
+            uint32_t lo = begin, hi = n_vectors;
+            while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (batch->offsets[mid] < target) lo = mid + 1;
+                else hi = mid;
+            }
+            end = lo;
+        }
+        workers[t].batch = batch;
+        workers[t].begin = begin;
+        workers[t].end   = end;
+        workers[t].id    = t;
+        begin = end;
+    }
+
+    // A worker with a NULL batch has no thread and runs after worker 0.
+    for (uint32_t t = 1; t < n_threads; ++t) {
+        if (STORM_thread_create(threads[t], STORM_batch_worker, &workers[t]) != 0) workers[t].batch = NULL;
+    }
+    STORM_batch_worker(&workers[0]);
+    for (uint32_t t = 1; t < n_threads; ++t) {
+        if (workers[t].batch != NULL) {
+            STORM_thread_join(threads[t]);
+        } else {
+            (*batch->func)(batch, workers[t].begin, workers[t].end, workers[t].id);
+        }
+    }
+
+    free(threads);
+    free(workers);
+    return batch->error ? -1 : 1;
+}
+
+// Moves all slabs of src into dst behind the slab dst is filling.
+static void STORM_pool_merge(STORM_pool_t* dst, STORM_pool_t* src) {
+    if (src->head == NULL) return;
+    if (dst->head == NULL) {
+        dst->head = src->head;
+    } else {
+        STORM_slab_t* tail = src->head;
+        while (tail->next != NULL) tail = tail->next;
+        tail->next = dst->head->next;
+        dst->head->next = src->head;
+    }
+    src->head = NULL;
+}
+
+static void STORM_batch_build(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id) {
+    STORM_t* bitmap = (STORM_t*)batch->target;
+    STORM_arena_t* arena = batch->arenas != NULL ? batch->arenas[id] : NULL;
+    for (uint32_t i = begin; i < end; ++i) {
+        const uint64_t offset = batch->offsets[i];
+        if (STORM_bitmap_cont_add_arena(&bitmap->conts[bitmap->n_conts + i], &batch->values[offset], batch->offsets[i+1] - offset, arena) < 0)
+            batch->error = 1;
+    }
+}
+
+int STORM_add_batch(STORM_t* bitmap, const uint64_t* offsets, const uint32_t* values, const uint32_t n_vectors, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (offsets == NULL) return -2;
+    if (values == NULL && offsets[n_vectors] != offsets[0]) return -3;
+    if (n_vectors == 0) return 1;
+
+    if ((uint64_t)bitmap->n_conts + n_vectors > bitmap->m_conts) {
+        uint32_t old_m = bitmap->m_conts;
+        uint64_t new_m = bitmap->m_conts ? bitmap->m_conts : 1024;
+        while (new_m < (uint64_t)bitmap->n_conts + n_vectors) new_m *= 2;
+        new_m = new_m > UINT32_MAX ? UINT32_MAX : new_m;
+        STORM_bitmap_cont_t* conts = (STORM_bitmap_cont_t*)realloc(bitmap->conts, new_m*sizeof(STORM_bitmap_cont_t));
+        if (conts == NULL) return -4;
+        bitmap->conts = conts;
+        bitmap->m_conts = new_m;
+        for (uint32_t i = old_m; i < bitmap->m_conts; ++i) {
+            STORM_bitmap_cont_init(&bitmap->conts[i]);
+        }
+    }
+
+    for (uint32_t i = bitmap->n_conts; i < bitmap->n_conts + n_vectors; ++i) {
+        bitmap->conts[i].block_size = bitmap->block_size;
+        bitmap->conts[i].scalar_threshold = bitmap->scalar_threshold;
+    }
+
+    n_threads = STORM_batch_threads(n_threads, n_vectors);
+
+    STORM_batch_t batch;
+    memset(&batch, 0, sizeof(STORM_batch_t));
+    batch.offsets = offsets;
+    batch.values  = values;
+    batch.target  = bitmap;
+    batch.func    = &STORM_batch_build;
+
+    // The arena is not shared between workers: each worker fills its own
+    // and the slabs are handed over to the STORM_t afterwards.
+    // Workers without an arena allocate their own memory.
+    if (bitmap->arena != NULL) {
+        batch.arenas = (STORM_arena_t**)malloc(n_threads * sizeof(STORM_arena_t*));
+        for (uint32_t t = 0; batch.arenas != NULL && t < n_threads; ++t) {
+            batch.arenas[t] = STORM_arena_new(bitmap->arena->dense.slab_size);
+        }
+    }
+
+    const int ret = STORM_batch_run(&batch, n_vectors, n_threads);
+
+    if (batch.arenas != NULL) {
+        for (uint32_t t = 0; t < n_threads; ++t) {
+            if (batch.arenas[t] == NULL) continue;
+            STORM_pool_merge(&bitmap->arena->dense, &batch.arenas[t]->dense);
+            STORM_pool_merge(&bitmap->arena->small, &batch.arenas[t]->small);
+            STORM_arena_free(batch.arenas[t]);
+        }
+        free(batch.arenas);
+    }
+
+    // Drop the partially built vectors: the containers keep their memory
+    // for reuse.
+    if (ret < 0) {
+        for (uint32_t i = bitmap->n_conts; i < bitmap->n_conts + n_vectors; ++i) {
+            STORM_bitmap_cont_clear(&bitmap->conts[i]);
+        }
+        return -5;
+    }
+    bitmap->n_conts += n_vectors;
+    return 1;
+}
+
+int STORM_clear(STORM_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    
+    for (int i = 0; i < bitmap->n_conts; ++i)
+        STORM_bitmap_cont_clear(&bitmap->conts[i]);
+    bitmap->n_conts = 0;
+    // No container references the mapping or the arena after clearing.
+    STORM_unmap(bitmap);
+    STORM_arena_clear(bitmap->arena);
+    return 1;
+}
+
+// Largest number of bitmaps in any container: bounds the size of the
+// block-id join output.
+static uint32_t STORM_max_bitmaps(const STORM_t* bitmap) {
+    uint32_t max = 1;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        max = bitmap->conts[i].n_bitmaps > max ? bitmap->conts[i].n_bitmaps : max;
+    }
+    return max;
+}
+
+uint64_t STORM_pairw_intersect_cardinality(STORM_t* bitmap) {
+    if (bitmap == NULL) return -1;
+
+    uint32_t* out = (uint32_t*)malloc(sizeof(uint32_t)*2*STORM_max_bitmaps(bitmap));
+    const STORM_compute_func f = STORM_get_intersect_count_func(bitmap->block_size / 64);
+
+    // printf("running for: %u vectors\n", bitmap->n_conts);
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        for (uint32_t j = i + 1; j < bitmap->n_conts; ++j) {
+            total += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
+        }
+    }
+
+    free(out);
+
+    return total;
+}
+
+// Guess the number of containers per tile such that a tile fits in
+// the cache block size given the average container size.
+static uint32_t STORM_guess_bsize(const STORM_t* bitmap) {
+    if (bitmap->n_conts == 0) return 5;
+    uint64_t tot = 0;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        tot += STORM_bitmap_cont_serialized_size(&bitmap->conts[i]);
+    }
+    uint32_t average_size = tot / bitmap->n_conts;
+    average_size = average_size == 0 ? 1 : average_size;
+    // printf("guestimating block-size to %u\n", bsize);
+    return ceil((double)STORM_get_cache_block_size(bitmap->block_size / 64) / average_size);
+}
+
+uint64_t STORM_pairw_intersect_cardinality_blocked(STORM_t* bitmap, uint32_t bsize) {
+    if (bitmap == NULL) return -1;
+
+    uint32_t* out = (uint32_t*)malloc(sizeof(uint32_t)*2*STORM_max_bitmaps(bitmap));
+    const STORM_compute_func f = STORM_get_intersect_count_func(bitmap->block_size / 64);
+    
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap);
+    
+    // Make sure block size is not <5.
+    bsize = bsize < 5 ? 5 : bsize;
+
+    // printf("running for: %u vectors\n", bitmap->n_conts);
+
+    uint64_t count = 0;
+    uint32_t i = 0;
+
+    for (/**/; i + bsize <= bitmap->n_conts; i += bsize) {
+        // diagonal component
+        for (uint32_t j = 0; j < bsize; ++j) {
+            for (uint32_t jj = j + 1; jj < bsize; ++jj) {
+                // count += (*func)(bitmaps[i+j].data, bitmaps[i+jj].data, n_bitmaps_sample);
+                count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i+j], &bitmap->conts[i+jj], f, out);
+            }
+        }
+
+        // square component
+        uint32_t curi = i;
+        uint32_t j = curi + bsize;
+        for (/**/; j + bsize <= bitmap->n_conts; j += bsize) {
+            for (uint32_t ii = 0; ii < bsize; ++ii) {
+                for (uint32_t jj = 0; jj < bsize; ++jj) {
+                    // count += (*func)(bitmaps[curi+ii].data, bitmaps[j+jj].data, n_bitmaps_sample);
+                    count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+ii], &bitmap->conts[j+jj], f, out);
+                }
+            }
+        }
+
+        // residual
+        for (/**/; j < bitmap->n_conts; ++j) {
+            for (uint32_t jj = 0; jj < bsize; ++jj) {
+                // count += (*func)(bitmaps[curi+jj].data, bitmaps[j].data, n_bitmaps_sample);
+                count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+jj], &bitmap->conts[j], f, out);
+            }
+        }
+    }
+    // residual tail
+    for (/**/; i < bitmap->n_conts; ++i) {
+        for (uint32_t j = i + 1; j < bitmap->n_conts; ++j) {
+            // count += (*func)(bitmaps[i].data, bitmaps[j].data, n_bitmaps_sample);
+            count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
+        }
+    }
+
+    free(out);
+
+    return count;
+}
+
+static uint64_t STORM_tile_kernel_storm(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_t* left  = (const STORM_t*)job->left;
+    const STORM_t* right = (const STORM_t*)job->right;
+    uint64_t* counts = worker->counts;
+    const uint32_t ld = tile->j_end - tile->j_start;
+
+    const STORM_signature_func candidates = STORM_get_signature_func();
+
+    uint64_t count = 0;
+    for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+        const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+        if (counts != NULL && j_start < tile->j_end) {
+            memset(&counts[(i - tile->i_start) * ld + (j_start - tile->j_start)], 0, (tile->j_end - j_start) * sizeof(uint64_t));
+        }
+        // Test the signatures of a batch of columns at once and only join
+        // the pairs that share a block.
+        for (uint32_t j0 = j_start; j0 < tile->j_end; j0 += STORM_SIGNATURE_BATCH) {
+            const uint32_t n = tile->j_end - j0 < STORM_SIGNATURE_BATCH ? tile->j_end - j0 : STORM_SIGNATURE_BATCH;
+            uint64_t mask = (*candidates)(left->conts[i].signature, &right->conts[j0], n);
+            while (mask) {
+                const uint32_t j = j0 + _mm_popcnt_u64((mask & -mask) - 1);
+                mask &= mask - 1;
+                const uint64_t c = STORM_bitmap_cont_intersect_cardinality_premade(&left->conts[i], &right->conts[j], job->func, worker->out);
+                count += c;
+                if (counts != NULL) counts[(i - tile->i_start) * ld + (j - tile->j_start)] = c;
+            }
+        }
+    }
+    return count;
+}
+
+// Shared engine for the threaded STORM_t entry points. The job may carry
+// a tile visitor set up by the caller.
+static uint64_t STORM_pairw_engine(STORM_t* bitmap, const uint32_t bsize, const uint32_t n_threads, STORM_job_t* job) {
+    job->left   = bitmap;
+    job->right  = bitmap;
+    job->func   = STORM_get_intersect_count_func(bitmap->block_size / 64);
+    job->kernel = &STORM_tile_kernel_storm;
+    job->n_out  = 2*STORM_max_bitmaps(bitmap);
+
+    return STORM_run_triangle(job, bitmap->n_conts, bsize, n_threads);
+}
+
+uint64_t STORM_pairw_intersect_cardinality_blocked_threads(STORM_t* bitmap, uint32_t bsize, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_pairw_engine(bitmap, bsize, n_threads, &job);
+}
+
+uint64_t STORM_bitmap_cont_cardinality(const STORM_bitmap_cont_t* bitmap) {
+    if (bitmap == NULL) return 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < bitmap->n_bitmaps; ++i) {
+        total += bitmap->bitmaps[i].n_bits_set;
+    }
+    return total;
+}
+
+uint64_t STORM_max_cardinality(const STORM_t* bitmap) {
+    if (bitmap == NULL) return 0;
+    uint64_t max = 0;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        const uint64_t c = STORM_bitmap_cont_cardinality(&bitmap->conts[i]);
+        max = c > max ? c : max;
+    }
+    return max;
+}
+
+uint64_t STORM_pairw_intersect_cardinality_visit(STORM_t* bitmap, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (callback == NULL) return -2;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_visitor_t visitor;
+    visitor.callback  = callback;
+    visitor.user_data = user_data;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_callback(&job, &visitor, bsize, bitmap->n_conts);
+    return STORM_pairw_engine(bitmap, bsize, n_threads, &job);
+}
+
+uint64_t STORM_pairw_intersect_cardinality_matrix(STORM_t* bitmap, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (out == NULL) return -2;
+    if (out->n_rows < bitmap->n_conts) return -3;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        STORM_result_store_diagonal(out, i, STORM_bitmap_cont_cardinality(&bitmap->conts[i]));
+    }
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_matrix(&job, out, bsize, bitmap->n_conts);
+    return STORM_pairw_engine(bitmap, bsize, n_threads, &job);
+}
+
+uint64_t STORM_serialized_size(const STORM_t* bitmap) {
+    if (bitmap == NULL) return 0;
+
+    uint64_t tot = 0;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        tot += STORM_bitmap_cont_serialized_size(&bitmap->conts[i]);
+    }
+    tot += 2*sizeof(uint32_t);
+
+    return tot;
+}
+
+/* *************************************
+*  File format
+*
+*  A STORM file is a 64-byte header followed by one record per container
+*  and an index of record offsets. Records and all payloads start on
+*  64-byte boundaries, so a mapped file can be used in place. Offsets
+*  inside a record are relative to the start of that record: any
+*  contiguous range of records can be loaded on its own.
+*
+*  header | record 0 | record 1 | ... | uint64_t offsets[n_conts + 1]
+*
+*  record: STORM_record_header_t | uint32_t block_ids[n_bitmaps] (padded
+*  to 8 bytes) | STORM_record_bitmap_t bitmaps[n_bitmaps] | payloads
+***************************************/
+
+#define STORM_FILE_MAGIC     "STORMBM"
+#define STORM_FILE_VERSION   1
+#define STORM_FILE_ALIGNMENT 64
+#define STORM_FILE_BOM       0x01020304
+
+typedef struct STORM_file_header_s {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // STORM_FILE_BOM as written by the producer
+    uint32_t block_size; // block size of the producing STORM_t
+    uint32_t n_conts;
+    uint64_t index_offset;
+    uint64_t file_size;
+    uint8_t reserved[24];
+} STORM_file_header_t;
+
+typedef struct STORM_record_header_s {
+    uint32_t n_bitmaps;
+    uint32_t prev_inserted_value;
+    uint64_t size; // record size including padding
+} STORM_record_header_t;
+
+typedef struct STORM_record_bitmap_s {
+    uint64_t data_offset; // 0 if there is no bitmap
+    uint64_t scalar_offset; // 0 if there are no scalars
+    uint32_t n_bitmap;
+    uint32_t n_scalar; // length of the scalar payload in uint16_t
+    uint32_t n_bits_set;
+    uint32_t flags; // STORM_RECORD_SCALAR_SET | STORM_RECORD_RUNS
+} STORM_record_bitmap_t;
+
+#define STORM_RECORD_SCALAR_SET 1
+#define STORM_RECORD_RUNS       2
+
+// Number of uint16_t in the scalar array of a block.
+static uint32_t STORM_bitmap_scalar_length(const STORM_bitmap_t* bitmap) {
+    return bitmap->n_runs ? 2*bitmap->n_runs : bitmap->n_scalar;
+}
+
+#define STORM_FILE_PAD(x) (((x) + STORM_FILE_ALIGNMENT - 1) & ~(uint64_t)(STORM_FILE_ALIGNMENT - 1))
+
+static uint64_t STORM_record_descr_offset(const uint32_t n_bitmaps) {
+    return (sizeof(STORM_record_header_t) + n_bitmaps*sizeof(uint32_t) + 7) & ~(uint64_t)7;
+}
+
+static uint64_t STORM_record_size(const STORM_bitmap_cont_t* cont) {
+    uint64_t size = STORM_FILE_PAD(STORM_record_descr_offset(cont->n_bitmaps) + cont->n_bitmaps*sizeof(STORM_record_bitmap_t));
+    for (uint32_t i = 0; i < cont->n_bitmaps; ++i) {
+        const STORM_bitmap_t* x = &cont->bitmaps[i];
+        if (x->n_bitmap) size += STORM_FILE_PAD(x->n_bitmap*sizeof(uint64_t));
+        if (STORM_bitmap_scalar_length(x)) size += STORM_FILE_PAD(STORM_bitmap_scalar_length(x)*sizeof(uint16_t));
+    }
+    return size;
+}
+
+// Writes a record to dst, which must hold STORM_record_size(cont) bytes.
+static uint64_t STORM_record_write(const STORM_bitmap_cont_t* cont, uint8_t* dst) {
+    const uint64_t size = STORM_record_size(cont);
+    memset(dst, 0, size);
+
+    STORM_record_header_t* header = (STORM_record_header_t*)dst;
+    header->n_bitmaps = cont->n_bitmaps;
+    header->prev_inserted_value = cont->prev_inserted_value;
+    header->size = size;
+
+    uint32_t* block_ids = (uint32_t*)(dst + sizeof(STORM_record_header_t));
+    STORM_record_bitmap_t* descr = (STORM_record_bitmap_t*)(dst + STORM_record_descr_offset(cont->n_bitmaps));
+    uint64_t offset = STORM_FILE_PAD(STORM_record_descr_offset(cont->n_bitmaps) + cont->n_bitmaps*sizeof(STORM_record_bitmap_t));
+
+    for (uint32_t i = 0; i < cont->n_bitmaps; ++i) {
+        const STORM_bitmap_t* x = &cont->bitmaps[i];
+        block_ids[i] = cont->block_ids[i];
+        descr[i].n_bitmap     = x->n_bitmap;
+        descr[i].n_scalar     = STORM_bitmap_scalar_length(x);
+        descr[i].n_bits_set   = x->n_bits_set;
+        descr[i].flags        = (x->n_scalar_set ? STORM_RECORD_SCALAR_SET : 0) | (x->n_runs ? STORM_RECORD_RUNS : 0);
+        if (x->n_bitmap) {
+            descr[i].data_offset = offset;
+            memcpy(dst + offset, x->data, x->n_bitmap*sizeof(uint64_t));
+            offset += STORM_FILE_PAD(x->n_bitmap*sizeof(uint64_t));
+        }
+        if (descr[i].n_scalar) {
+            descr[i].scalar_offset = offset;
+            memcpy(dst + offset, x->scalar, descr[i].n_scalar*sizeof(uint16_t));
+            offset += STORM_FILE_PAD(descr[i].n_scalar*sizeof(uint16_t));
+        }
+    }
+    assert(offset == size);
+    return size;
+}
+
+/**
+ * Points the container at a record of length size. The data and scalar
+ * arrays of its bitmaps borrow from the record, which must outlive the
+ * container and be 64-byte aligned. Returns a negative value if the
+ * record is malformed.
+ */
+static int STORM_record_view(STORM_bitmap_cont_t* cont, const uint8_t* src, const uint64_t size, const uint32_t block_size) {
+    STORM_bitmap_cont_init(cont);
+    if (size < sizeof(STORM_record_header_t)) return -1;
+    const STORM_record_header_t* header = (const STORM_record_header_t*)src;
+    const uint32_t n = header->n_bitmaps;
+    if (header->size != size) return -2;
+    if (n > size / sizeof(STORM_record_bitmap_t)) return -3;
+    const uint64_t descr_end = STORM_record_descr_offset(n) + (uint64_t)n*sizeof(STORM_record_bitmap_t);
+    if (descr_end > size) return -3;
+
+    const uint32_t* block_ids = (const uint32_t*)(src + sizeof(STORM_record_header_t));
+    const STORM_record_bitmap_t* descr = (const STORM_record_bitmap_t*)(src + STORM_record_descr_offset(n));
+
+    cont->block_size = block_size;
+    cont->prev_inserted_value = header->prev_inserted_value;
+    if (n == 0) return 1;
+
+    STORM_bitmap_t* bitmaps = (STORM_bitmap_t*)malloc(n*sizeof(STORM_bitmap_t));
+    uint32_t* ids = (uint32_t*)malloc(n*sizeof(uint32_t));
+    if (bitmaps == NULL || ids == NULL) {
+        free(bitmaps);
+        free(ids);
+        return -5;
+    }
+    cont->bitmaps   = bitmaps;
+    cont->block_ids = ids;
+    cont->n_bitmaps = n;
+    cont->m_bitmaps = n;
+    memcpy(cont->block_ids, block_ids, n*sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; ++i) {
+        STORM_bitmap_init(&cont->bitmaps[i]);
+        cont->bitmaps[i].own_data   = 0;
+        cont->bitmaps[i].own_scalar = 0;
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (i && block_ids[i] <= block_ids[i-1]) return -4;
+        const uint64_t n_data   = (uint64_t)descr[i].n_bitmap*sizeof(uint64_t);
+        const uint64_t n_scalar = (uint64_t)descr[i].n_scalar*sizeof(uint16_t);
+        if (descr[i].n_bitmap) {
+            if (descr[i].n_bitmap != block_size / 64) return -4;
+            if (descr[i].data_offset % 8 || descr[i].data_offset < descr_end || descr[i].data_offset > size || n_data > size - descr[i].data_offset) return -4;
+        }
+        if (descr[i].n_scalar) {
+            if (descr[i].scalar_offset % 8 || descr[i].scalar_offset < descr_end || descr[i].scalar_offset > size || n_scalar > size - descr[i].scalar_offset) return -4;
+            const uint16_t* scalar = (const uint16_t*)(src + descr[i].scalar_offset);
+            if (descr[i].flags & STORM_RECORD_RUNS) {
+                // Runs are (start, length - 1) pairs.
+                if (descr[i].n_scalar % 2) return -4;
+                for (uint32_t k = 0; k < descr[i].n_scalar; k += 2) {
+                    if ((uint32_t)scalar[k] + scalar[k+1] >= block_size) return -4;
+                }
+            } else {
+                for (uint32_t k = 0; k < descr[i].n_scalar; ++k) {
+                    if (scalar[k] >= block_size) return -4;
+                }
+            }
+        }
+
+        STORM_bitmap_t* x = &cont->bitmaps[i];
+        x->id           = block_ids[i];
+        x->block_size   = block_size;
+        STORM_signature_add(cont->signature, block_ids[i]);
+        x->n_bitmap     = descr[i].n_bitmap;
+        x->m_scalar     = descr[i].n_scalar;
+        x->n_bits_set   = descr[i].n_bits_set;
+        x->n_scalar_set = (descr[i].flags & STORM_RECORD_SCALAR_SET) != 0;
+        if (descr[i].flags & STORM_RECORD_RUNS) x->n_runs = descr[i].n_scalar / 2;
+        else x->n_scalar = descr[i].n_scalar;
+        if (descr[i].n_bitmap) x->data = (uint64_t*)(src + descr[i].data_offset);
+        if (descr[i].n_scalar) x->scalar = (uint16_t*)(src + descr[i].scalar_offset);
+    }
+    return 1;
+}
+
+uint64_t STORM_file_size(const STORM_t* bitmap) {
+    if (bitmap == NULL) return 0;
+    uint64_t size = sizeof(STORM_file_header_t);
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        size += STORM_record_size(&bitmap->conts[i]);
+    }
+    size += ((uint64_t)bitmap->n_conts + 1) * sizeof(uint64_t);
+    return size;
+}
+
+static void STORM_file_header_init(const STORM_t* bitmap, STORM_file_header_t* header) {
+    memset(header, 0, sizeof(STORM_file_header_t));
+    memcpy(header->magic, STORM_FILE_MAGIC, sizeof(STORM_FILE_MAGIC));
+    header->version    = STORM_FILE_VERSION;
+    header->byte_order = STORM_FILE_BOM;
+    header->block_size = bitmap->block_size;
+    header->n_conts    = bitmap->n_conts;
+    header->file_size  = STORM_file_size(bitmap);
+    header->index_offset = header->file_size - ((uint64_t)bitmap->n_conts + 1) * sizeof(uint64_t);
+}
+
+int STORM_serialize(const STORM_t* bitmap, uint8_t* dst) {
+    if (bitmap == NULL) return -1;
+    if (dst == NULL) return -2;
+
+    STORM_file_header_t header;
+    STORM_file_header_init(bitmap, &header);
+    memcpy(dst, &header, sizeof(STORM_file_header_t));
+
+    uint64_t* index = (uint64_t*)(dst + header.index_offset);
+    uint64_t offset = sizeof(STORM_file_header_t);
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        index[i] = offset;
+        offset += STORM_record_write(&bitmap->conts[i], dst + offset);
+    }
+    index[bitmap->n_conts] = offset;
+    return 1;
+}
+
+int STORM_write_file(const STORM_t* bitmap, const char* path) {
+    if (bitmap == NULL) return -1;
+    if (path == NULL) return -2;
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) return -3;
+
+    STORM_file_header_t header;
+    STORM_file_header_init(bitmap, &header);
+    uint64_t* index = (uint64_t*)malloc(((uint64_t)bitmap->n_conts + 1) * sizeof(uint64_t));
+    uint8_t* buffer = NULL;
+    uint64_t m_buffer = 0;
+    int ret = index == NULL ? -5 : 1;
+
+    if (ret == 1 && fwrite(&header, sizeof(STORM_file_header_t), 1, f) != 1) ret = -4;
+
+    uint64_t offset = sizeof(STORM_file_header_t);
+    for (uint32_t i = 0; i < bitmap->n_conts && ret == 1; ++i) {
+        const uint64_t size = STORM_record_size(&bitmap->conts[i]);
+        if (size > m_buffer) {
+            free(buffer);
+            m_buffer = size + 65536;
+            buffer = (uint8_t*)malloc(m_buffer);
+            if (buffer == NULL) {
+                ret = -5;
+                break;
+            }
+        }
+        STORM_record_write(&bitmap->conts[i], buffer);
+        if (fwrite(buffer, 1, size, f) != size) ret = -4;
+        index[i] = offset;
+        offset += size;
+    }
+    if (ret == 1) index[bitmap->n_conts] = offset;
+
+    if (ret == 1 && fwrite(index, sizeof(uint64_t), (uint64_t)bitmap->n_conts + 1, f) != (uint64_t)bitmap->n_conts + 1) ret = -4;
+    if (fclose(f) != 0 && ret == 1) ret = -4;
+    // Do not leave a truncated file behind.
+    if (ret != 1) remove(path);
+
+    free(buffer);
+    free(index);
+    return ret;
+}
+
+// Checks a header against the size of its file. Returns 1 if it is valid.
+static int STORM_file_header_check(const STORM_file_header_t* header, const uint64_t size) {
+    if (memcmp(header->magic, STORM_FILE_MAGIC, sizeof(STORM_FILE_MAGIC)) != 0) return 0;
+    if (header->version != STORM_FILE_VERSION) return 0;
+    if (header->byte_order != STORM_FILE_BOM) return 0;
+    if (STORM_valid_block_size(header->block_size) == 0) return 0;
+    if (header->file_size != size) return 0;
+    if (header->index_offset < sizeof(STORM_file_header_t) || header->index_offset % 8) return 0;
+    if (header->n_conts > (size - sizeof(STORM_file_header_t)) / sizeof(uint64_t)) return 0;
+    if (header->index_offset > size || size - header->index_offset != ((uint64_t)header->n_conts + 1) * sizeof(uint64_t)) return 0;
+    return 1;
+}
+
+// Records lie between the header and the index, aligned and in order.
+// Returns 1 if the index is valid.
+static int STORM_file_index_check(const uint64_t* index, const STORM_file_header_t* header) {
+    if (header->n_conts && index[0] < sizeof(STORM_file_header_t)) return 0;
+    for (uint32_t i = 0; i < header->n_conts; ++i) {
+        if (index[i] % STORM_FILE_ALIGNMENT || index[i] > index[i+1] || index[i+1] > header->index_offset)
+            return 0;
+    }
+    return 1;
+}
+
+// Builds a model that borrows all of its data from a serialized buffer.
+static STORM_t* STORM_view_buffer(const uint8_t* src, const uint64_t size) {
+    if (size < sizeof(STORM_file_header_t)) return NULL;
+    if (((uintptr_t)src % STORM_FILE_ALIGNMENT) != 0) return NULL;
+
+    const STORM_file_header_t* header = (const STORM_file_header_t*)src;
+    if (STORM_file_header_check(header, size) == 0) return NULL;
+
+    const uint64_t* index = (const uint64_t*)(src + header->index_offset);
+    STORM_t* bitmap = STORM_new();
+    if (bitmap == NULL) return NULL;
+    bitmap->block_size = header->block_size;
+    bitmap->m_conts = header->n_conts;
+    bitmap->conts   = (STORM_bitmap_cont_t*)malloc(((uint64_t)header->n_conts == 0 ? 1 : header->n_conts) * sizeof(STORM_bitmap_cont_t));
+    if (bitmap->conts == NULL) {
+        bitmap->m_conts = 0;
+        STORM_free(bitmap);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header->n_conts; ++i) {
+        STORM_bitmap_cont_init(&bitmap->conts[i]);
+    }
+
+    if (STORM_file_index_check(index, header) == 0) {
+        STORM_free(bitmap);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header->n_conts; ++i) {
+        if (STORM_record_view(&bitmap->conts[i], src + index[i], index[i+1] - index[i], header->block_size) < 0) {
+            STORM_free(bitmap);
+            return NULL;
+        }
+        ++bitmap->n_conts;
+    }
+    return bitmap;
+}
+
+static void STORM_unmap(STORM_t* bitmap) {
+    if (bitmap->map == NULL) return;
+#if defined(_WIN32)
+    UnmapViewOfFile(bitmap->map);
+#else
+    munmap(bitmap->map, bitmap->map_size);
+#endif
+    bitmap->map = NULL;
+    bitmap->map_size = 0;
+}
+
+STORM_t* STORM_mmap_file(const char* path) {
+    if (path == NULL) return NULL;
+    void* map = NULL;
+    uint64_t size = 0;
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) == 0 || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+    size = file_size.QuadPart;
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return NULL;
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // the view keeps the mapping alive
+    if (map == NULL) return NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (map == MAP_FAILED) return NULL;
+#endif
+
+    STORM_t* bitmap = STORM_view_buffer((const uint8_t*)map, size);
+    if (bitmap == NULL) {
+#if defined(_WIN32)
+        UnmapViewOfFile(map);
+#else
+        munmap(map, size);
+#endif
+        return NULL;
+    }
+    bitmap->map      = map;
+    bitmap->map_size = size;
+    return bitmap;
+}
+
+/* *************************************
+*  Out-of-core engine
+*
+*  The rows of a STORM file are split into panels whose records fit into a
+*  third of the memory budget. Panel pairs (a,b) with a <= b are visited
+*  row by row, sweeping b alternately forwards and backwards so that
+*  consecutive steps share a resident panel and only one panel is read per
+*  step. While a step is being computed the panel of the following step is
+*  read by a loader thread into the third buffer.
+***************************************/
+
+#if defined(_WIN32)
+typedef HANDLE STORM_file_t;
+#else
+typedef int STORM_file_t;
+#endif
+
+static int STORM_file_open(const char* path, STORM_file_t* file) {
+#if defined(_WIN32)
+    *file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    return *file == INVALID_HANDLE_VALUE ? -1 : 1;
+#else
+    *file = open(path, O_RDONLY);
+    return *file < 0 ? -1 : 1;
+#endif
+}
+
+static int STORM_file_length(STORM_file_t file, uint64_t* size) {
+#if defined(_WIN32)
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) == 0) return -1;
+    *size = file_size.QuadPart;
+#else
+    struct stat st;
+    if (fstat(file, &st) != 0) return -1;
+    *size = st.st_size;
+#endif
+    return 1;
+}
+
+static void STORM_file_close(STORM_file_t file) {
+#if defined(_WIN32)
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+// Reads exactly size bytes at offset. Returns 1 on success. Reads of the
+// same file must not overlap in time.
+static int STORM_file_read(STORM_file_t file, void* dst, uint64_t size, uint64_t offset) {
+    uint8_t* out = (uint8_t*)dst;
+#if !defined(_WIN32)
+    if (lseek(file, offset, SEEK_SET) != (off_t)offset) return -1;
+#endif
+    while (size) {
+#if defined(_WIN32)
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(OVERLAPPED));
+        overlapped.Offset     = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD chunk = size > (1u << 30) ? (1u << 30) : (DWORD)size;
+        DWORD n = 0;
+        if (ReadFile(file, out, chunk, &n, &overlapped) == 0 || n == 0) return -1;
+#else
+        ssize_t n = read(file, out, size > (1u << 30) ? (1u << 30) : size);
+        if (n <= 0) return -1;
+#endif
+        out    += n;
+        offset += n;
+        size   -= n;
+    }
+    return 1;
+}
+
+typedef struct STORM_panel_s {
+    int64_t id; // panel held by this slot or -1
+    uint8_t* buffer; // aligned records of the panel
+    uint64_t m_buffer;
+    STORM_t view; // containers borrowing from buffer
+    int ret;
+} STORM_panel_t;
+
+typedef struct STORM_ooc_s {
+    STORM_file_t file;
+    const uint64_t* index; // record offsets
+    const uint32_t* panels; // first row of each panel (n_panels + 1)
+    uint32_t n_panels;
+    uint32_t block_size;
+} STORM_ooc_t;
+
+typedef struct STORM_panel_load_s {
+    const STORM_ooc_t* ooc;
+    STORM_panel_t* slot;
+    uint32_t panel;
+} STORM_panel_load_t;
+
+static int STORM_panel_load(const STORM_ooc_t* ooc, STORM_panel_t* slot, const uint32_t panel) {
+    const uint32_t begin = ooc->panels[panel], end = ooc->panels[panel + 1];
+    const uint64_t offset = ooc->index[begin];
+    const uint64_t size = ooc->index[end] - offset;
+
+    for (uint32_t i = 0; i < slot->view.n_conts; ++i) {
+        STORM_bitmap_cont_release(&slot->view.conts[i]);
+    }
+    slot->view.n_conts = 0;
+    slot->id = -1;
+
+    if (size > slot->m_buffer) {
+        STORM_aligned_free(slot->buffer);
+        slot->m_buffer = size;
+        slot->buffer = (uint8_t*)STORM_aligned_malloc(STORM_FILE_ALIGNMENT, size);
+        if (slot->buffer == NULL) {
+            slot->m_buffer = 0;
+            return -1;
+        }
+    }
+    if (STORM_file_read(ooc->file, slot->buffer, size, offset) != 1) return -2;
+
+    for (uint32_t i = begin; i < end; ++i) {
+        if (STORM_record_view(&slot->view.conts[i - begin], slot->buffer + (ooc->index[i] - offset), ooc->index[i + 1] - ooc->index[i], ooc->block_size) < 0)
+            return -3;
+        ++slot->view.n_conts;
+    }
+    slot->id = panel;
+    return 1;
+}
+
+STORM_THREAD_FUNC(STORM_panel_loader) {
+    STORM_panel_load_t* load = (STORM_panel_load_t*)arg;
+    load->slot->ret = STORM_panel_load(load->ooc, load->slot, load->panel);
+    return STORM_THREAD_RETURN;
+}
+
+static STORM_panel_t* STORM_panel_find(STORM_panel_t* slots, const uint32_t panel) {
+    for (int s = 0; s < 3; ++s) {
+        if (slots[s].id == (int64_t)panel) return &slots[s];
+    }
+    return NULL;
+}
+
+// Returns a slot holding neither of the panels a and b.
+static STORM_panel_t* STORM_panel_free_slot(STORM_panel_t* slots, const int64_t a, const int64_t b) {
+    for (int s = 0; s < 3; ++s) {
+        if (slots[s].id == -1) return &slots[s];
+    }
+    for (int s = 0; s < 3; ++s) {
+        if (slots[s].id != a && slots[s].id != b) return &slots[s];
+    }
+    return NULL;
+}
+
+/**
+ * Boustrophedon schedule over the panel pairs (a,b), a <= b. Row a starts
+ * on its diagonal and then sweeps b forwards when a is even and backwards
+ * when a is odd.
+ */
+static void STORM_ooc_schedule(const uint32_t n_panels, uint32_t* steps) {
+    uint64_t k = 0;
+    for (uint32_t a = 0; a < n_panels; ++a) {
+        steps[2*k] = a; steps[2*k+1] = a; ++k;
+        for (uint32_t q = a + 1; q < n_panels; ++q, ++k) {
+            steps[2*k]   = a;
+            steps[2*k+1] = (a % 2 == 0) ? q : n_panels - (q - a);
+        }
+    }
+}
+
+uint64_t STORM_pairw_intersect_cardinality_file(const char* path, uint64_t memory_budget, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads) {
+    if (path == NULL) return -1;
+
+    STORM_ooc_t ooc;
+    if (STORM_file_open(path, &ooc.file) != 1) return -1;
+
+    STORM_file_header_t header;
+    uint64_t size = 0;
+    if (STORM_file_length(ooc.file, &size) != 1 || size < sizeof(STORM_file_header_t) ||
+        STORM_file_read(ooc.file, &header, sizeof(STORM_file_header_t), 0) != 1 ||
+        STORM_file_header_check(&header, size) == 0)
+    {
+        STORM_file_close(ooc.file);
+        return -1;
+    }
+
+    const uint32_t n = header.n_conts;
+    uint64_t* index = (uint64_t*)malloc(((uint64_t)n + 1) * sizeof(uint64_t));
+    if (index == NULL ||
+        STORM_file_read(ooc.file, index, ((uint64_t)n + 1) * sizeof(uint64_t), header.index_offset) != 1 ||
+        STORM_file_index_check(index, &header) == 0)
+    {
+        free(index);
+        STORM_file_close(ooc.file);
+        return -1;
+    }
+
+    // Greedily pack consecutive records into panels of at most a third of
+    // the budget. A single record larger than that forms its own panel.
+    const uint64_t panel_bytes = memory_budget / 3;
+    uint32_t* panels = (uint32_t*)malloc(((uint64_t)n + 2) * sizeof(uint32_t));
+    if (panels == NULL) {
+        free(index);
+        STORM_file_close(ooc.file);
+        return -1;
+    }
+    uint32_t n_panels = 0, max_rows = 1;
+    panels[0] = 0;
+    for (uint32_t i = 0; i < n; /**/) {
+        uint32_t end = i + 1;
+        while (end < n && index[end + 1] - index[i] <= panel_bytes) ++end;
+        max_rows = end - i > max_rows ? end - i : max_rows;
+        panels[++n_panels] = end;
+        i = end;
+    }
+
+    if (bsize == 0) {
+        const uint64_t average_size = n ? (index[n] - index[0]) / n : 1;
+        bsize = ceil((double)STORM_get_cache_block_size(header.block_size / 64) / (average_size == 0 ? 1 : average_size));
+    }
+    bsize = bsize < 5 ? 5 : bsize;
+
+    ooc.index    = index;
+    ooc.panels   = panels;
+    ooc.n_panels = n_panels;
+    ooc.block_size = header.block_size;
+
+    int ret = 1;
+    STORM_panel_t slots[3];
+    for (int s = 0; s < 3; ++s) {
+        memset(&slots[s], 0, sizeof(STORM_panel_t));
+        slots[s].id = -1;
+        slots[s].view.conts = (STORM_bitmap_cont_t*)malloc((uint64_t)max_rows * sizeof(STORM_bitmap_cont_t));
+        if (slots[s].view.conts == NULL) {
+            ret = -5;
+            continue;
+        }
+        for (uint32_t i = 0; i < max_rows; ++i) STORM_bitmap_cont_init(&slots[s].view.conts[i]);
+        slots[s].view.m_conts = max_rows;
+    }
+
+    const uint64_t n_steps = ((uint64_t)n_panels * (n_panels + 1)) / 2;
+    uint32_t* steps = (uint32_t*)malloc((n_steps == 0 ? 1 : n_steps) * 2 * sizeof(uint32_t));
+    if (steps == NULL) ret = -5;
+    else STORM_ooc_schedule(n_panels, steps);
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    job.func   = STORM_get_intersect_count_func(header.block_size / 64);
+    job.kernel = &STORM_tile_kernel_storm;
+    STORM_visitor_t visitor;
+    visitor.callback  = callback;
+    visitor.user_data = user_data;
+    if (callback != NULL) bsize = STORM_job_set_callback(&job, &visitor, bsize, max_rows);
+
+    uint64_t total = 0;
+    for (uint64_t k = 0; k < n_steps && ret == 1 && job.abort == 0; ++k) {
+        const uint32_t a = steps[2*k], b = steps[2*k+1];
+
+        // Panels not brought in by the loader are read synchronously.
+        for (int p = 0; p < 2 && ret == 1; ++p) {
+            const uint32_t panel = p ? b : a;
+            if (STORM_panel_find(slots, panel) == NULL)
+                ret = STORM_panel_load(&ooc, STORM_panel_free_slot(slots, a, b), panel);
+        }
+        if (ret != 1) break;
+        STORM_panel_t* left  = STORM_panel_find(slots, a);
+        STORM_panel_t* right = STORM_panel_find(slots, b);
+
+        // Prefetch the panel of the next step that is not yet resident.
+        STORM_thread_t loader;
+        STORM_panel_load_t load;
+        int loading = 0;
+        if (k + 1 < n_steps) {
+            for (int p = 0; p < 2 && loading == 0; ++p) {
+                const uint32_t panel = steps[2*(k+1) + p];
+                if (STORM_panel_find(slots, panel) != NULL) continue;
+                load.ooc   = &ooc;
+                load.slot  = STORM_panel_free_slot(slots, a, b);
+                load.panel = panel;
+                load.slot->id = -1;
+                // Without a loader thread the panel is read synchronously next step.
+                loading = STORM_thread_create(loader, STORM_panel_loader, &load) == 0;
+            }
+        }
+
+        job.left       = &left->view;
+        job.right      = &right->view;
+        job.row_offset = panels[a];
+        job.col_offset = panels[b];
+        const uint32_t max_left  = STORM_max_bitmaps(&left->view);
+        const uint32_t max_right = STORM_max_bitmaps(&right->view);
+        job.n_out = 2*(max_left > max_right ? max_left : max_right);
+
+        const uint64_t sum = a == b ? STORM_run_triangle(&job, left->view.n_conts, bsize, n_threads)
+                                    : STORM_run_rect(&job, left->view.n_conts, right->view.n_conts, bsize, n_threads);
+        if (job.error) ret = -5;
+        else total += sum;
+
+        if (loading) {
+            STORM_thread_join(loader);
+            if (load.slot->ret != 1) ret = load.slot->ret;
+        }
+    }
+
+    for (int s = 0; s < 3; ++s) {
+        for (uint32_t i = 0; i < slots[s].view.m_conts; ++i) STORM_bitmap_cont_release(&slots[s].view.conts[i]);
+        free(slots[s].view.conts);
+        STORM_aligned_free(slots[s].buffer);
+    }
+    free(steps);
+    free(panels);
+    free(index);
+    STORM_file_close(ooc.file);
+    return ret == 1 ? total : (uint64_t)-1;
+}
+
+/* *************************************
+*  Square (A x B) comparisons
+***************************************/
+
+// Shared engine for the A x B entry points. The job may carry a tile
+// visitor set up by the caller.
+static uint64_t STORM_square_engine(const STORM_t* bitmap1, const STORM_t* bitmap2, const uint32_t bsize, const uint32_t n_threads, STORM_job_t* job) {
+    if (bitmap1->block_size != bitmap2->block_size) return -1;
+
+    const uint32_t max1 = STORM_max_bitmaps(bitmap1);
+    const uint32_t max2 = STORM_max_bitmaps(bitmap2);
+
+    job->left   = bitmap1;
+    job->right  = bitmap2;
+    job->func   = STORM_get_intersect_count_func(bitmap1->block_size / 64);
+    job->kernel = &STORM_tile_kernel_storm;
+    job->n_out  = 2*(max1 > max2 ? max1 : max2);
+
+    return STORM_run_rect(job, bitmap1->n_conts, bitmap2->n_conts, bsize, n_threads);
+}
+
+uint64_t STORM_intersect_cardinality_square(const STORM_t* STORM_RESTRICT bitmap1, const STORM_t* STORM_RESTRICT bitmap2) {
+    return STORM_intersect_cardinality_square_threads(bitmap1, bitmap2, 0, 1);
+}
+
+uint64_t STORM_intersect_cardinality_square_threads(const STORM_t* bitmap1, const STORM_t* bitmap2, uint32_t bsize, uint32_t n_threads) {
+    if (bitmap1 == NULL) return -1;
+    if (bitmap2 == NULL) return -1;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap1);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_square_engine(bitmap1, bitmap2, bsize, n_threads, &job);
+}
+
+uint64_t STORM_intersect_cardinality_square_matrix(const STORM_t* bitmap1, const STORM_t* bitmap2, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads) {
+    if (bitmap1 == NULL) return -1;
+    if (bitmap2 == NULL) return -1;
+    if (out == NULL) return -2;
+    if (out->layout != STORM_LAYOUT_FULL) return -3;
+    if (out->n_rows < bitmap1->n_conts || out->n_cols < bitmap2->n_conts) return -3;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap1);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_matrix_rect(&job, out, bsize, bitmap1->n_conts > bitmap2->n_conts ? bitmap1->n_conts : bitmap2->n_conts);
+    return STORM_square_engine(bitmap1, bitmap2, bsize, n_threads, &job);
+}
+
+uint64_t STORM_intersect_cardinality_square_visit(const STORM_t* bitmap1, const STORM_t* bitmap2, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads) {
+    if (bitmap1 == NULL) return -1;
+    if (bitmap2 == NULL) return -1;
+    if (callback == NULL) return -2;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap1);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_visitor_t visitor;
+    visitor.callback  = callback;
+    visitor.user_data = user_data;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_callback(&job, &visitor, bsize, bitmap1->n_conts > bitmap2->n_conts ? bitmap1->n_conts : bitmap2->n_conts);
+    return STORM_square_engine(bitmap1, bitmap2, bsize, n_threads, &job);
+}
+
+/* *************************************
+*  Incremental updates
+*
+*  When vectors [n_old, n) are appended to a set whose pairs are already
+*  counted, only the new x old rectangle and the new x new triangle are
+*  computed. Both run on views of the vector array, with the job offsets
+*  set to the global position of the views. Removal moves the last vector
+*  into the freed position so that a single row and column change.
+***************************************/
+
+// A view of the vectors [begin, end) of bitmap.
+static STORM_t STORM_view(const STORM_t* bitmap, const uint32_t begin, const uint32_t end) {
+    STORM_t view = *bitmap;
+    view.conts   = bitmap->conts + begin;
+    view.n_conts = end - begin;
+    view.m_conts = end - begin;
+    return view;
+}
+
+uint64_t STORM_incremental_update(STORM_incremental_t* inc, STORM_t* bitmap, uint32_t bsize, uint32_t n_threads) {
+    if (inc == NULL) return -1;
+    if (bitmap == NULL) return -1;
+    if (inc->n_vectors > bitmap->n_conts) return -1;
+    if (inc->out != NULL && inc->out->n_rows < bitmap->n_conts) return -1;
+
+    const uint32_t n_old = inc->n_vectors;
+    const uint32_t n = bitmap->n_conts;
+    if (n_old == n) return inc->total;
+
+    if (bsize == 0) bsize = STORM_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_t old_view = STORM_view(bitmap, 0, n_old);
+    STORM_t new_view = STORM_view(bitmap, n_old, n);
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    if (inc->out != NULL) {
+        for (uint32_t i = n_old; i < n; ++i) {
+            STORM_result_store_diagonal(inc->out, i, STORM_bitmap_cont_cardinality(&bitmap->conts[i]));
+        }
+        bsize = STORM_job_set_matrix(&job, inc->out, bsize, n);
+    }
+
+    // inc is left unchanged if the tiles cannot be scheduled.
+    job.row_offset = n_old;
+    const uint64_t added = n_old != 0 ? STORM_square_engine(&new_view, &old_view, bsize, n_threads, &job) : 0;
+    job.col_offset = n_old;
+    const uint64_t added_new = job.error ? 0 : STORM_pairw_engine(&new_view, bsize, n_threads, &job);
+    if (job.error) return -1;
+    inc->total += added + added_new;
+    inc->n_vectors = n;
+    return inc->total;
+}
+
+int STORM_remove(STORM_t* bitmap, uint32_t index) {
+    if (bitmap == NULL) return -1;
+    if (index >= bitmap->n_conts) return -2;
+
+    // Keep the memory of the removed container around for reuse.
+    const uint32_t last = bitmap->n_conts - 1;
+    STORM_bitmap_cont_t removed = bitmap->conts[index];
+    bitmap->conts[index] = bitmap->conts[last];
+    bitmap->conts[last]  = removed;
+    STORM_bitmap_cont_clear(&bitmap->conts[last]);
+    --bitmap->n_conts;
+    return 1;
+}
+
+uint64_t STORM_incremental_remove(STORM_incremental_t* inc, STORM_t* bitmap, uint32_t index, uint32_t n_threads) {
+    if (inc == NULL) return -1;
+    if (bitmap == NULL) return -1;
+    if (inc->n_vectors != bitmap->n_conts) return -1;
+    if (index >= bitmap->n_conts) return -1;
+
+    const uint32_t last = bitmap->n_conts - 1;
+    if (inc->out != NULL) {
+        inc->total -= STORM_result_row_sum(inc->out, index, bitmap->n_conts);
+        if (index != last) STORM_result_move(inc->out, index, last);
+    } else {
+        // The row against all vectors includes |Xk & Xk| = |Xk|.
+        STORM_t row = STORM_view(bitmap, index, index + 1);
+        STORM_job_t job;
+        memset(&job, 0, sizeof(STORM_job_t));
+        const uint32_t bsize = STORM_guess_bsize(bitmap);
+        const uint64_t row_sum = STORM_square_engine(&row, bitmap, bsize < 5 ? 5 : bsize, n_threads, &job);
+        if (job.error) return -1;
+        inc->total -= row_sum - STORM_bitmap_cont_cardinality(&bitmap->conts[index]);
+    }
+
+    STORM_remove(bitmap, index);
+    inc->n_vectors = bitmap->n_conts;
+    return inc->total;
+}
+
+// contig
+
+// Contiguous memory bitmaps
+// struct STORM_contiguous_bitmap_s {
+//     uint64_t* data; // not owner of this data
+//     uint32_t* scalar; // not owner of this data
+//     // width of data is described outside
+//     uint32_t n_scalar; // copy from outside
+// };
+
+// struct STORM_contiguous_s {
+//     uint64_t* data; // bitmaps
+//     uint32_t* scalar; // scalar values
+//     uint32_t* n_scalar; // scalar values per bitmap
+//     STORM_contiguous_bitmap_t* bitmaps; // interpret of data
+//     uint64_t n_data, m_data; // m_data is reported per _VECTOR_ not per machine word
+//     uint64_t vector_length;
+//     uint32_t n_bitmaps_vector; // _MUST_ be divisible by largest alignment!
+//     STORM_compute_func intsec_func; // determined during ctor
+//     uint32_t alignment; // determined during ctor
+//     uint32_t scalar_cutoff; // cutoff for storing scalars
+//     int own_data; // data is released by us, not adopted from the caller
+// };
+
+
+STORM_contiguous_t* STORM_contig_new(size_t vector_length) {
+    STORM_contiguous_t* all = (STORM_contiguous_t*)malloc(sizeof(STORM_contiguous_t));
+    if (all == NULL) return NULL;
+    all->data    = NULL;
+    all->scalar  = NULL;
+    all->n_scalar= NULL;
+    all->bitmaps = NULL;
+    all->n_data  = 0;
+    all->m_data  = 0;
+    all->tot_scalar = 0;
+    all->m_scalar   = 0;
+    all->vector_length = vector_length;
+    all->n_bitmaps_vector = ceil(vector_length / 64.0);
+    all->alignment     = STORM_get_alignment();
+    all->intsec_func   = STORM_get_intersect_count_func(all->n_bitmaps_vector);
+    all->scalar_cutoff = STORM_get_scalar_cutoff(vector_length);
+    all->own_data      = 1;
+    all->panels        = NULL;
+    all->n_panel_rows  = 0;
+    all->narrow        = NULL;
+    all->n_narrow_rows = 0;
+    all->narrow_words  = 0;
+    return all;
+}
+
+void STORM_contig_free(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return;
+    // for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
+    //     STORM_bitmap_cont_free(&bitmap->conts[i]);
+    // }
+    if (bitmap->own_data) STORM_aligned_free(bitmap->data);
+    free(bitmap->bitmaps);
+    STORM_aligned_free(bitmap->scalar);
+    STORM_aligned_free(bitmap->n_scalar);
+    STORM_aligned_free(bitmap->panels);
+    STORM_aligned_free(bitmap->narrow);
+}
+
+// Drops the interleaved panels and narrow rows before the vectors change.
+static void STORM_contig_drop_packed(STORM_contiguous_t* bitmap) {
+    STORM_aligned_free(bitmap->panels);
+    bitmap->panels = NULL;
+    bitmap->n_panel_rows = 0;
+    STORM_aligned_free(bitmap->narrow);
+    bitmap->narrow = NULL;
+    bitmap->n_narrow_rows = 0;
+}
+
+/**
+ * Grows the storage to hold at least m_data vectors and m_scalar list
+ * values. Buffers grow geometrically so that adding vectors one at a time
+ * copies each vector a constant number of times on average. The views in
+ * bitmaps are re-pointed into the new buffers.
+ */
+static int STORM_contig_reserve(STORM_contiguous_t* bitmap, const uint64_t m_data, const uint64_t m_scalar) {
+    STORM_contig_drop_packed(bitmap);
+    if (bitmap->scalar == NULL || m_scalar > bitmap->m_scalar) {
+        uint64_t new_m = bitmap->m_scalar ? bitmap->m_scalar : 512*32;
+        while (new_m < m_scalar) new_m *= 2;
+        uint32_t* old = bitmap->scalar;
+        uint32_t* scalar = (uint32_t*)STORM_aligned_malloc(bitmap->alignment, new_m*sizeof(uint32_t));
+        if (scalar == NULL) return -1;
+        if (old != NULL) {
+            memcpy(scalar, old, bitmap->tot_scalar*sizeof(uint32_t));
+            for (uint64_t i = 0; i < bitmap->n_data; ++i) {
+                if (bitmap->bitmaps[i].scalar != NULL) 
+                    bitmap->bitmaps[i].scalar = scalar + (bitmap->bitmaps[i].scalar - old);
+            }
+            STORM_aligned_free(old);
+        }
+        bitmap->scalar   = scalar;
+        bitmap->m_scalar = new_m;
+    }
+
+    if (bitmap->data == NULL || m_data > bitmap->m_data) {
+        uint64_t new_m = bitmap->m_data ? bitmap->m_data : 512;
+        while (new_m < m_data) new_m *= 2;
+        const uint64_t n_words = bitmap->n_bitmaps_vector;
+        uint64_t* data = (uint64_t*)STORM_aligned_malloc(bitmap->alignment, n_words*new_m*sizeof(uint64_t));
+        uint32_t* n_scalar = (uint32_t*)STORM_aligned_malloc(bitmap->alignment, new_m*sizeof(uint32_t));
+        STORM_contiguous_bitmap_t* bitmaps = (STORM_contiguous_bitmap_t*)realloc(bitmap->bitmaps, new_m*sizeof(STORM_contiguous_bitmap_t));
+        if (data == NULL || n_scalar == NULL || bitmaps == NULL) {
+            STORM_aligned_free(data);
+            STORM_aligned_free(n_scalar);
+            if (bitmaps != NULL) bitmap->bitmaps = bitmaps;
+            return -2;
+        }
+        if (bitmap->data != NULL) {
+            memcpy(data, bitmap->data, n_words*bitmap->n_data*sizeof(uint64_t));
+            memcpy(n_scalar, bitmap->n_scalar, bitmap->n_data*sizeof(uint32_t));
+        }
+        memset(&data[n_words*bitmap->n_data], 0, n_words*(new_m - bitmap->n_data)*sizeof(uint64_t));
+        if (bitmap->own_data) STORM_aligned_free(bitmap->data);
+        STORM_aligned_free(bitmap->n_scalar);
+
+        for (uint64_t i = 0; i < new_m; ++i) {
+            bitmaps[i].data = &data[n_words*i];
+            if (i >= bitmap->n_data) {
+                bitmaps[i].scalar   = NULL;
+                bitmaps[i].n_scalar = 0;
+            }
+        }
+        bitmap->data     = data;
+        bitmap->own_data = 1;
+        bitmap->n_scalar = n_scalar;
+        bitmap->bitmaps  = bitmaps;
+        bitmap->m_data   = new_m;
+    }
+    return 1;
+}
+
+// Sets the bits of the sorted values in the vector at position i and
+// stores them as a list at scalar if there are fewer than scalar_cutoff
+// distinct values. Returns the number of distinct values.
+static uint32_t STORM_contig_set(STORM_contiguous_t* bitmap, const uint64_t i, const uint32_t* values, const uint32_t n_values, uint32_t* scalar) {
+    uint64_t* data = bitmap->bitmaps[i].data;
+    uint32_t n_values_used = 0;
+    for (uint32_t k = 0; k < n_values; ++k) {
+        if (k != 0 && values[k] == values[k-1]) continue;
+        assert(k == 0 || values[k] > values[k-1]);
+        data[values[k] / 64] |= 1ULL << (values[k] % 64);
+        ++n_values_used;
+    }
+
+    // Add scalar values if the total number of values does not exceed
+    // the threshold scalar_cutoff.
+    if (n_values_used < bitmap->scalar_cutoff) {
+        bitmap->bitmaps[i].scalar = scalar;
+        for (uint32_t k = 0, j = 0; k < n_values; ++k) {
+            if (k != 0 && values[k] == values[k-1]) continue;
+            scalar[j++] = values[k];
+        }
+    }
+
+    bitmap->n_scalar[i] = n_values_used;
+    bitmap->bitmaps[i].n_scalar = n_values_used;
+    return n_values_used;
+}
+
+int STORM_contig_add(STORM_contiguous_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -2;
+    if (n_values == 0)  return 0;
+
+    if (STORM_contig_reserve(bitmap, bitmap->n_data + 1, bitmap->tot_scalar + n_values) < 0) return -3;
+
+    const uint32_t n_values_used = STORM_contig_set(bitmap, bitmap->n_data, values, n_values, &bitmap->scalar[bitmap->tot_scalar]);
+    if (n_values_used < bitmap->scalar_cutoff) bitmap->tot_scalar += n_values_used;
+    ++bitmap->n_data; // Advance data pointer
+
+    return n_values;
+}
+
+// Writes the positions of the n_values set bits in data to scalar in
+// ascending order.
+static void STORM_contig_extract(const uint64_t* data, const uint32_t n_values, uint32_t* scalar) {
+    uint32_t j = 0;
+    for (uint32_t w = 0; j < n_values; ++w) {
+        for (uint64_t x = data[w]; x; x &= x - 1)
+            scalar[j++] = 64*w + _mm_popcnt_u64((x & -x) - 1);
+    }
+}
+
+int STORM_contig_add_unsorted(STORM_contiguous_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+    if (bitmap == NULL) return -1;
+    if (values == NULL) return -2;
+    if (n_values == 0)  return 0;
+
+    const uint32_t m_list = n_values < bitmap->scalar_cutoff ? n_values : bitmap->scalar_cutoff;
+    if (STORM_contig_reserve(bitmap, bitmap->n_data + 1, bitmap->tot_scalar + m_list) < 0) return -3;
+
+    // Setting the bits deduplicates; the first scalar_cutoff distinct
+    // values are collected on the way in case the vector stays a list.
+    const uint64_t i = bitmap->n_data;
+    uint64_t* data = bitmap->bitmaps[i].data;
+    uint32_t* scalar = &bitmap->scalar[bitmap->tot_scalar];
+    uint32_t n_values_used = 0;
+    for (uint32_t k = 0; k < n_values; ++k) {
+        assert(values[k] < bitmap->vector_length);
+        const uint64_t bit = 1ULL << (values[k] % 64);
+        if (data[values[k] / 64] & bit) continue;
+        data[values[k] / 64] |= bit;
+        if (n_values_used < m_list) scalar[n_values_used] = values[k];
+        ++n_values_used;
+    }
+
+    if (n_values_used < bitmap->scalar_cutoff) {
+        if (n_values_used <= STORM_INSERTION_SORT_MAX) {
+            STORM_insertion_sort(scalar, n_values_used);
+        } else {
+            STORM_contig_extract(data, n_values_used, scalar);
+        }
+        bitmap->bitmaps[i].scalar = scalar;
+        bitmap->tot_scalar += n_values_used;
+    }
+    bitmap->n_scalar[i] = n_values_used;
+    bitmap->bitmaps[i].n_scalar = n_values_used;
+    ++bitmap->n_data;
+
+    return n_values;
+}
+
+static void STORM_contig_batch_count(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id) {
+    (void)id;
+    for (uint32_t i = begin; i < end; ++i) {
+        const uint32_t* values = &batch->values[batch->offsets[i]];
+        const uint32_t n_values = batch->offsets[i+1] - batch->offsets[i];
+        uint32_t n_unique = n_values != 0;
+        for (uint32_t k = 1; k < n_values; ++k) n_unique += values[k] != values[k-1];
+        batch->n_unique[i] = n_unique;
+    }
+}
+
+static void STORM_contig_batch_build(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id) {
+    (void)id;
+    STORM_contiguous_t* bitmap = (STORM_contiguous_t*)batch->target;
+    for (uint32_t i = begin; i < end; ++i) {
+        const uint64_t offset = batch->offsets[i];
+        STORM_contig_set(bitmap, bitmap->n_data + i, &batch->values[offset], batch->offsets[i+1] - offset, &bitmap->scalar[batch->scalar_offsets[i]]);
+    }
+}
+
+int STORM_contig_add_batch(STORM_contiguous_t* bitmap, const uint64_t* offsets, const uint32_t* values, const uint32_t n_vectors, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (offsets == NULL) return -2;
+    if (values == NULL && offsets[n_vectors] != offsets[0]) return -3;
+    if (n_vectors == 0) return 1;
+
+    n_threads = STORM_batch_threads(n_threads, n_vectors);
+
+    STORM_batch_t batch;
+    memset(&batch, 0, sizeof(STORM_batch_t));
+    batch.offsets  = offsets;
+    batch.values   = values;
+    batch.target   = bitmap;
+    batch.n_unique = (uint32_t*)malloc(n_vectors * sizeof(uint32_t));
+    batch.scalar_offsets = (uint64_t*)malloc(n_vectors * sizeof(uint64_t));
+    if (batch.n_unique == NULL || batch.scalar_offsets == NULL) {
+        free(batch.n_unique);
+        free(batch.scalar_offsets);
+        return -4;
+    }
+
+    // First pass: size the lists so that every vector knows where its list
+    // goes before any worker writes.
+    batch.func = &STORM_contig_batch_count;
+    if (STORM_batch_run(&batch, n_vectors, n_threads) < 0) {
+        free(batch.n_unique);
+        free(batch.scalar_offsets);
+        return -5;
+    }
+
+    uint64_t tot_scalar = bitmap->tot_scalar;
+    for (uint32_t i = 0; i < n_vectors; ++i) {
+        batch.scalar_offsets[i] = tot_scalar;
+        if (batch.n_unique[i] < bitmap->scalar_cutoff) tot_scalar += batch.n_unique[i];
+    }
+
+    int ret = STORM_contig_reserve(bitmap, bitmap->n_data + n_vectors, tot_scalar);
+    batch.func = &STORM_contig_batch_build;
+    if (ret >= 0 && STORM_batch_run(&batch, n_vectors, n_threads) == 1) {
+        bitmap->n_data += n_vectors;
+        bitmap->tot_scalar = tot_scalar;
+        ret = 1;
+    } else {
+        ret = -5;
+    }
+
+    free(batch.n_unique);
+    free(batch.scalar_offsets);
+    return ret;
+}
+
+// Computes the counts and builds the lists for the n_rows rows starting at
+// position first, whose bits are already set, and makes them visible.
+static int STORM_contig_index_rows(STORM_contiguous_t* bitmap, const uint64_t first, const uint64_t n_rows) {
+    const uint64_t n_words = bitmap->n_bitmaps_vector;
+    uint64_t tot_scalar = bitmap->tot_scalar;
+    for (uint64_t i = first; i < first + n_rows; ++i) {
+        const uint32_t n_values = STORM_popcnt(bitmap->bitmaps[i].data, n_words*sizeof(uint64_t));
+        bitmap->n_scalar[i] = n_values;
+        bitmap->bitmaps[i].n_scalar = n_values;
+        bitmap->bitmaps[i].scalar = NULL;
+        if (n_values < bitmap->scalar_cutoff) tot_scalar += n_values;
+    }
+
+    if (STORM_contig_reserve(bitmap, first + n_rows, tot_scalar) < 0) return -1;
+    for (uint64_t i = first; i < first + n_rows; ++i) {
+        if (bitmap->n_scalar[i] >= bitmap->scalar_cutoff) continue;
+        bitmap->bitmaps[i].scalar = &bitmap->scalar[bitmap->tot_scalar];
+        STORM_contig_extract(bitmap->bitmaps[i].data, bitmap->n_scalar[i], bitmap->bitmaps[i].scalar);
+        bitmap->tot_scalar += bitmap->n_scalar[i];
+    }
+    bitmap->n_data = first + n_rows;
+    return 1;
+}
+
+int STORM_contig_add_matrix(STORM_contiguous_t* bitmap, const uint64_t* data, const uint64_t n_rows, const uint64_t stride, const int adopt) {
+    if (bitmap == NULL) return -1;
+    if (data == NULL && n_rows != 0) return -2;
+    if (stride < bitmap->n_bitmaps_vector) return -3;
+    if (n_rows == 0) return 0;
+
+    const uint64_t n_words = bitmap->n_bitmaps_vector;
+    const uint64_t tail = bitmap->vector_length % 64 ? ~((1ULL << (bitmap->vector_length % 64)) - 1) : 0;
+    for (uint64_t i = 0; i < n_rows; ++i) {
+        if (data[i*stride + n_words - 1] & tail) return -4;
+    }
+
+    const uint64_t first = bitmap->n_data;
+    if (adopt && first == 0 && stride == n_words && ((uintptr_t)data % bitmap->alignment) == 0) {
+        // Keep the lists and counts but point the rows at the caller's data.
+        if (STORM_contig_reserve(bitmap, n_rows, 0) < 0) return -5;
+        if (bitmap->own_data) STORM_aligned_free(bitmap->data);
+        bitmap->data     = (uint64_t*)data;
+        bitmap->own_data = 0;
+        bitmap->m_data   = n_rows;
+        for (uint64_t i = 0; i < n_rows; ++i) bitmap->bitmaps[i].data = &bitmap->data[n_words*i];
+    } else {
+        if (STORM_contig_reserve(bitmap, first + n_rows, 0) < 0) return -5;
+        for (uint64_t i = 0; i < n_rows; ++i) {
+            memcpy(bitmap->bitmaps[first + i].data, &data[i*stride], n_words*sizeof(uint64_t));
+        }
+    }
+
+    if (STORM_contig_index_rows(bitmap, first, n_rows) < 0) return -5;
+    return n_rows;
+}
+
+/* *************************************
+*  Column marginals
+*
+*  Every value k held by c_k vectors is counted once for each of their
+*  C(c_k, 2) pairs, so the pairwise total is sum_k C(c_k, 2) and only the
+*  column counts are needed. Contiguous bitmaps are counted row by row into
+*  bit-sliced counters: slice s of a word holds bit s of the counts of its
+*  64 columns, and adding a row ripples a carry through the slices. The
+*  slices are flushed into plain counts before they can overflow. For a
+*  STORM_t the blocks are bucketed by block id and each bucket is scattered
+*  into one block of counters, which is then read back and cleared by
+*  walking the same blocks again.
+***************************************/
+
+#define STORM_MARGINAL_SLICES 8 // counts up to 255 rows between flushes
+
+typedef void (*STORM_slice_add_func)(uint64_t* STORM_RESTRICT slices, const uint64_t* STORM_RESTRICT row, const uint32_t begin, const uint32_t n_words);
+
+static void STORM_slice_add_scalar(uint64_t* STORM_RESTRICT slices, const uint64_t* STORM_RESTRICT row, const uint32_t begin, const uint32_t n_words) {
+    for (uint32_t w = begin; w < n_words; ++w) {
+        uint64_t carry = row[w];
+        for (uint32_t k = 0; k < STORM_MARGINAL_SLICES && carry; ++k) {
+            const uint64_t t = slices[k*n_words + w] & carry;
+            slices[k*n_words + w] ^= carry;
+            carry = t;
+        }
+    }
+}
+
+#if defined(STORM_HAVE_AVX2)
+STORM_TARGET("avx2")
+static void STORM_slice_add_avx2(uint64_t* STORM_RESTRICT slices, const uint64_t* STORM_RESTRICT row, const uint32_t begin, const uint32_t n_words) {
+    uint32_t w = begin;
+    for (/**/; w + 4 <= n_words; w += 4) {
+        __m256i carry = _mm256_loadu_si256((const __m256i*)&row[w]);
+        for (uint32_t k = 0; k < STORM_MARGINAL_SLICES; ++k) {
+            if (_mm256_testz_si256(carry, carry)) break;
+            __m256i* s = (__m256i*)&slices[k*n_words + w];
+            const __m256i v = _mm256_loadu_si256(s);
+            _mm256_storeu_si256(s, _mm256_xor_si256(v, carry));
+            carry = _mm256_and_si256(v, carry);
+        }
+    }
+    STORM_slice_add_scalar(slices, row, w, n_words);
+}
+#endif
+
+static STORM_slice_add_func STORM_get_slice_add_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_slice_add_avx2;
+#endif
+    return &STORM_slice_add_scalar;
+}
+
+// Adds the bit-sliced counters to counts and clears them.
+static void STORM_slice_flush(uint64_t* slices, const uint32_t n_words, uint64_t* counts) {
+    for (uint32_t k = 0; k < STORM_MARGINAL_SLICES; ++k) {
+        for (uint32_t w = 0; w < n_words; ++w) {
+            for (uint64_t x = slices[k*n_words + w]; x; x &= x - 1)
+                counts[64*w + _mm_popcnt_u64((x & -x) - 1)] += 1ULL << k;
+            slices[k*n_words + w] = 0;
+        }
+    }
+}
+
+// Counts the set bits of every column over all rows into counts, which
+// holds 64 * n_bitmaps_vector entries.
+static int STORM_contig_count_columns(const STORM_contiguous_t* bitmap, uint64_t* counts) {
+    const uint32_t n_words = bitmap->n_bitmaps_vector;
+    memset(counts, 0, 64*(uint64_t)n_words*sizeof(uint64_t));
+    uint64_t* slices = (uint64_t*)calloc(STORM_MARGINAL_SLICES*(uint64_t)n_words, sizeof(uint64_t));
+    if (slices == NULL) return -1;
+
+    const STORM_slice_add_func add = STORM_get_slice_add_func();
+    const uint32_t max_rows = (1 << STORM_MARGINAL_SLICES) - 1;
+    for (uint64_t i = 0; i < bitmap->n_data; /**/) {
+        const uint64_t end = i + max_rows < bitmap->n_data ? i + max_rows : bitmap->n_data;
+        for (/**/; i < end; ++i) (*add)(slices, &bitmap->data[i*n_words], 0, n_words);
+        STORM_slice_flush(slices, n_words, counts);
+    }
+    free(slices);
+    return 1;
+}
+
+int STORM_contig_column_counts(const STORM_contiguous_t* bitmap, uint64_t* counts) {
+    if (bitmap == NULL) return -1;
+    if (counts == NULL) return -2;
+
+    // The padding bits past vector_length are never set.
+    if (bitmap->vector_length == 64*(uint64_t)bitmap->n_bitmaps_vector)
+        return STORM_contig_count_columns(bitmap, counts) < 0 ? -3 : 1;
+
+    uint64_t* all = (uint64_t*)malloc(64*(uint64_t)bitmap->n_bitmaps_vector*sizeof(uint64_t));
+    if (all == NULL) return -3;
+    if (STORM_contig_count_columns(bitmap, all) < 0) {
+        free(all);
+        return -3;
+    }
+    memcpy(counts, all, bitmap->vector_length*sizeof(uint64_t));
+    free(all);
+    return 1;
+}
+
+uint64_t STORM_contig_pairw_intersect_cardinality_total(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return -1;
+
+    const uint64_t n_columns = 64*(uint64_t)bitmap->n_bitmaps_vector;
+    uint64_t* counts = (uint64_t*)malloc((n_columns == 0 ? 1 : n_columns)*sizeof(uint64_t));
+    if (counts == NULL) return -1;
+    if (STORM_contig_count_columns(bitmap, counts) < 0) {
+        free(counts);
+        return -1;
+    }
+
+    uint64_t total = 0;
+    for (uint64_t k = 0; k < n_columns; ++k) {
+        total += counts[k] * (counts[k] - 1) / 2;
+    }
+    free(counts);
+    return total;
+}
+
+// Adds one to the counter of every value of a block.
+static void STORM_marginal_scatter(const STORM_bitmap_t* x, uint32_t* counts) {
+    if (x->n_runs) {
+        for (uint32_t r = 0; r < x->n_runs; ++r) {
+            const uint32_t end = (uint32_t)x->scalar[2*r] + x->scalar[2*r+1];
+            for (uint32_t v = x->scalar[2*r]; v <= end; ++v) ++counts[v];
+        }
+    } else if (x->n_bitmap) {
+        for (uint32_t w = 0; w < x->n_bitmap; ++w) {
+            for (uint64_t y = x->data[w]; y; y &= y - 1)
+                ++counts[64*w + _mm_popcnt_u64((y & -y) - 1)];
+        }
+    } else {
+        for (uint32_t i = 0; i < x->n_scalar; ++i) ++counts[x->scalar[i]];
+    }
+}
+
+// Returns the sum of C(c, 2) over the counters of the values of a block
+// and clears them, so that every counter is taken once.
+static uint64_t STORM_marginal_gather(const STORM_bitmap_t* x, uint32_t* counts) {
+    uint64_t total = 0;
+    if (x->n_runs) {
+        for (uint32_t r = 0; r < x->n_runs; ++r) {
+            const uint32_t end = (uint32_t)x->scalar[2*r] + x->scalar[2*r+1];
+            for (uint32_t v = x->scalar[2*r]; v <= end; ++v) {
+                total += (uint64_t)counts[v] * (counts[v] - 1) / 2;
+                counts[v] = 0;
+            }
+        }
+    } else if (x->n_bitmap) {
+        for (uint32_t w = 0; w < x->n_bitmap; ++w) {
+            for (uint64_t y = x->data[w]; y; y &= y - 1) {
+                const uint32_t v = 64*w + _mm_popcnt_u64((y & -y) - 1);
+                total += (uint64_t)counts[v] * (counts[v] - 1) / 2;
+                counts[v] = 0;
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < x->n_scalar; ++i) {
+            const uint32_t v = x->scalar[i];
+            total += (uint64_t)counts[v] * (counts[v] - 1) / 2;
+            counts[v] = 0;
+        }
+    }
+    return total;
+}
+
+// Position of id in the sorted array ids, which must hold it.
+static uint32_t STORM_marginal_find(const uint32_t* ids, const uint32_t n_ids, const uint32_t id) {
+    uint32_t lo = 0, hi = n_ids;
+    while (hi - lo > 1) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (ids[mid] <= id) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The blocks of a STORM_t bucketed by block id. Block g is the g-th block
+// in container order and bucket s holds blocks[order[offsets[s]]] to
+// blocks[order[offsets[s+1]-1]].
+typedef struct STORM_buckets_s {
+    const STORM_bitmap_t** blocks;
+    uint32_t* order;
+    uint64_t* offsets; // n_buckets + 1
+    uint64_t* first; // first block of each container (n_conts + 1)
+    uint32_t n_buckets;
+} STORM_buckets_t;
+
+static void STORM_buckets_free(STORM_buckets_t* buckets) {
+    free(buckets->blocks);
+    free(buckets->order);
+    free(buckets->offsets);
+    free(buckets->first);
+}
+
+static int STORM_buckets_build(const STORM_t* bitmap, STORM_buckets_t* buckets) {
+    memset(buckets, 0, sizeof(STORM_buckets_t));
+    buckets->first = (uint64_t*)malloc((bitmap->n_conts + 1) * sizeof(uint64_t));
+    if (buckets->first == NULL) return -1;
+    buckets->first[0] = 0;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        buckets->first[i+1] = buckets->first[i] + bitmap->conts[i].n_bitmaps;
+    }
+    const uint64_t n_blocks = buckets->first[bitmap->n_conts];
+    if (n_blocks == 0) return 1;
+    if (n_blocks > UINT32_MAX / 2) return -1;
+
+    // Distinct block ids in ascending order.
+    uint32_t* buffer = (uint32_t*)malloc(2*n_blocks*sizeof(uint32_t));
+    buckets->blocks = (const STORM_bitmap_t**)malloc(n_blocks*sizeof(STORM_bitmap_t*));
+    buckets->order  = (uint32_t*)malloc(n_blocks*sizeof(uint32_t));
+    if (buffer == NULL || buckets->blocks == NULL || buckets->order == NULL) {
+        free(buffer);
+        return -1;
+    }
+    for (uint32_t i = 0, g = 0; i < bitmap->n_conts; ++i) {
+        for (uint32_t k = 0; k < bitmap->conts[i].n_bitmaps; ++k, ++g) {
+            buffer[g] = bitmap->conts[i].block_ids[k];
+            buckets->blocks[g] = &bitmap->conts[i].bitmaps[k];
+        }
+    }
+    uint32_t* ids = STORM_radix_sort(buffer, &buffer[n_blocks], n_blocks, 0, 32);
+    uint32_t n_ids = 1;
+    for (uint32_t g = 1; g < n_blocks; ++g) {
+        if (ids[g] != ids[n_ids - 1]) ids[n_ids++] = ids[g];
+    }
+
+    buckets->offsets = (uint64_t*)calloc(n_ids + 1, sizeof(uint64_t));
+    if (buckets->offsets == NULL) {
+        free(buffer);
+        return -1;
+    }
+    for (uint32_t g = 0; g < n_blocks; ++g) {
+        ++buckets->offsets[STORM_marginal_find(ids, n_ids, buckets->blocks[g]->id) + 1];
+    }
+    for (uint32_t s = 0; s < n_ids; ++s) buckets->offsets[s+1] += buckets->offsets[s];
+    for (uint32_t g = 0; g < n_blocks; ++g) {
+        buckets->order[buckets->offsets[STORM_marginal_find(ids, n_ids, buckets->blocks[g]->id)]++] = g;
+    }
+    // Filling advanced every offset to the end of its bucket.
+    for (uint32_t s = n_ids; s > 0; --s) buckets->offsets[s] = buckets->offsets[s-1];
+    buckets->offsets[0] = 0;
+    buckets->n_buckets = n_ids;
+
+    free(buffer);
+    return 1;
+}
+
+uint64_t STORM_pairw_intersect_cardinality_total(STORM_t* bitmap) {
+    if (bitmap == NULL) return -1;
+
+    STORM_buckets_t buckets;
+    uint32_t* counts = (uint32_t*)calloc(bitmap->block_size, sizeof(uint32_t));
+    if (STORM_buckets_build(bitmap, &buckets) < 0 || counts == NULL) {
+        STORM_buckets_free(&buckets);
+        free(counts);
+        return -1;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t s = 0; s < buckets.n_buckets; ++s) {
+        const uint64_t begin = buckets.offsets[s], end = buckets.offsets[s+1];
+        if (end - begin < 2) continue; // a single block pairs with nothing
+        for (uint64_t b = begin; b < end; ++b) STORM_marginal_scatter(buckets.blocks[buckets.order[b]], counts);
+        for (uint64_t b = begin; b < end; ++b) total += STORM_marginal_gather(buckets.blocks[buckets.order[b]], counts);
+    }
+
+    STORM_buckets_free(&buckets);
+    free(counts);
+    return total;
+}
+
+/* *************************************
+*  Row degrees
+*
+*  The weighted degree of vector i, sum_{j != i} |Xi & Xj|, is
+*  sum_{k in Xi} c_k - |Xi| given the column counts c_k. Lists gather
+*  their counts (eight at a time with AVX2) and dense rows take the
+*  weighted popcount: every byte of a word is expanded into a lane mask
+*  that selects the counts of its set bits. For a STORM_t the weight of
+*  every block is computed bucket by bucket and then summed per row.
+***************************************/
+
+typedef uint64_t (*STORM_gather16_func)(const uint32_t* STORM_RESTRICT counts, const uint16_t* STORM_RESTRICT list, const uint32_t n);
+typedef uint64_t (*STORM_gather32_func)(const uint32_t* STORM_RESTRICT counts, const uint32_t* STORM_RESTRICT list, const uint32_t n);
+typedef uint64_t (*STORM_weighted_popcnt_func)(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT counts, const uint32_t n_words);
+
+static uint64_t STORM_gather16_scalar(const uint32_t* STORM_RESTRICT counts, const uint16_t* STORM_RESTRICT list, const uint32_t n) {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < n; ++i) sum += counts[list[i]];
+    return sum;
+}
+
+static uint64_t STORM_gather32_scalar(const uint32_t* STORM_RESTRICT counts, const uint32_t* STORM_RESTRICT list, const uint32_t n) {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < n; ++i) sum += counts[list[i]];
+    return sum;
+}
+
+static uint64_t STORM_weighted_popcnt_scalar(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT counts, const uint32_t n_words) {
+    uint64_t sum = 0;
+    for (uint32_t w = 0; w < n_words; ++w) {
+        for (uint64_t x = data[w]; x; x &= x - 1)
+            sum += counts[64*w + _mm_popcnt_u64((x & -x) - 1)];
+    }
+    return sum;
+}
+
+#if defined(STORM_HAVE_AVX2)
+STORM_TARGET("avx2")
+static __m256i STORM_add_epu32_avx2(const __m256i sum, const __m256i v) {
+    return _mm256_add_epi64(_mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v))),
+                            _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_hsum64_avx2(const __m256i v) {
+    const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return (uint64_t)_mm_cvtsi128_si64(sum) + (uint64_t)_mm_extract_epi64(sum, 1);
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_gather16_avx2(const uint32_t* STORM_RESTRICT counts, const uint16_t* STORM_RESTRICT list, const uint32_t n) {
+    __m256i sum = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (/**/; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&list[i]));
+        sum = STORM_add_epu32_avx2(sum, _mm256_i32gather_epi32((const int*)counts, v, 4));
+    }
+    return STORM_hsum64_avx2(sum) + STORM_gather16_scalar(counts, &list[i], n - i);
+}
+
+// Indices must be below 2^31.
+STORM_TARGET("avx2")
+static uint64_t STORM_gather32_avx2(const uint32_t* STORM_RESTRICT counts, const uint32_t* STORM_RESTRICT list, const uint32_t n) {
+    __m256i sum = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (/**/; i + 8 <= n; i += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)&list[i]);
+        sum = STORM_add_epu32_avx2(sum, _mm256_i32gather_epi32((const int*)counts, v, 4));
+    }
+    return STORM_hsum64_avx2(sum) + STORM_gather32_scalar(counts, &list[i], n - i);
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_weighted_popcnt_avx2(const uint64_t* STORM_RESTRICT data, const uint32_t* STORM_RESTRICT counts, const uint32_t n_words) {
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i sum = _mm256_setzero_si256();
+    for (uint32_t w = 0; w < n_words; ++w) {
+        uint64_t x = data[w];
+        for (uint32_t g = 0; x; ++g, x >>= 8) {
+            if ((x & 255) == 0) continue;
+            const __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(x & 255), bits), bits);
+            const __m256i c = _mm256_loadu_si256((const __m256i*)&counts[64*w + 8*g]);
+            sum = STORM_add_epu32_avx2(sum, _mm256_and_si256(c, mask));
+        }
+    }
+    return STORM_hsum64_avx2(sum);
+}
+#endif
+
+static STORM_gather16_func STORM_get_gather16_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_gather16_avx2;
+#endif
+    return &STORM_gather16_scalar;
+}
+
+static STORM_gather32_func STORM_get_gather32_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_gather32_avx2;
+#endif
+    return &STORM_gather32_scalar;
+}
+
+static STORM_weighted_popcnt_func STORM_get_weighted_popcnt_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_weighted_popcnt_avx2;
+#endif
+    return &STORM_weighted_popcnt_scalar;
+}
+
+// Returns sum_{v in x} (counts[v] - 1).
+static uint64_t STORM_marginal_weight(const STORM_bitmap_t* x, const uint32_t* counts) {
+    if (x->n_runs) {
+        uint64_t sum = 0;
+        for (uint32_t r = 0; r < x->n_runs; ++r) {
+            const uint32_t end = (uint32_t)x->scalar[2*r] + x->scalar[2*r+1];
+            for (uint32_t v = x->scalar[2*r]; v <= end; ++v) sum += counts[v] - 1;
+        }
+        return sum;
+    } else if (x->n_bitmap) {
+        return (*STORM_get_weighted_popcnt_func())(x->data, counts, x->n_bitmap) - STORM_popcnt(x->data, x->n_bitmap*sizeof(uint64_t));
+    }
+    return (*STORM_get_gather16_func())(counts, x->scalar, x->n_scalar) - x->n_scalar;
+}
+
+typedef struct STORM_degree_s {
+    const void* source; // STORM_t or STORM_contiguous_t
+    const STORM_buckets_t* buckets;
+    const uint32_t* counts; // column counts (contiguous)
+    uint64_t* weights; // per block (STORM_t)
+    uint64_t* out;
+    volatile int ret;
+} STORM_degree_t;
+
+// Computes the weights of the blocks in buckets [begin, end).
+static void STORM_degree_buckets(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id) {
+    (void)id;
+    STORM_degree_t* degree = (STORM_degree_t*)batch->target;
+    const STORM_buckets_t* buckets = degree->buckets;
+    uint32_t* counts = (uint32_t*)calloc(((const STORM_t*)degree->source)->block_size, sizeof(uint32_t));
+    if (counts == NULL) {
+        degree->ret = -1;
+        return;
+    }
+
+    for (uint32_t s = begin; s < end; ++s) {
+        const uint64_t first = buckets->offsets[s], last = buckets->offsets[s+1];
+        if (last - first < 2) {
+            degree->weights[buckets->order[first]] = 0;
+            continue;
+        }
+        for (uint64_t b = first; b < last; ++b) STORM_marginal_scatter(buckets->blocks[buckets->order[b]], counts);
+        for (uint64_t b = first; b < last; ++b) {
+            const uint32_t g = buckets->order[b];
+            degree->weights[g] = STORM_marginal_weight(buckets->blocks[g], counts);
+        }
+        // Clears the counters; the pair count itself is not needed.
+        for (uint64_t b = first; b < last; ++b) STORM_marginal_gather(buckets->blocks[buckets->order[b]], counts);
+    }
+    free(counts);
+}
+
+// Sums the block weights of the rows [begin, end).
+static void STORM_degree_rows(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id) {
+    (void)id;
+    STORM_degree_t* degree = (STORM_degree_t*)batch->target;
+    for (uint32_t i = begin; i < end; ++i) {
+        uint64_t sum = 0;
+        for (uint64_t g = degree->buckets->first[i]; g < degree->buckets->first[i+1]; ++g) sum += degree->weights[g];
+        degree->out[i] = sum;
+    }
+}
+
+int STORM_row_degrees(STORM_t* bitmap, uint64_t* out, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (out == NULL) return -2;
+    if (bitmap->n_conts == 0) return 1;
+
+    STORM_buckets_t buckets;
+    if (STORM_buckets_build(bitmap, &buckets) < 0) {
+        STORM_buckets_free(&buckets);
+        return -3;
+    }
+    const uint64_t n_blocks = buckets.first[bitmap->n_conts];
+
+    STORM_degree_t degree;
+    memset(&degree, 0, sizeof(STORM_degree_t));
+    degree.source  = bitmap;
+    degree.buckets = &buckets;
+    degree.weights = (uint64_t*)malloc((n_blocks == 0 ? 1 : n_blocks) * sizeof(uint64_t));
+    degree.out     = out;
+    if (degree.weights == NULL) {
+        STORM_buckets_free(&buckets);
+        return -3;
+    }
+
+    STORM_batch_t batch;
+    memset(&batch, 0, sizeof(STORM_batch_t));
+    batch.target = &degree;
+    if (buckets.n_buckets) {
+        batch.offsets = buckets.offsets;
+        batch.func    = &STORM_degree_buckets;
+        if (STORM_batch_run(&batch, buckets.n_buckets, STORM_batch_threads(n_threads, buckets.n_buckets)) < 0) degree.ret = -1;
+    }
+    if (degree.ret == 0) {
+        batch.offsets = buckets.first;
+        batch.func    = &STORM_degree_rows;
+        if (STORM_batch_run(&batch, bitmap->n_conts, STORM_batch_threads(n_threads, bitmap->n_conts)) < 0) degree.ret = -1;
+    }
+
+    free(degree.weights);
+    STORM_buckets_free(&buckets);
+    return degree.ret < 0 ? -3 : 1;
+}
+
+static void STORM_contig_degree_rows(STORM_batch_t* batch, const uint32_t begin, const uint32_t end, const uint32_t id) {
+    (void)id;
+    STORM_degree_t* degree = (STORM_degree_t*)batch->target;
+    const STORM_contiguous_t* bitmap = (const STORM_contiguous_t*)degree->source;
+    const uint32_t n_words = bitmap->n_bitmaps_vector;
+    const STORM_gather32_func gather = bitmap->vector_length <= INT32_MAX ? STORM_get_gather32_func() : &STORM_gather32_scalar;
+    const STORM_weighted_popcnt_func weighted = STORM_get_weighted_popcnt_func();
+
+    for (uint32_t i = begin; i < end; ++i) {
+        const STORM_contiguous_bitmap_t* row = &bitmap->bitmaps[i];
+        if (bitmap->scalar != NULL && row->n_scalar < bitmap->scalar_cutoff) {
+            degree->out[i] = (*gather)(degree->counts, row->scalar, row->n_scalar) - row->n_scalar;
+        } else {
+            degree->out[i] = (*weighted)(row->data, degree->counts, n_words) - STORM_popcnt(row->data, n_words*sizeof(uint64_t));
+        }
+    }
+}
+
+int STORM_contig_row_degrees(STORM_contiguous_t* bitmap, uint64_t* out, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (out == NULL) return -2;
+    if (bitmap->n_data == 0) return 1;
+    if (bitmap->n_data > UINT32_MAX) return -3;
+
+    const uint64_t n_columns = 64*(uint64_t)bitmap->n_bitmaps_vector;
+    uint64_t* counts = (uint64_t*)malloc(n_columns*sizeof(uint64_t));
+    uint32_t* counts32 = (uint32_t*)malloc(n_columns*sizeof(uint32_t));
+    uint64_t* offsets = (uint64_t*)malloc((bitmap->n_data + 1)*sizeof(uint64_t));
+    if (counts == NULL || counts32 == NULL || offsets == NULL || STORM_contig_count_columns(bitmap, counts) < 0) {
+        free(counts); free(counts32); free(offsets);
+        return -3;
+    }
+    for (uint64_t k = 0; k < n_columns; ++k) counts32[k] = counts[k];
+    free(counts);
+
+    // Balance the workers on the work per row: the length of its list or
+    // the width of its bitmap.
+    offsets[0] = 0;
+    for (uint64_t i = 0; i < bitmap->n_data; ++i) {
+        const uint32_t n_scalar = bitmap->bitmaps[i].n_scalar;
+        offsets[i+1] = offsets[i] + (bitmap->scalar != NULL && n_scalar < bitmap->scalar_cutoff ? n_scalar : bitmap->n_bitmaps_vector);
+    }
+
+    STORM_degree_t degree;
+    memset(&degree, 0, sizeof(STORM_degree_t));
+    degree.source = bitmap;
+    degree.counts = counts32;
+    degree.out    = out;
+
+    STORM_batch_t batch;
+    memset(&batch, 0, sizeof(STORM_batch_t));
+    batch.offsets = offsets;
+    batch.target  = &degree;
+    batch.func    = &STORM_contig_degree_rows;
+    const int ret = STORM_batch_run(&batch, bitmap->n_data, STORM_batch_threads(n_threads, bitmap->n_data));
+
+    free(counts32);
+    free(offsets);
+    return ret < 0 ? -3 : 1;
+}
+
+/* *************************************
+*  Column-stream transposer
+*
+*  Columns are buffered 64 at a time. A full batch is cut into 64x64 bit
+*  tiles, one per 64 rows, and each tile is transposed in registers so
+*  that word r of the tile holds the 64 new bits of row r. Contiguous
+*  targets take the word as is; STORM_t targets collect the positions of
+*  the current block per row and encode them when the block is complete.
+***************************************/
+
+struct STORM_transposer_s {
+    STORM_t* storm;
+    STORM_contiguous_t* contig;
+    uint64_t first; // position of the first row in the target
+    uint64_t n_rows;
+    uint64_t n_row_words; // words per buffered column
+    uint64_t n_columns; // columns added so far
+    uint64_t* columns; // STORM_TRANSPOSE_BATCH columns of n_row_words words
+    uint32_t** values; // positions in the current block per row (STORM_t)
+    uint32_t* n_values;
+    uint32_t* m_values;
+};
+
+#define STORM_TRANSPOSE_BATCH 64
+
+// Transposes a 64x64 bit matrix in place: bit c of tile[r] moves to bit r
+// of tile[c]. Stage j swaps the off-diagonal j x j blocks of every 2j x 2j
+// block.
+typedef void (*STORM_transpose_func)(uint64_t* tile);
+
+static const uint64_t STORM_transpose_masks[6] = {
+    0x5555555555555555ULL, 0x3333333333333333ULL, 0x0F0F0F0F0F0F0F0FULL,
+    0x00FF00FF00FF00FFULL, 0x0000FFFF0000FFFFULL, 0x00000000FFFFFFFFULL };
+
+static void STORM_transpose64_stage(uint64_t* tile, const uint32_t j, const uint64_t m) {
+    for (uint32_t base = 0; base < 64; base += 2*j) {
+        for (uint32_t k = base; k < base + j; ++k) {
+            const uint64_t t = ((tile[k] >> j) ^ tile[k + j]) & m;
+            tile[k]     ^= t << j;
+            tile[k + j] ^= t;
+        }
+    }
+}
+
+static void STORM_transpose64_scalar(uint64_t* tile) {
+    for (int s = 5; s >= 0; --s) STORM_transpose64_stage(tile, 1u << s, STORM_transpose_masks[s]);
+}
+
+#if defined(STORM_HAVE_AVX2)
+STORM_TARGET("avx2")
+static void STORM_transpose64_avx2(uint64_t* tile) {
+    // Stages with j >= 4 pair whole vectors of four rows.
+    for (int s = 5; s >= 2; --s) {
+        const uint32_t j = 1u << s;
+        const __m128i shift = _mm_cvtsi32_si128(j);
+        const __m256i m = _mm256_set1_epi64x(STORM_transpose_masks[s]);
+        for (uint32_t base = 0; base < 64; base += 2*j) {
+            for (uint32_t k = base; k < base + j; k += 4) {
+                __m256i a = _mm256_loadu_si256((const __m256i*)&tile[k]);
+                __m256i b = _mm256_loadu_si256((const __m256i*)&tile[k + j]);
+                const __m256i t = _mm256_and_si256(_mm256_xor_si256(_mm256_srl_epi64(a, shift), b), m);
+                a = _mm256_xor_si256(a, _mm256_sll_epi64(t, shift));
+                b = _mm256_xor_si256(b, t);
+                _mm256_storeu_si256((__m256i*)&tile[k], a);
+                _mm256_storeu_si256((__m256i*)&tile[k + j], b);
+            }
+        }
+    }
+    STORM_transpose64_stage(tile, 2, STORM_transpose_masks[1]);
+    STORM_transpose64_stage(tile, 1, STORM_transpose_masks[0]);
+}
+#endif
+
+static STORM_transpose_func STORM_get_transpose_func(void) {
+#if defined(STORM_HAVE_AVX2)
+    if (STORM_cpuid_cached() & STORM_CPUID_runtime_bit_AVX2) return &STORM_transpose64_avx2;
+#endif
+    return &STORM_transpose64_scalar;
+}
+
+static STORM_transposer_t* STORM_transposer_alloc(const uint64_t n_rows) {
+    STORM_transposer_t* t = (STORM_transposer_t*)calloc(1, sizeof(STORM_transposer_t));
+    if (t == NULL) return NULL;
+    t->n_rows = n_rows;
+    t->n_row_words = (n_rows + 63) / 64;
+    t->columns = (uint64_t*)calloc(STORM_TRANSPOSE_BATCH*t->n_row_words + 1, sizeof(uint64_t));
+    if (t->columns == NULL) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+STORM_transposer_t* STORM_transposer_new(STORM_t* bitmap, const uint64_t n_rows) {
+    if (bitmap == NULL) return NULL;
+    STORM_transposer_t* t = STORM_transposer_alloc(n_rows);
+    if (t == NULL) return NULL;
+    t->storm = bitmap;
+    t->first = bitmap->n_conts;
+    t->values   = (uint32_t**)calloc(n_rows + 1, sizeof(uint32_t*));
+    t->n_values = (uint32_t*)calloc(n_rows + 1, sizeof(uint32_t));
+    t->m_values = (uint32_t*)calloc(n_rows + 1, sizeof(uint32_t));
+    if (t->values == NULL || t->n_values == NULL || t->m_values == NULL) {
+        STORM_transposer_free(t);
+        return NULL;
+    }
+    for (uint64_t i = 0; i < n_rows; ++i) STORM_next_cont(bitmap);
+    return t;
+}
+
+STORM_transposer_t* STORM_transposer_new_contig(STORM_contiguous_t* bitmap, const uint64_t n_rows) {
+    if (bitmap == NULL) return NULL;
+    STORM_transposer_t* t = STORM_transposer_alloc(n_rows);
+    if (t == NULL) return NULL;
+    t->contig = bitmap;
+    t->first  = bitmap->n_data;
+    if (STORM_contig_reserve(bitmap, t->first + n_rows, 0) < 0) {
+        STORM_transposer_free(t);
+        return NULL;
+    }
+    memset(&bitmap->data[t->first*bitmap->n_bitmaps_vector], 0, n_rows*bitmap->n_bitmaps_vector*sizeof(uint64_t));
+    return t;
+}
+
+// Encodes the positions collected for the current block of every row.
+static int STORM_transposer_flush_block(STORM_transposer_t* t) {
+    for (uint64_t r = 0; r < t->n_rows; ++r) {
+        if (t->n_values[r] == 0) continue;
+        STORM_bitmap_cont_add_arena(&t->storm->conts[t->first + r], t->values[r], t->n_values[r], t->storm->arena);
+        t->n_values[r] = 0;
+    }
+    return 1;
+}
+
+// Transposes the buffered batch of columns into the target rows.
+static int STORM_transposer_flush(STORM_transposer_t* t) {
+    const uint64_t n_buffered = t->n_columns % STORM_TRANSPOSE_BATCH ? t->n_columns % STORM_TRANSPOSE_BATCH : STORM_TRANSPOSE_BATCH;
+    const uint64_t col0 = t->n_columns - n_buffered;
+    const STORM_transpose_func transpose = STORM_get_transpose_func();
+    uint64_t tile[64];
+
+    for (uint64_t rb = 0; rb < t->n_row_words; ++rb) {
+        uint64_t any = 0;
+        for (uint32_t c = 0; c < 64; ++c) {
+            tile[c] = t->columns[c*t->n_row_words + rb];
+            any |= tile[c];
+        }
+        if (any == 0) continue;
+        (*transpose)(tile);
+
+        const uint64_t n_tile_rows = t->n_rows - 64*rb < 64 ? t->n_rows - 64*rb : 64;
+        for (uint64_t r = 0; r < n_tile_rows; ++r) {
+            if (tile[r] == 0) continue;
+            const uint64_t row = 64*rb + r;
+            if (t->contig != NULL) {
+                t->contig->bitmaps[t->first + row].data[col0 / 64] = tile[r];
+                continue;
+            }
+            const uint32_t n = _mm_popcnt_u64(tile[r]);
+            if (t->n_values[row] + n > t->m_values[row]) {
+                uint32_t m = t->m_values[row] ? t->m_values[row] : 64;
+                while (m < t->n_values[row] + n) m *= 2;
+                uint32_t* values = (uint32_t*)realloc(t->values[row], m*sizeof(uint32_t));
+                if (values == NULL) return -1;
+                t->values[row] = values;
+                t->m_values[row] = m;
+            }
+            uint32_t* dst = &t->values[row][t->n_values[row]];
+            for (uint64_t w = tile[r]; w; w &= w - 1) *dst++ = col0 + _mm_popcnt_u64((w & -w) - 1);
+            t->n_values[row] += n;
+        }
+    }
+    memset(t->columns, 0, STORM_TRANSPOSE_BATCH*t->n_row_words*sizeof(uint64_t));
+
+    if (t->storm != NULL && t->n_columns % t->storm->block_size == 0)
+        return STORM_transposer_flush_block(t);
+    return 1;
+}
+
+// Claims the next column slot in the batch buffer.
+static uint64_t* STORM_transposer_next_column(STORM_transposer_t* t) {
+    if (t->contig != NULL && t->n_columns >= t->contig->vector_length) return NULL;
+    if (t->storm != NULL && t->n_columns > UINT32_MAX) return NULL;
+    return &t->columns[(t->n_columns % STORM_TRANSPOSE_BATCH)*t->n_row_words];
+}
+
+int STORM_transposer_add_column(STORM_transposer_t* t, const uint64_t* column) {
+    if (t == NULL) return -1;
+    if (column == NULL) return -2;
+    uint64_t* dst = STORM_transposer_next_column(t);
+    if (dst == NULL) return -3;
+    memcpy(dst, column, t->n_row_words*sizeof(uint64_t));
+    if (t->n_rows % 64) dst[t->n_row_words - 1] &= (1ULL << (t->n_rows % 64)) - 1;
+    if (++t->n_columns % STORM_TRANSPOSE_BATCH == 0 && STORM_transposer_flush(t) < 0) return -4;
+    return 1;
+}
+
+int STORM_transposer_add_column_rows(STORM_transposer_t* t, const uint32_t* rows, const uint32_t n_values) {
+    if (t == NULL) return -1;
+    if (rows == NULL && n_values != 0) return -2;
+    uint64_t* dst = STORM_transposer_next_column(t);
+    if (dst == NULL) return -3;
+    for (uint32_t i = 0; i < n_values; ++i) {
+        if (rows[i] >= t->n_rows) return -2;
+        dst[rows[i] / 64] |= 1ULL << (rows[i] % 64);
+    }
+    if (++t->n_columns % STORM_TRANSPOSE_BATCH == 0 && STORM_transposer_flush(t) < 0) return -4;
+    return 1;
+}
+
+int STORM_transposer_finish(STORM_transposer_t* t) {
+    if (t == NULL) return -1;
+    if (t->n_columns % STORM_TRANSPOSE_BATCH && STORM_transposer_flush(t) < 0) return -4;
+    if (t->storm != NULL) return STORM_transposer_flush_block(t);
+    if (STORM_contig_index_rows(t->contig, t->first, t->n_rows) < 0) return -5;
+    return 1;
+}
+
+void STORM_transposer_free(STORM_transposer_t* t) {
+    if (t == NULL) return;
+    if (t->values != NULL) {
+        for (uint64_t r = 0; r < t->n_rows; ++r) free(t->values[r]);
+    }
+    free(t->values);
+    free(t->n_values);
+    free(t->m_values);
+    free(t->columns);
+    free(t);
+}
+
+int STORM_contig_clear(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    STORM_contig_drop_packed(bitmap);
+    if (bitmap->data == NULL) return 0;
+    if (bitmap->own_data == 0) {
+        // Drop the adopted rows; the next add allocates our own storage.
+        bitmap->data   = NULL;
+        bitmap->m_data = 0;
+        bitmap->n_data = 0;
+        bitmap->tot_scalar = 0;
+        return 1;
+    }
+    memset(bitmap->data, 0, bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t));
+    bitmap->n_data = 0;
+    bitmap->tot_scalar = 0;
+    
+    return 1;
+}
+
+static int STORM_contig_has_panels(const STORM_contiguous_t* bitmap);
+static int STORM_contig_has_narrow(const STORM_contiguous_t* bitmap);
+static uint32_t STORM_contig_guess_bsize(const STORM_contiguous_t* bitmap);
+static uint64_t STORM_contig_pairw_engine(STORM_contiguous_t* bitmap, const uint32_t bsize, int use_list, const uint32_t n_threads, STORM_job_t* job);
+
+uint64_t STORM_contig_pairw_intersect_cardinality(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return -1;
+
+    if (STORM_contig_has_narrow(bitmap)) {
+        STORM_job_t job;
+        memset(&job, 0, sizeof(STORM_job_t));
+        return STORM_contig_pairw_engine(bitmap, STORM_contig_guess_bsize(bitmap), 0, 1, &job);
+    }
+
+    if (bitmap->scalar != NULL) {
+        // check list
+        uint32_t valid = 0;
+        for (int i = 0; i < bitmap->n_data; ++i) {
+            valid += bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff;
+        }
+        // printf("checking for scalar: %u<%u\n", valid, bitmap->scalar_cutoff);
+        if (valid) {
+            // printf("using scalar\n");
+            return STORM_contig_pairw_intersect_cardinality_list(bitmap);
+        }
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
+            total += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
+            // total += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->bitmaps[i].data, &bitmap->bitmaps[j].data, bitmap->intsec_func, out);
+        }
+    }
+
+    return total;
+}
+
+// Same as STORM_wrapper_tile over the vectors of a contiguous set.
+static uint64_t STORM_contig_tile(const STORM_contiguous_t* bitmap,
+                                  const uint32_t i_start, const uint32_t i_end,
+                                  const uint32_t j_start, const uint32_t j_end,
+                                  const int diag, const uint32_t panel)
+{
+    const uint32_t n_words = bitmap->n_bitmaps_vector;
+    uint64_t total = 0;
+    for (uint32_t k = 0; k < n_words; k += panel) {
+        const uint32_t n = n_words - k < panel ? n_words - k : panel;
+        for (uint32_t i = i_start; i < i_end; ++i) {
+            const uint64_t* left = &bitmap->bitmaps[i].data[k];
+            for (uint32_t j = diag ? i + 1 : j_start; j < j_end; ++j) {
+                total += (*bitmap->intsec_func)(left, &bitmap->bitmaps[j].data[k], n);
+            }
+        }
+    }
+    return total;
+}
+
+
+uint64_t STORM_contig_pairw_intersect_cardinality_blocked(STORM_contiguous_t* bitmap, uint32_t bsize) {
+    if (bitmap == NULL) return -1;
+
+    if (STORM_contig_has_narrow(bitmap) && bsize > 2) {
+        STORM_job_t job;
+        memset(&job, 0, sizeof(STORM_job_t));
+        return STORM_contig_pairw_engine(bitmap, bsize, 0, 1, &job);
+    }
+
+    if (bitmap->scalar != NULL) {
+        // check list
+        uint32_t valid = 0;
+        for (int i = 0; i < bitmap->n_data; ++i) {
+            valid += bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff;
+        }
+        // printf("checking for blocked-scalar: %u<%u\n", valid, bitmap->scalar_cutoff);
+        if (valid) {
+            // printf("using scalar\n");
+            return STORM_contig_pairw_intersect_cardinality_blocked_list(bitmap, bsize);
+        }
+    }
+
+    if (bsize <= 2)
+        return STORM_contig_pairw_intersect_cardinality(bitmap);
+
+    if (STORM_contig_has_panels(bitmap)) {
+        STORM_job_t job;
+        memset(&job, 0, sizeof(STORM_job_t));
+        return STORM_contig_pairw_engine(bitmap, bsize, 0, 1, &job);
+    }
+
+    // printf("running for: %u vectors\n", bitmap->n_conts);
+
+    const uint32_t panel = STORM_word_panel(bitmap->n_bitmaps_vector, 2*bsize);
+    uint64_t count = 0;
+
+    for (uint32_t i = 0; i < bitmap->n_data; i += bsize) {
+        const uint32_t i_end = bitmap->n_data - i < bsize ? bitmap->n_data : i + bsize;
+        // diagonal component
+        count += STORM_contig_tile(bitmap, i, i_end, i, i_end, 1, panel);
+
+        // square component and residual
+        for (uint32_t j = i_end; j < bitmap->n_data; j += bsize) {
+            const uint32_t j_end = bitmap->n_data - j < bsize ? bitmap->n_data : j + bsize;
+            count += STORM_contig_tile(bitmap, i, i_end, j, j_end, 0, panel);
+        }
+    }
+
+    return count;
+}
+
+uint64_t STORM_contig_pairw_intersect_cardinality_list(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    if (bitmap->scalar == NULL) return -2;
+    if (bitmap->n_scalar == NULL) return -3;
+
+    // printf("using list\n");
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
+            if (bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j].n_scalar < bitmap->scalar_cutoff) {
+                total += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->bitmaps[i].scalar, bitmap->bitmaps[j].scalar, bitmap->bitmaps[i].n_scalar, bitmap->bitmaps[j].n_scalar);
+            } else {
+                total += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
+                // total += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->bitmaps[i].data, &bitmap->bitmaps[j].data, bitmap->intsec_func, out);
+            }
+        }
+    }
+
+    return total;
+}
+
+uint64_t STORM_contig_pairw_intersect_cardinality_blocked_list(STORM_contiguous_t* bitmap, uint32_t bsize) {
+    if (bitmap == NULL) return -1;
+    if (bitmap->scalar == NULL) return -2;
+    if (bitmap->n_scalar == NULL) return -3;
+
+    if (bsize <= 2)
+        return STORM_contig_pairw_intersect_cardinality_list(bitmap);
+
+    // printf("using blocked-list\n");
+
+    // printf("running for: %u vectors\n", bitmap->n_conts);
+
+    uint64_t count = 0;
+    uint32_t i = 0;
+
+    for (/**/; i + bsize <= bitmap->n_data; i += bsize) {
+        // diagonal component
+        for (uint32_t j = 0; j < bsize; ++j) {
+            for (uint32_t jj = j + 1; jj < bsize; ++jj) {
+                if (bitmap->bitmaps[i+j].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[i+jj].n_scalar < bitmap->scalar_cutoff) {
+                    count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[i+j].data, bitmap->bitmaps[i+jj].data, 
+                        bitmap->bitmaps[i+j].scalar, bitmap->bitmaps[i+jj].scalar, 
+                        bitmap->bitmaps[i+j].n_scalar, bitmap->bitmaps[i+jj].n_scalar);
+                } else {
+                    count += (*bitmap->intsec_func)(bitmap->bitmaps[i+j].data, bitmap->bitmaps[i+jj].data, bitmap->n_bitmaps_vector);
+                }
+            }
+        }
+
+        // square component
+        uint32_t curi = i;
+        uint32_t j = curi + bsize;
+        for (/**/; j + bsize <= bitmap->n_data; j += bsize) {
+            for (uint32_t ii = 0; ii < bsize; ++ii) {
+                for (uint32_t jj = 0; jj < bsize; ++jj) {
+                    if (bitmap->bitmaps[curi+ii].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j+jj].n_scalar < bitmap->scalar_cutoff) {
+                        count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, 
+                            bitmap->bitmaps[curi+ii].scalar, bitmap->bitmaps[j+jj].scalar, 
+                            bitmap->bitmaps[curi+ii].n_scalar, bitmap->bitmaps[j+jj].n_scalar);
+                    } else {
+                        count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, bitmap->n_bitmaps_vector);
+                    }
+                    // count += (*func)(bitmaps[curi+ii].data, bitmaps[j+jj].data, n_bitmaps_sample);
+                    // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+ii], &bitmap->conts[j+jj], f, out);
+                    // count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, bitmap->n_bitmaps_vector);
+                }
+            }
+        }
+
+        // residual
+        for (/**/; j < bitmap->n_data; ++j) {
+            for (uint32_t jj = 0; jj < bsize; ++jj) {
+                if (bitmap->bitmaps[curi+jj].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j].n_scalar < bitmap->scalar_cutoff) {
+                    count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, 
+                        bitmap->bitmaps[curi+jj].scalar, bitmap->bitmaps[j].scalar, 
+                        bitmap->bitmaps[curi+jj].n_scalar, bitmap->bitmaps[j].n_scalar);
+                } else {
+                    count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
+                }
+                // count += (*func)(bitmaps[curi+jj].data, bitmaps[j].data, n_bitmaps_sample);
+                // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+jj], &bitmap->conts[j], f, out);
+                // count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
+            }
+        }
+    }
+    // residual tail
+    for (/**/; i < bitmap->n_data; ++i) {
+        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
+            if (bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j].n_scalar < bitmap->scalar_cutoff) {
+                count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, 
+                    bitmap->bitmaps[i].scalar, bitmap->bitmaps[j].scalar, 
+                    bitmap->bitmaps[i].n_scalar, bitmap->bitmaps[j].n_scalar);
+            } else {
+                count += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
+            }
+            // count += (*func)(bitmaps[i].data, bitmaps[j].data, n_bitmaps_sample);
+            // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
+            // count += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
+        }
+    }
+
+    return count;
+}
+
+/* *************************************
+*  Register-blocked micro-kernel
+*
+*  STORM_contig_pack_panels copies the rows into panels of
+*  STORM_MICRO_ROWS rows. A panel is a sequence of chunks of
+*  STORM_MICRO_WORDS words per row, with the rows of the panel stored one
+*  after the other within a chunk:
+*
+*  panel p: | row 4p chunk 0 | row 4p+1 chunk 0 | ... | row 4p+3 chunk 0 | row 4p chunk 1 | ...
+*
+*  Vectors are zero-padded to whole chunks and the last panel to whole
+*  panels. The micro-kernel streams two panels once and counts all 4 x 4
+*  pairs between them: every word loaded is used four times. Counts are
+*  kept per byte with a nibble-lookup popcount and widened with SAD
+*  before the bytes can overflow. With AVX-512 all 16 accumulators stay in
+*  registers; AVX2 computes the block as two 2 x 4 halves.
+***************************************/
+
+#define STORM_MICRO_ROWS  4
+#define STORM_MICRO_WORDS 8
+
+// Counts the STORM_MICRO_ROWS^2 pairs between two panels of n_chunks
+// chunks into out[4*r + c] (row r of panel a, row c of panel b).
+typedef void (*STORM_micro_func)(const uint64_t* STORM_RESTRICT a, const uint64_t* STORM_RESTRICT b, const uint64_t n_chunks, uint64_t* STORM_RESTRICT out);
+
+static inline uint64_t STORM_micro_chunks(const uint64_t n_words) {
+    return (n_words + STORM_MICRO_WORDS - 1) / STORM_MICRO_WORDS;
+}
+
+static void STORM_micro_scalar(const uint64_t* STORM_RESTRICT a, const uint64_t* STORM_RESTRICT b, const uint64_t n_chunks, uint64_t* STORM_RESTRICT out) {
+    uint64_t acc[STORM_MICRO_ROWS*STORM_MICRO_ROWS] = {0};
+    for (uint64_t k = 0; k < n_chunks; ++k) {
+        const uint64_t* pa = &a[k*STORM_MICRO_ROWS*STORM_MICRO_WORDS];
+        const uint64_t* pb = &b[k*STORM_MICRO_ROWS*STORM_MICRO_WORDS];
+        for (uint32_t w = 0; w < STORM_MICRO_WORDS; ++w) {
+            const uint64_t b0 = pb[w], b1 = pb[STORM_MICRO_WORDS + w], b2 = pb[2*STORM_MICRO_WORDS + w], b3 = pb[3*STORM_MICRO_WORDS + w];
+            for (uint32_t r = 0; r < STORM_MICRO_ROWS; ++r) {
+                const uint64_t x = pa[r*STORM_MICRO_WORDS + w];
+                acc[4*r+0] += _mm_popcnt_u64(x & b0);
+                acc[4*r+1] += _mm_popcnt_u64(x & b1);
+                acc[4*r+2] += _mm_popcnt_u64(x & b2);
+                acc[4*r+3] += _mm_popcnt_u64(x & b3);
+            }
+        }
+    }
+    memcpy(out, acc, sizeof(acc));
+}
+
+#if defined(STORM_HAVE_AVX2)
+STORM_TARGET("avx2")
+static __m256i STORM_popcnt8_avx2(const __m256i v, const __m256i lookup, const __m256i low) {
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+                           _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+}
+
+STORM_TARGET("avx2")
+static uint64_t STORM_sad_sum_avx2(const __m256i v) {
+    const __m256i s = _mm256_sad_epu8(v, _mm256_setzero_si256());
+    const __m128i h = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    return (uint64_t)_mm_cvtsi128_si64(h) + (uint64_t)_mm_extract_epi64(h, 1);
+}
+
+STORM_TARGET("avx2")
+static void STORM_micro_avx2(const uint64_t* STORM_RESTRICT a, const uint64_t* STORM_RESTRICT b, const uint64_t n_chunks, uint64_t* STORM_RESTRICT out) {
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4, 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const uint64_t stride = STORM_MICRO_ROWS*STORM_MICRO_WORDS;
+
+    for (uint32_t r = 0; r < STORM_MICRO_ROWS; r += 2) {
+        uint64_t acc[8] = {0};
+        for (uint64_t k = 0; k < n_chunks; /**/) {
+            // A chunk adds at most 16 to every byte.
+            const uint64_t end = k + 15 < n_chunks ? k + 15 : n_chunks;
+            __m256i s00 = _mm256_setzero_si256(), s01 = s00, s02 = s00, s03 = s00;
+            __m256i s10 = s00, s11 = s00, s12 = s00, s13 = s00;
+            for (/**/; k < end; ++k) {
+                for (uint32_t h = 0; h < STORM_MICRO_WORDS; h += 4) {
+                    const uint64_t* pa = &a[k*stride + r*STORM_MICRO_WORDS + h];
+                    const uint64_t* pb = &b[k*stride + h];
+                    const __m256i x0 = _mm256_loadu_si256((const __m256i*)pa);
+                    const __m256i x1 = _mm256_loadu_si256((const __m256i*)(pa + STORM_MICRO_WORDS));
+                    const __m256i b0 = _mm256_loadu_si256((const __m256i*)pb);
+                    const __m256i b1 = _mm256_loadu_si256((const __m256i*)(pb + STORM_MICRO_WORDS));
+                    const __m256i b2 = _mm256_loadu_si256((const __m256i*)(pb + 2*STORM_MICRO_WORDS));
+                    const __m256i b3 = _mm256_loadu_si256((const __m256i*)(pb + 3*STORM_MICRO_WORDS));
+                    s00 = _mm256_add_epi8(s00, STORM_popcnt8_avx2(_mm256_and_si256(x0, b0), lookup, low));
+                    s01 = _mm256_add_epi8(s01, STORM_popcnt8_avx2(_mm256_and_si256(x0, b1), lookup, low));
+                    s02 = _mm256_add_epi8(s02, STORM_popcnt8_avx2(_mm256_and_si256(x0, b2), lookup, low));
+                    s03 = _mm256_add_epi8(s03, STORM_popcnt8_avx2(_mm256_and_si256(x0, b3), lookup, low));
+                    s10 = _mm256_add_epi8(s10, STORM_popcnt8_avx2(_mm256_and_si256(x1, b0), lookup, low));
+                    s11 = _mm256_add_epi8(s11, STORM_popcnt8_avx2(_mm256_and_si256(x1, b1), lookup, low));
+                    s12 = _mm256_add_epi8(s12, STORM_popcnt8_avx2(_mm256_and_si256(x1, b2), lookup, low));
+                    s13 = _mm256_add_epi8(s13, STORM_popcnt8_avx2(_mm256_and_si256(x1, b3), lookup, low));
+                }
+            }
+            acc[0] += STORM_sad_sum_avx2(s00); acc[1] += STORM_sad_sum_avx2(s01);
+            acc[2] += STORM_sad_sum_avx2(s02); acc[3] += STORM_sad_sum_avx2(s03);
+            acc[4] += STORM_sad_sum_avx2(s10); acc[5] += STORM_sad_sum_avx2(s11);
+            acc[6] += STORM_sad_sum_avx2(s12); acc[7] += STORM_sad_sum_avx2(s13);
+        }
+        memcpy(&out[4*r], acc, sizeof(acc));
+    }
+}
+#endif
+
+#if defined(STORM_HAVE_AVX512)
+STORM_TARGET("avx512bw")
+static __m512i STORM_popcnt8_avx512(const __m512i v, const __m512i lookup, const __m512i low) {
+    return _mm512_add_epi8(_mm512_shuffle_epi8(lookup, _mm512_and_si512(v, low)),
+                           _mm512_shuffle_epi8(lookup, _mm512_and_si512(_mm512_srli_epi16(v, 4), low)));
+}
+
+STORM_TARGET("avx512bw")
+static void STORM_micro_avx512(const uint64_t* STORM_RESTRICT a, const uint64_t* STORM_RESTRICT b, const uint64_t n_chunks, uint64_t* STORM_RESTRICT out) {
+    const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4));
+    const __m512i low = _mm512_set1_epi8(0x0f);
+    const uint64_t stride = STORM_MICRO_ROWS*STORM_MICRO_WORDS;
+    uint64_t acc[STORM_MICRO_ROWS*STORM_MICRO_ROWS] = {0};
+
+    for (uint64_t k = 0; k < n_chunks; /**/) {
+        // A chunk adds at most 8 to every byte.
+        const uint64_t end = k + 31 < n_chunks ? k + 31 : n_chunks;
+        __m512i s[STORM_MICRO_ROWS*STORM_MICRO_ROWS];
+        for (uint32_t i = 0; i < STORM_MICRO_ROWS*STORM_MICRO_ROWS; ++i) s[i] = _mm512_setzero_si512();
+        for (/**/; k < end; ++k) {
+            const uint64_t* pa = &a[k*stride];
+            const uint64_t* pb = &b[k*stride];
+            const __m512i b0 = _mm512_loadu_si512((const void*)pb);
+            const __m512i b1 = _mm512_loadu_si512((const void*)(pb + STORM_MICRO_WORDS));
+            const __m512i b2 = _mm512_loadu_si512((const void*)(pb + 2*STORM_MICRO_WORDS));
+            const __m512i b3 = _mm512_loadu_si512((const void*)(pb + 3*STORM_MICRO_WORDS));
+            for (uint32_t r = 0; r < STORM_MICRO_ROWS; ++r) {
+                const __m512i x = _mm512_loadu_si512((const void*)(pa + r*STORM_MICRO_WORDS));
+                s[4*r+0] = _mm512_add_epi8(s[4*r+0], STORM_popcnt8_avx512(_mm512_and_si512(x, b0), lookup, low));
+                s[4*r+1] = _mm512_add_epi8(s[4*r+1], STORM_popcnt8_avx512(_mm512_and_si512(x, b1), lookup, low));
+                s[4*r+2] = _mm512_add_epi8(s[4*r+2], STORM_popcnt8_avx512(_mm512_and_si512(x, b2), lookup, low));
+                s[4*r+3] = _mm512_add_epi8(s[4*r+3], STORM_popcnt8_avx512(_mm512_and_si512(x, b3), lookup, low));
+            }
+        }
+        for (uint32_t i = 0; i < STORM_MICRO_ROWS*STORM_MICRO_ROWS; ++i) {
+            acc[i] += _mm512_reduce_add_epi64(_mm512_sad_epu8(s[i], _mm512_setzero_si512()));
+        }
+    }
+    memcpy(out, acc, sizeof(acc));
+}
+#endif
+
+static STORM_micro_func STORM_get_micro_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+    (void)cpuid;
+#if defined(STORM_HAVE_AVX512)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX512BW) return &STORM_micro_avx512;
+#endif
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_micro_avx2;
+#endif
+    return &STORM_micro_scalar;
+}
+
+int STORM_contig_pack_panels(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    STORM_aligned_free(bitmap->panels);
+    bitmap->panels = NULL;
+    bitmap->n_panel_rows = 0;
+    if (bitmap->n_data == 0) return 1;
+
+    const uint64_t n_words  = bitmap->n_bitmaps_vector;
+    const uint64_t n_chunks = STORM_micro_chunks(n_words);
+    const uint64_t n_panels = (bitmap->n_data + STORM_MICRO_ROWS - 1) / STORM_MICRO_ROWS;
+    const uint64_t size = n_panels * n_chunks * STORM_MICRO_ROWS * STORM_MICRO_WORDS * sizeof(uint64_t);
+    uint64_t* panels = (uint64_t*)STORM_aligned_malloc(64, size);
+    if (panels == NULL) return -2;
+    memset(panels, 0, size);
+
+    for (uint64_t i = 0; i < bitmap->n_data; ++i) {
+        uint64_t* dst = &panels[((i / STORM_MICRO_ROWS) * n_chunks * STORM_MICRO_ROWS + i % STORM_MICRO_ROWS) * STORM_MICRO_WORDS];
+        for (uint64_t k = 0; k < n_chunks; ++k, dst += STORM_MICRO_ROWS*STORM_MICRO_WORDS) {
+            const uint64_t w = k*STORM_MICRO_WORDS;
+            memcpy(dst, &bitmap->bitmaps[i].data[w], (n_words - w < STORM_MICRO_WORDS ? n_words - w : STORM_MICRO_WORDS)*sizeof(uint64_t));
+        }
+    }
+    bitmap->panels = panels;
+    bitmap->n_panel_rows = bitmap->n_data;
+    return 1;
+}
+
+static int STORM_contig_has_panels(const STORM_contiguous_t* bitmap) {
+    return bitmap->panels != NULL && bitmap->n_panel_rows == bitmap->n_data;
+}
+
+/* *************************************
+*  Narrow engine
+*
+*  STORM_contig_pack_narrow copies vectors of at most 1024 bits into rows
+*  of 1, 2, 4, 8 or 16 words. The tile kernels are specialised per width:
+*  the word loop is unrolled and the row of the tile is held in registers
+*  while it is compared against the columns.
+*
+*  The lookup-table (Four-Russians) kernel works on tiles of up to
+*  STORM_NARROW_LUT_ROWS rows against a block of STORM_NARROW_LUT_COLS
+*  columns. For every byte position c and byte value v it tabulates
+*  POPCNT(v & column byte c) for all columns of the block, so that a row
+*  adds 8 * narrow_words table rows instead of counting each pair.
+***************************************/
+
+#define STORM_NARROW_LUT_COLS 32
+#define STORM_NARROW_LUT_ROWS 4096
+// Wider vectors would need tables larger than the L2 cache and use the
+// direct kernels over tiles of STORM_NARROW_BSIZE vectors instead.
+#define STORM_NARROW_LUT_MAX_WORDS 4
+#define STORM_NARROW_BSIZE 256
+
+int STORM_contig_pack_narrow(STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return -1;
+    if (bitmap->n_bitmaps_vector > STORM_NARROW_MAX_WORDS) return -2;
+    STORM_aligned_free(bitmap->narrow);
+    bitmap->narrow = NULL;
+    bitmap->n_narrow_rows = 0;
+
+    uint32_t n_words = 1;
+    while (n_words < bitmap->n_bitmaps_vector) n_words *= 2;
+    bitmap->narrow_words = n_words;
+    if (bitmap->n_data == 0) return 1;
+
+    const uint64_t size = bitmap->n_data * n_words * sizeof(uint64_t);
+    uint64_t* narrow = (uint64_t*)STORM_aligned_malloc(64, size);
+    if (narrow == NULL) return -3;
+    memset(narrow, 0, size);
+
+    for (uint64_t i = 0; i < bitmap->n_data; ++i) {
+        memcpy(&narrow[i*n_words], bitmap->bitmaps[i].data, bitmap->n_bitmaps_vector*sizeof(uint64_t));
+    }
+    bitmap->narrow = narrow;
+    bitmap->n_narrow_rows = bitmap->n_data;
+    return 1;
+}
+
+static int STORM_contig_has_narrow(const STORM_contiguous_t* bitmap) {
+    return bitmap->narrow != NULL && bitmap->n_narrow_rows == bitmap->n_data;
+}
+
+// Same as STORM_tile_kernel_contig on narrow rows of n_words words. Only
+// called with constant widths so that every instance is specialised.
+static STORM_FORCE_INLINE uint64_t STORM_tile_narrow(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker, const uint32_t n_words) {
+    const uint64_t* left  = ((const STORM_contiguous_t*)job->left)->narrow;
+    const uint64_t* right = ((const STORM_contiguous_t*)job->right)->narrow;
+    uint64_t* counts = worker->counts;
+    const uint32_t ld = tile->j_end - tile->j_start;
+
+    uint64_t count = 0;
+    for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+        uint64_t a[STORM_NARROW_MAX_WORDS];
+        for (uint32_t w = 0; w < n_words; ++w) a[w] = left[(uint64_t)i*n_words + w];
+
+        const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+        for (uint32_t j = j_start; j < tile->j_end; ++j) {
+            const uint64_t* b = &right[(uint64_t)j*n_words];
+            uint64_t c = 0;
+            for (uint32_t w = 0; w < n_words; ++w) c += _mm_popcnt_u64(a[w] & b[w]);
+            count += c;
+            if (counts != NULL) counts[(i - tile->i_start) * ld + (j - tile->j_start)] = c;
+        }
+    }
+    return count;
+}
+
+static uint64_t STORM_tile_kernel_narrow1(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) { return STORM_tile_narrow(job, tile, worker, 1); }
+static uint64_t STORM_tile_kernel_narrow2(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) { return STORM_tile_narrow(job, tile, worker, 2); }
+static uint64_t STORM_tile_kernel_narrow4(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) { return STORM_tile_narrow(job, tile, worker, 4); }
+
+static uint64_t STORM_tile_kernel_narrow8(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) { return STORM_tile_narrow(job, tile, worker, 8); }
+static uint64_t STORM_tile_kernel_narrow16(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) { return STORM_tile_narrow(job, tile, worker, 16); }
+
+static STORM_tile_func STORM_get_narrow_kernel(const uint32_t n_words) {
+    switch (n_words) {
+    case 1:  return &STORM_tile_kernel_narrow1;
+    case 2:  return &STORM_tile_kernel_narrow2;
+    case 4:  return &STORM_tile_kernel_narrow4;
+    case 8:  return &STORM_tile_kernel_narrow8;
+    default: return &STORM_tile_kernel_narrow16;
+    }
+}
+
+// Bytes of worker scratch for the tables of a block.
+static uint64_t STORM_narrow_lut_size(const uint32_t n_words) {
+    return (uint64_t)8*n_words * 256 * STORM_NARROW_LUT_COLS;
+}
+
+/**
+ * Fills table[c][v][j] = POPCNT(v & byte c of column j) for the columns
+ * [j_start, j_start + n_cols). Each entry extends the entry of v with its
+ * lowest bit cleared. Missing columns count as zero.
+ */
+static void STORM_narrow_lut_build(const uint64_t* rows, const uint32_t n_words, const uint32_t j_start, const uint32_t n_cols, uint8_t* STORM_RESTRICT table) {
+    for (uint32_t c = 0; c < 8*n_words; ++c) {
+        uint8_t bytes[STORM_NARROW_LUT_COLS];
+        memset(bytes, 0, sizeof(bytes));
+        for (uint32_t j = 0; j < n_cols; ++j) {
+            bytes[j] = rows[(uint64_t)(j_start + j)*n_words + c/8] >> (8*(c%8));
+        }
+
+        uint8_t* t = &table[(uint64_t)c*256*STORM_NARROW_LUT_COLS];
+        memset(t, 0, STORM_NARROW_LUT_COLS);
+        for (uint32_t v = 1; v < 256; ++v) {
+            const uint32_t bit = _mm_popcnt_u64((v & -v) - 1);
+            const uint8_t* prev = &t[(v & (v - 1))*STORM_NARROW_LUT_COLS];
+            uint8_t* cur = &t[v*STORM_NARROW_LUT_COLS];
+            for (uint32_t j = 0; j < STORM_NARROW_LUT_COLS; ++j) {
+                cur[j] = prev[j] + ((bytes[j] >> bit) & 1);
+            }
+        }
+    }
+}
+
+// Adds up the table rows selected by the bytes of each of n_rows rows and
+// returns the sum total over all columns. If counts is not NULL then the
+// count of row i and column j is stored at counts[i * n_cols + j].
+typedef uint64_t (*STORM_lut_sweep_func)(const uint8_t* STORM_RESTRICT table, const uint64_t* STORM_RESTRICT rows, const uint32_t n_rows, const uint32_t n_words, const uint32_t n_cols, uint64_t* STORM_RESTRICT counts);
+
+static uint64_t STORM_lut_sweep_scalar(const uint8_t* STORM_RESTRICT table, const uint64_t* STORM_RESTRICT rows, const uint32_t n_rows, const uint32_t n_words, const uint32_t n_cols, uint64_t* STORM_RESTRICT counts) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < n_rows; ++i) {
+        const uint64_t* a = &rows[(uint64_t)i*n_words];
+        uint32_t acc[STORM_NARROW_LUT_COLS];
+        memset(acc, 0, sizeof(acc));
+        for (uint32_t c = 0; c < 8*n_words; ++c) {
+            const uint8_t* t = &table[((uint64_t)c*256 + ((a[c/8] >> (8*(c%8))) & 0xFF)) * STORM_NARROW_LUT_COLS];
+            for (uint32_t j = 0; j < STORM_NARROW_LUT_COLS; ++j) acc[j] += t[j];
+        }
+        for (uint32_t j = 0; j < n_cols; ++j) {
+            count += acc[j];
+            if (counts != NULL) counts[(uint64_t)i*n_cols + j] = acc[j];
+        }
+    }
+    return count;
+}
+
+#if defined(STORM_HAVE_AVX2)
+/**
+ * A table row is one 256-bit vector. Counts are added per byte in two
+ * independent chains and widened to 16 bits every 2 words, before 8 bits
+ * can overflow. Sums without counts are reduced into 32-bit lanes as the
+ * missing columns are zero.
+ */
+STORM_TARGET("avx2")
+static uint64_t STORM_lut_sweep_avx2(const uint8_t* STORM_RESTRICT table, const uint64_t* STORM_RESTRICT rows, const uint32_t n_rows, const uint32_t n_words, const uint32_t n_cols, uint64_t* STORM_RESTRICT counts) {
+    const __m256i ones8  = _mm256_set1_epi8(1);
+    const __m256i ones16 = _mm256_set1_epi16(1);
+    const uint64_t stride = 256 * STORM_NARROW_LUT_COLS;
+    __m256i total = _mm256_setzero_si256();
+    uint16_t acc[STORM_NARROW_LUT_COLS];
+    uint64_t count = 0;
+
+    for (uint32_t i = 0; i < n_rows; ++i) {
+        const uint64_t* a = &rows[(uint64_t)i*n_words];
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+        for (uint32_t w = 0; w < n_words; w += 2) {
+            __m256i b0 = _mm256_setzero_si256();
+            __m256i b1 = _mm256_setzero_si256();
+            const uint32_t w_end = n_words - w < 2 ? n_words : w + 2;
+            for (uint32_t k = w; k < w_end; ++k) {
+                const uint64_t v = a[k];
+                const uint8_t* t = &table[(uint64_t)8*k*stride];
+                for (uint32_t c = 0; c < 8; c += 2) {
+                    b0 = _mm256_add_epi8(b0, _mm256_loadu_si256((const __m256i*)&t[c*stride + ((v >> (8*c)) & 0xFF)*STORM_NARROW_LUT_COLS]));
+                    b1 = _mm256_add_epi8(b1, _mm256_loadu_si256((const __m256i*)&t[(c+1)*stride + ((v >> (8*c+8)) & 0xFF)*STORM_NARROW_LUT_COLS]));
+                }
+            }
+            if (counts == NULL) {
+                lo = _mm256_add_epi16(lo, _mm256_add_epi16(_mm256_maddubs_epi16(b0, ones8), _mm256_maddubs_epi16(b1, ones8)));
+                continue;
+            }
+            const __m256i bytes = _mm256_add_epi8(b0, b1);
+            lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+            hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+        }
+
+        if (counts == NULL) {
+            total = _mm256_add_epi32(total, _mm256_madd_epi16(lo, ones16));
+            continue;
+        }
+        _mm256_storeu_si256((__m256i*)&acc[0], lo);
+        _mm256_storeu_si256((__m256i*)&acc[16], hi);
+        for (uint32_t j = 0; j < n_cols; ++j) {
+            count += acc[j];
+            counts[(uint64_t)i*n_cols + j] = acc[j];
+        }
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, total);
+    for (uint32_t k = 0; k < 8; ++k) count += lanes[k];
+    return count;
+}
+#endif
+
+static STORM_lut_sweep_func STORM_get_lut_sweep_func(void) {
+    const int cpuid = STORM_cpuid_cached();
+#if defined(STORM_HAVE_AVX2)
+    if (cpuid & STORM_CPUID_runtime_bit_AVX2) return &STORM_lut_sweep_avx2;
+#endif
+    return &STORM_lut_sweep_scalar;
+}
+
+/**
+ * Lookup-table kernel for off-diagonal tiles of at most
+ * STORM_NARROW_LUT_COLS columns. The tables of the last block are kept in
+ * the worker scratch (after a 64-byte header holding j_start + 1) so that
+ * consecutive tiles of the same block do not rebuild them. Diagonal
+ * tiles are too small to pay for the tables.
+ */
+static uint64_t STORM_tile_kernel_narrow_lut(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_contiguous_t* left  = (const STORM_contiguous_t*)job->left;
+    const STORM_contiguous_t* right = (const STORM_contiguous_t*)job->right;
+    const uint32_t n_words = left->narrow_words;
+    if (tile->diag) return (*STORM_get_narrow_kernel(n_words))(job, tile, worker);
+
+    uint8_t* table = (uint8_t*)&worker->out[16];
+    if (worker->out[0] != tile->j_start + 1) {
+        STORM_narrow_lut_build(right->narrow, n_words, tile->j_start, tile->j_end - tile->j_start, table);
+        worker->out[0] = tile->j_start + 1;
+    }
+
+    return (*STORM_get_lut_sweep_func())(table, &left->narrow[(uint64_t)tile->i_start*n_words], tile->i_end - tile->i_start, n_words, tile->j_end - tile->j_start, worker->counts);
+}
+
+/**
+ * Runs a job over the upper triangle of an N x N comparison in blocks of
+ * STORM_NARROW_LUT_COLS columns. The rows before a block are split into
+ * tiles of at most STORM_NARROW_LUT_ROWS rows and the block itself forms
+ * a diagonal tile. Tiles are generated in batches of whole blocks.
+ */
+static uint64_t STORM_run_lut(STORM_job_t* job, const uint32_t n, const uint32_t n_threads) {
+    uint64_t total = 0;
+    uint32_t begin = 0;
+    while (begin < n && job->abort == 0 && job->error == 0) {
+        uint64_t n_tiles = 0;
+        uint32_t end = begin;
+        while (end < n) {
+            const uint64_t block = (end + STORM_NARROW_LUT_ROWS - 1) / STORM_NARROW_LUT_ROWS + 1;
+            if (n_tiles != 0 && n_tiles + block > STORM_TILE_BATCH) break;
+            n_tiles += block;
+            end = n - end < STORM_NARROW_LUT_COLS ? n : end + STORM_NARROW_LUT_COLS;
+        }
+
+        STORM_tile_t* tiles = (STORM_tile_t*)malloc(n_tiles * sizeof(STORM_tile_t));
+        if (tiles == NULL) {
+            job->error = 1;
+            break;
+        }
 
-    return 1;
+        uint32_t t = 0;
+        for (uint32_t j = begin; j < end; j += STORM_NARROW_LUT_COLS) {
+            const uint32_t j_end = end - j < STORM_NARROW_LUT_COLS ? end : j + STORM_NARROW_LUT_COLS;
+            for (uint32_t i = 0; i < j; i += STORM_NARROW_LUT_ROWS, ++t) {
+                tiles[t].i_start = i;
+                tiles[t].i_end   = j - i < STORM_NARROW_LUT_ROWS ? j : i + STORM_NARROW_LUT_ROWS;
+                tiles[t].j_start = j;
+                tiles[t].j_end   = j_end;
+                tiles[t].diag    = 0;
+                tiles[t].cost    = (uint64_t)(tiles[t].i_end - i) * (j_end - j);
+            }
+            tiles[t].i_start = j;
+            tiles[t].i_end   = j_end;
+            tiles[t].j_start = j;
+            tiles[t].j_end   = j_end;
+            tiles[t].diag    = 1;
+            tiles[t].cost    = ((uint64_t)(j_end - j) * (j_end - j - 1)) / 2;
+            ++t;
+        }
+        assert(t == n_tiles);
+        total += STORM_run_tiles(job, tiles, t, n_threads);
+        free(tiles);
+        begin = end;
+    }
+    return job->error ? (uint64_t)-1 : total;
 }
 
-uint64_t STORM_bitmap_cont_intersect_cardinality(const STORM_bitmap_cont_t* STORM_RESTRICT bitmap1, 
-                                               const STORM_bitmap_cont_t* STORM_RESTRICT bitmap2)
-{
-    if (bitmap1 == NULL) return 0;
-    if (bitmap2 == NULL) return 0;
-    if (bitmap1->n_bitmaps == 0) return 0;
-    if (bitmap2->n_bitmaps == 0) return 0;
+/* *************************************
+*  Threaded contiguous engine
+***************************************/
 
-    // Move this out to recycle memory.
-    uint32_t* out = (uint32_t*)malloc(8192*sizeof(uint32_t));
+// Relative cost of a single scalar probe into a bitmap compared to
+// intersecting and counting one 64-bit word.
+#ifndef STORM_SCALAR_PROBE_COST
+#define STORM_SCALAR_PROBE_COST 4
+#endif
 
-    uint32_t ret = STORM_intersect_vector32_unsafe(bitmap1->block_ids, 
-                                                 bitmap2->block_ids, 
-                                                 bitmap1->n_bitmaps, 
-                                                 bitmap2->n_bitmaps, 
-                                                 out);
-    // Retrieve optimal intersect function.
-    const STORM_compute_func f = STORM_get_intersect_count_func(bitmap1->n_bitmaps);
+static uint64_t STORM_tile_kernel_contig(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_contiguous_t* left  = (const STORM_contiguous_t*)job->left;
+    const STORM_contiguous_t* right = (const STORM_contiguous_t*)job->right;
+    const uint32_t n_words = left->n_bitmaps_vector;
+    uint64_t* counts = worker->counts;
+    const uint32_t ld = tile->j_end - tile->j_start;
+    const uint32_t panel = STORM_word_panel(n_words, (tile->i_end - tile->i_start) + ld);
 
     uint64_t count = 0;
-    for (uint32_t i = 0; i < ret; i += 2) {
-        assert(bitmap1->bitmaps[out[i+0]].id == bitmap2->bitmaps[out[i+1]].id);
-        count += STORM_bitmap_intersect_cardinality_func(&bitmap1->bitmaps[out[i+0]], &bitmap2->bitmaps[out[i+1]], f);
+    for (uint32_t k = 0; k < n_words; k += panel) {
+        const uint32_t n = n_words - k < panel ? n_words - k : panel;
+        for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+            const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+            for (uint32_t j = j_start; j < tile->j_end; ++j) {
+                const uint64_t c = (*job->func)(&left->bitmaps[i].data[k], &right->bitmaps[j].data[k], n);
+                count += c;
+                if (counts != NULL) {
+                    uint64_t* dst = &counts[(i - tile->i_start) * ld + (j - tile->j_start)];
+                    *dst = (k == 0 ? 0 : *dst) + c;
+                }
+            }
+        }
     }
+    return count;
+}
 
-    free(out);
+// Same as STORM_tile_kernel_contig on interleaved panels. Word panels are
+// whole chunks.
+static uint64_t STORM_tile_kernel_contig_panels(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_contiguous_t* left  = (const STORM_contiguous_t*)job->left;
+    const STORM_contiguous_t* right = (const STORM_contiguous_t*)job->right;
+    const uint64_t n_chunks = STORM_micro_chunks(left->n_bitmaps_vector);
+    const uint64_t panel_words = n_chunks * STORM_MICRO_ROWS * STORM_MICRO_WORDS;
+    const STORM_micro_func micro = STORM_get_micro_func();
+    uint64_t* counts = worker->counts;
+    const uint32_t ld = tile->j_end - tile->j_start;
+    const uint64_t span = STORM_micro_chunks(STORM_word_panel(left->n_bitmaps_vector, (tile->i_end - tile->i_start) + ld));
+    uint64_t block[STORM_MICRO_ROWS*STORM_MICRO_ROWS];
 
+    uint64_t count = 0;
+    for (uint64_t k = 0; k < n_chunks; k += span) {
+        const uint64_t n = n_chunks - k < span ? n_chunks - k : span;
+        const uint64_t offset = k*STORM_MICRO_ROWS*STORM_MICRO_WORDS;
+        for (uint32_t p = tile->i_start / STORM_MICRO_ROWS; p*STORM_MICRO_ROWS < tile->i_end; ++p) {
+            const uint32_t i0 = p*STORM_MICRO_ROWS;
+            const uint32_t i_first = i0 > tile->i_start ? i0 : tile->i_start;
+            const uint32_t j_first = tile->diag ? i_first + 1 : tile->j_start;
+            for (uint32_t q = j_first / STORM_MICRO_ROWS; q*STORM_MICRO_ROWS < tile->j_end; ++q) {
+                (*micro)(&left->panels[p*panel_words + offset], &right->panels[q*panel_words + offset], n, block);
+                for (uint32_t r = 0; r < STORM_MICRO_ROWS; ++r) {
+                    const uint32_t i = i0 + r;
+                    if (i < tile->i_start || i >= tile->i_end) continue;
+                    const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+                    for (uint32_t c = 0; c < STORM_MICRO_ROWS; ++c) {
+                        const uint32_t j = q*STORM_MICRO_ROWS + c;
+                        if (j < j_start || j >= tile->j_end) continue;
+                        count += block[STORM_MICRO_ROWS*r + c];
+                        if (counts != NULL) {
+                            uint64_t* dst = &counts[(i - tile->i_start) * ld + (j - tile->j_start)];
+                            *dst = (k == 0 ? 0 : *dst) + block[STORM_MICRO_ROWS*r + c];
+                        }
+                    }
+                }
+            }
+        }
+    }
     return count;
 }
 
-uint64_t STORM_bitmap_cont_intersect_cardinality_premade(const STORM_bitmap_cont_t* STORM_RESTRICT bitmap1, 
-                                                       const STORM_bitmap_cont_t* STORM_RESTRICT bitmap2, 
-                                                       const STORM_compute_func func, 
-                                                       uint32_t* out)
-{
-    if (bitmap1 == NULL) return 0;
-    if (bitmap2 == NULL) return 0;
-    if (bitmap1->n_bitmaps == 0) return 0;
-    if (bitmap2->n_bitmaps == 0) return 0;
-    if (out == NULL) return 0;
-
-    uint32_t ret = STORM_intersect_vector32_unsafe(bitmap1->block_ids, 
-                                                 bitmap2->block_ids, 
-                                                 bitmap1->n_bitmaps, 
-                                                 bitmap2->n_bitmaps, 
-                                                 out);
+static uint64_t STORM_tile_kernel_contig_list(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_contiguous_t* left  = (const STORM_contiguous_t*)job->left;
+    const STORM_contiguous_t* right = (const STORM_contiguous_t*)job->right;
+    const uint32_t n_words = left->n_bitmaps_vector;
+    const uint32_t cutoff  = left->scalar_cutoff;
+    uint64_t* counts = worker->counts;
+    const uint32_t ld = tile->j_end - tile->j_start;
 
     uint64_t count = 0;
-    for (uint32_t i = 0; i < ret; i += 2) {
-        assert(bitmap1->bitmaps[out[i+0]].id == bitmap2->bitmaps[out[i+1]].id);
-        count += STORM_bitmap_intersect_cardinality_func(&bitmap1->bitmaps[out[i+0]], &bitmap2->bitmaps[out[i+1]], func);
+    for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+        const STORM_contiguous_bitmap_t* a = &left->bitmaps[i];
+        const uint32_t j_start = tile->diag ? i + 1 : tile->j_start;
+        for (uint32_t j = j_start; j < tile->j_end; ++j) {
+            const STORM_contiguous_bitmap_t* b = &right->bitmaps[j];
+            uint64_t c;
+            if (a->n_scalar < cutoff || b->n_scalar < cutoff) {
+                c = STORM_intersect_bitmaps_scalar_list(a->data, b->data, a->scalar, b->scalar, a->n_scalar, b->n_scalar);
+            } else {
+                c = (*job->func)(a->data, b->data, n_words);
+            }
+            count += c;
+            if (counts != NULL) counts[(i - tile->i_start) * ld + (j - tile->j_start)] = c;
+        }
     }
-    
     return count;
 }
- 
-int STORM_bitmap_cont_clear(STORM_bitmap_cont_t* bitmap) {
-    if (bitmap == NULL) return -1;
-    for (uint32_t i = 0; i < bitmap->n_bitmaps; ++i) {
-        STORM_bitmap_clear(&bitmap->bitmaps[i]);
+
+/**
+ * Estimate the work in each tile from the data rather than the number of
+ * pairs. Pairs between two dense rows cost n_bitmaps_vector words. Pairs
+ * that take the list path cost one probe per value in the shorter list,
+ * which we bound by the list length of the sparse row(s) involved.
+ */
+typedef struct STORM_contig_costs_s {
+    uint64_t n_words;
+    uint64_t* n_list; // prefix sums of the number of list rows
+    uint64_t* l_list; // prefix sums of list lengths
+    uint64_t* n_list_cols; // same for the column source (may alias n_list)
+    uint64_t* l_list_cols;
+} STORM_contig_costs_t;
+
+// Allocates and fills the prefix sums over the vectors of bitmap. Both
+// are NULL if either cannot be allocated and tiles are then costed by size.
+static void STORM_contig_list_sums(const STORM_contiguous_t* bitmap, uint64_t** n_list, uint64_t** l_list) {
+    *n_list = (uint64_t*)malloc((bitmap->n_data + 1) * sizeof(uint64_t));
+    *l_list = (uint64_t*)malloc((bitmap->n_data + 1) * sizeof(uint64_t));
+    if (*n_list == NULL || *l_list == NULL) {
+        free(*n_list);
+        free(*l_list);
+        *n_list = NULL;
+        *l_list = NULL;
+        return;
+    }
+    (*n_list)[0] = 0; (*l_list)[0] = 0;
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        const int is_list = bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff;
+        (*n_list)[i+1] = (*n_list)[i] + is_list;
+        (*l_list)[i+1] = (*l_list)[i] + (is_list ? bitmap->bitmaps[i].n_scalar : 0);
     }
-    bitmap->n_bitmaps = 0;
-    bitmap->prev_inserted_value = 0;
-    return 1;
 }
 
-// cont
-STORM_t* STORM_new() {
-    STORM_t* all = (STORM_t*)malloc(sizeof(STORM_t));
-    if (all == NULL) return NULL;
-    all->conts = NULL;
-    all->n_conts = 0;
-    all->m_conts = 0;
-    return all;
-}
+static void STORM_contig_tile_costs(const STORM_job_t* job, STORM_tile_t* tiles, const uint32_t n_tiles) {
+    const STORM_contig_costs_t* costs = (const STORM_contig_costs_t*)job->cost_data;
+    const uint64_t n_words = costs->n_words;
+    const uint64_t* n_list = costs->n_list;
+    const uint64_t* l_list = costs->l_list;
+    const uint64_t* n_list_cols = costs->n_list_cols;
+    const uint64_t* l_list_cols = costs->l_list_cols;
+
+    if (n_list == NULL) {
+        for (uint32_t t = 0; t < n_tiles; ++t) tiles[t].cost *= n_words;
+        return;
+    }
 
-void STORM_free(STORM_t* bitmap) {
-    if (bitmap == NULL) return;
-    // for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
-    //     STORM_bitmap_cont_free(&bitmap->conts[i]);
-    // }
-    free(bitmap->conts);
+    for (uint32_t t = 0; t < n_tiles; ++t) {
+        STORM_tile_t* tile = &tiles[t];
+        const uint64_t rows  = tile->i_end - tile->i_start;
+        const uint64_t cols  = tile->j_end - tile->j_start;
+        const uint64_t pairs = tile->cost;
+        const uint64_t dense_rows = rows - (n_list[tile->i_end] - n_list[tile->i_start]);
+        const uint64_t dense_cols = cols - (n_list_cols[tile->j_end] - n_list_cols[tile->j_start]);
+        uint64_t dense_pairs;
+        if (tile->diag) {
+            // Strips (single row) are diagonal tiles whose columns extend
+            // beyond the row.
+            if (rows == 1) dense_pairs = dense_rows * (dense_cols - dense_rows);
+            else dense_pairs = (dense_rows * (dense_rows - (dense_rows != 0))) / 2;
+        } else {
+            dense_pairs = dense_rows * dense_cols;
+        }
+        dense_pairs = dense_pairs > pairs ? pairs : dense_pairs;
+
+        const uint64_t probes = (l_list[tile->i_end] - l_list[tile->i_start]) * cols
+                              + (l_list_cols[tile->j_end] - l_list_cols[tile->j_start]) * rows;
+        tile->cost = dense_pairs * n_words + (pairs - dense_pairs) + probes * STORM_SCALAR_PROBE_COST / 2;
+    }
 }
 
-int STORM_add(STORM_t* bitmap, const uint32_t* values, const uint32_t n_values) {
-    if (bitmap == NULL) return -1;
-    
-    if (bitmap->m_conts == 0) {
-        bitmap->m_conts = 1024;
-        bitmap->conts = (STORM_bitmap_cont_t*)malloc(bitmap->m_conts*sizeof(STORM_bitmap_cont_t));
-        bitmap->n_conts = 0;
-        for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
-            STORM_bitmap_cont_init(&bitmap->conts[i]);
-        }
+/**
+ * Shared engine for the threaded contiguous entry points. A bsize of 0
+ * schedules one row strip per tile, mirroring the unblocked drivers. The
+ * job may carry a tile visitor set up by the caller.
+ */
+static uint64_t STORM_contig_pairw_engine(STORM_contiguous_t* bitmap, const uint32_t bsize, int use_list, const uint32_t n_threads, STORM_job_t* job) {
+    // Narrow rows are cheaper to intersect than any list.
+    const int narrow = STORM_contig_has_narrow(bitmap);
+    use_list = use_list && !narrow;
+
+    STORM_contig_costs_t costs;
+    costs.n_words = bitmap->n_bitmaps_vector;
+    costs.n_list  = NULL;
+    costs.l_list  = NULL;
+
+    if (use_list) {
+        // Prefix sums over rows of the number of list rows and their lengths.
+        STORM_contig_list_sums(bitmap, &costs.n_list, &costs.l_list);
     }
+    costs.n_list_cols = costs.n_list;
+    costs.l_list_cols = costs.l_list;
+
+    job->left      = bitmap;
+    job->right     = bitmap;
+    job->func      = bitmap->intsec_func;
+    if (use_list) job->kernel = &STORM_tile_kernel_contig_list;
+    else if (narrow) job->kernel = STORM_get_narrow_kernel(bitmap->narrow_words);
+    else if (bsize && STORM_contig_has_panels(bitmap)) job->kernel = &STORM_tile_kernel_contig_panels;
+    else job->kernel = &STORM_tile_kernel_contig;
+    job->cost      = &STORM_contig_tile_costs;
+    job->cost_data = &costs;
 
-    if (bitmap->n_conts == bitmap->m_conts) {
-        bitmap->m_conts += 1024;
-        bitmap->conts = (STORM_bitmap_cont_t*)realloc(bitmap->conts, bitmap->m_conts*sizeof(STORM_bitmap_cont_t));
-        for (uint32_t i = bitmap->n_conts; i < bitmap->m_conts; ++i) {
-            STORM_bitmap_cont_init(&bitmap->conts[i]);
-        }
+    uint64_t total = 0;
+    if (bsize == 0) {
+        uint32_t n_tiles = 0;
+        STORM_tile_t* tiles = STORM_tiles_strips(bitmap->n_data, &n_tiles);
+        if (tiles != NULL) {
+            STORM_contig_tile_costs(job, tiles, n_tiles);
+            total = STORM_run_tiles(job, tiles, n_tiles, n_threads);
+            free(tiles);
+        } else job->error = n_tiles != 0;
+        if (job->error) total = (uint64_t)-1;
+    } else {
+        total = STORM_run_triangle(job, bitmap->n_data, bsize, n_threads);
     }
 
-    STORM_bitmap_cont_add(&bitmap->conts[bitmap->n_conts++], values, n_values);
-    return 1;
+    free(costs.n_list);
+    free(costs.l_list);
+    return total;
 }
 
-int STORM_clear(STORM_t* bitmap) {
-    if (bitmap == NULL) return -1;
-    
-    for (int i = 0; i < bitmap->n_conts; ++i)
-        STORM_bitmap_cont_clear(&bitmap->conts[i]);
-    bitmap->n_conts = 0;
-    return 1;
+// Returns non-zero if any vector has a scalar list.
+static int STORM_contig_has_list(const STORM_contiguous_t* bitmap) {
+    if (bitmap->scalar == NULL) return 0;
+    for (uint64_t i = 0; i < bitmap->n_data; ++i) {
+        if (bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff) return 1;
+    }
+    return 0;
 }
 
-uint64_t STORM_pairw_intersect_cardinality(STORM_t* bitmap) {
+uint64_t STORM_contig_pairw_intersect_cardinality_threads(STORM_contiguous_t* bitmap, uint32_t n_threads) {
     if (bitmap == NULL) return -1;
+    if (STORM_contig_has_list(bitmap))
+        return STORM_contig_pairw_intersect_cardinality_list_threads(bitmap, n_threads);
 
-    uint32_t* out = (uint32_t*)malloc(sizeof(uint32_t)*2*STORM_DEFAULT_SCALAR_THRESHOLD);
-    const STORM_compute_func f = STORM_get_intersect_count_func(ceil(STORM_DEFAULT_BLOCK_SIZE/64.0));
-
-    // printf("running for: %u vectors\n", bitmap->n_conts);
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_contig_pairw_engine(bitmap, 0, 0, n_threads, &job);
+}
 
-    uint64_t total = 0;
-    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
-        for (uint32_t j = i + 1; j < bitmap->n_conts; ++j) {
-            total += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
-        }
-    }
+uint64_t STORM_contig_pairw_intersect_cardinality_blocked_threads(STORM_contiguous_t* bitmap, uint32_t bsize, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (STORM_contig_has_list(bitmap))
+        return STORM_contig_pairw_intersect_cardinality_blocked_list_threads(bitmap, bsize, n_threads);
 
-    free(out);
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
 
-    return total;
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_contig_pairw_engine(bitmap, bsize, 0, n_threads, &job);
 }
 
-uint64_t STORM_pairw_intersect_cardinality_blocked(STORM_t* bitmap, uint32_t bsize) {
+uint64_t STORM_contig_pairw_intersect_cardinality_list_threads(STORM_contiguous_t* bitmap, uint32_t n_threads) {
     if (bitmap == NULL) return -1;
+    if (bitmap->scalar == NULL) return -2;
+    if (bitmap->n_scalar == NULL) return -3;
 
-    uint32_t* out = (uint32_t*)malloc(sizeof(uint32_t)*2*STORM_DEFAULT_SCALAR_THRESHOLD);
-    const STORM_compute_func f = STORM_get_intersect_count_func(ceil(STORM_DEFAULT_BLOCK_SIZE/64.0));
-    
-    if (bsize == 0) {
-        uint64_t tot = 0;
-        for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
-            tot += STORM_bitmap_cont_serialized_size(&bitmap->conts[i]);
-        }
-        uint32_t average_size = tot / bitmap->n_conts;
-        bsize = ceil((double)STORM_CACHE_BLOCK_SIZE / average_size);
-        // printf("guestimating block-size to %u\n", bsize);
-    }
-    
-    // Make sure block size is not <5.
-    bsize = bsize < 5 ? 5 : bsize;
-
-    // printf("running for: %u vectors\n", bitmap->n_conts);
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_contig_pairw_engine(bitmap, 0, 1, n_threads, &job);
+}
 
-    uint64_t count = 0;
-    uint32_t i = 0;
+uint64_t STORM_contig_pairw_intersect_cardinality_blocked_list_threads(STORM_contiguous_t* bitmap, uint32_t bsize, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (bitmap->scalar == NULL) return -2;
+    if (bitmap->n_scalar == NULL) return -3;
 
-    for (/**/; i + bsize <= bitmap->n_conts; i += bsize) {
-        // diagonal component
-        for (uint32_t j = 0; j < bsize; ++j) {
-            for (uint32_t jj = j + 1; jj < bsize; ++jj) {
-                // count += (*func)(bitmaps[i+j].data, bitmaps[i+jj].data, n_bitmaps_sample);
-                count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i+j], &bitmap->conts[i+jj], f, out);
-            }
-        }
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
 
-        // square component
-        uint32_t curi = i;
-        uint32_t j = curi + bsize;
-        for (/**/; j + bsize <= bitmap->n_conts; j += bsize) {
-            for (uint32_t ii = 0; ii < bsize; ++ii) {
-                for (uint32_t jj = 0; jj < bsize; ++jj) {
-                    // count += (*func)(bitmaps[curi+ii].data, bitmaps[j+jj].data, n_bitmaps_sample);
-                    count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+ii], &bitmap->conts[j+jj], f, out);
-                }
-            }
-        }
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_contig_pairw_engine(bitmap, bsize, 1, n_threads, &job);
+}
 
-        // residual
-        for (/**/; j < bitmap->n_conts; ++j) {
-            for (uint32_t jj = 0; jj < bsize; ++jj) {
-                // count += (*func)(bitmaps[curi+jj].data, bitmaps[j].data, n_bitmaps_sample);
-                count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+jj], &bitmap->conts[j], f, out);
-            }
-        }
-    }
-    // residual tail
-    for (/**/; i < bitmap->n_conts; ++i) {
-        for (uint32_t j = i + 1; j < bitmap->n_conts; ++j) {
-            // count += (*func)(bitmaps[i].data, bitmaps[j].data, n_bitmaps_sample);
-            count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
-        }
+uint64_t STORM_contig_max_cardinality(const STORM_contiguous_t* bitmap) {
+    if (bitmap == NULL) return 0;
+    uint64_t max = 0;
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        max = bitmap->bitmaps[i].n_scalar > max ? bitmap->bitmaps[i].n_scalar : max;
     }
+    return max;
+}
 
-    free(out);
-
-    return count;
+// Number of vectors per tile such that a tile fits in the cache block size.
+// Rounded to whole panels of the micro-kernel.
+static uint32_t STORM_contig_guess_bsize(const STORM_contiguous_t* bitmap) {
+    uint32_t bsize = STORM_get_cache_block_size(bitmap->n_bitmaps_vector) / (bitmap->n_bitmaps_vector * sizeof(uint64_t));
+    if (bsize >= 2*STORM_MICRO_ROWS) bsize -= bsize % STORM_MICRO_ROWS;
+    return bsize < 5 ? 5 : bsize;
 }
 
-uint64_t STORM_serialized_size(const STORM_t* bitmap) {
-    if (bitmap == NULL) return 0;
+uint64_t STORM_contig_pairw_intersect_cardinality_matrix(STORM_contiguous_t* bitmap, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (out == NULL) return -2;
+    if (out->n_rows < bitmap->n_data) return -3;
 
-    uint64_t tot = 0;
-    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
-        tot += STORM_bitmap_cont_serialized_size(&bitmap->conts[i]);
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        STORM_result_store_diagonal(out, i, bitmap->bitmaps[i].n_scalar);
     }
-    tot += 2*sizeof(uint32_t);
 
-    return tot;
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_matrix(&job, out, bsize, bitmap->n_data);
+    return STORM_contig_pairw_engine(bitmap, bsize, STORM_contig_has_list(bitmap), n_threads, &job);
 }
 
-uint64_t STORM_intersect_cardinality_square(const STORM_t* STORM_RESTRICT bitmap1, const STORM_t* STORM_RESTRICT bitmap2);
+uint64_t STORM_contig_pairw_intersect_cardinality_visit(STORM_contiguous_t* bitmap, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (callback == NULL) return -2;
 
-// contig
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
 
-// Contiguous memory bitmaps
-// struct STORM_contiguous_bitmap_s {
-//     uint64_t* data; // not owner of this data
-//     uint32_t* scalar; // not owner of this data
-//     // width of data is described outside
-//     uint32_t n_scalar; // copy from outside
-// };
+    STORM_visitor_t visitor;
+    visitor.callback  = callback;
+    visitor.user_data = user_data;
 
-// struct STORM_contiguous_s {
-//     uint64_t* data; // bitmaps
-//     uint32_t* scalar; // scalar values
-//     uint32_t* n_scalar; // scalar values per bitmap
-//     STORM_contiguous_bitmap_t* bitmaps; // interpret of data
-//     uint64_t n_data, m_data; // m_data is reported per _VECTOR_ not per machine word
-//     uint64_t vector_length;
-//     uint32_t n_bitmaps_vector; // _MUST_ be divisible by largest alignment!
-//     STORM_compute_func intsec_func; // determined during ctor
-//     uint32_t alignment; // determined during ctor
-//     uint32_t scalar_cutoff; // cutoff for storing scalars
-// };
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_callback(&job, &visitor, bsize, bitmap->n_data);
+    return STORM_contig_pairw_engine(bitmap, bsize, STORM_contig_has_list(bitmap), n_threads, &job);
+}
 
+// Packs the vectors into narrow rows unless they already are.
+static int STORM_contig_need_narrow(STORM_contiguous_t* bitmap) {
+    if (STORM_contig_has_narrow(bitmap)) return 1;
+    return STORM_contig_pack_narrow(bitmap);
+}
 
-STORM_contiguous_t* STORM_contig_new(size_t vector_length) {
-    STORM_contiguous_t* all = (STORM_contiguous_t*)malloc(sizeof(STORM_contiguous_t));
-    if (all == NULL) return NULL;
-    all->data    = NULL;
-    all->scalar  = NULL;
-    all->n_scalar= NULL;
-    all->bitmaps = NULL;
-    all->n_data  = 0;
-    all->m_data  = 0;
-    all->tot_scalar = 0;
-    all->m_scalar   = 0;
-    all->vector_length = vector_length;
-    all->n_bitmaps_vector = ceil(vector_length / 64.0);
-    all->alignment     = STORM_get_alignment();
-    all->intsec_func   = STORM_get_intersect_count_func(all->n_bitmaps_vector);
-    all->scalar_cutoff = vector_length / 200 > 200 ? 200 : vector_length / 200;
-    return all;
+// Shared engine for the lookup-table entry points. Vectors too wide for
+// the tables are compared in tiles of bsize vectors.
+static uint64_t STORM_contig_lut_engine(STORM_contiguous_t* bitmap, const uint32_t bsize, const uint32_t n_threads, STORM_job_t* job) {
+    if (bitmap->narrow_words > STORM_NARROW_LUT_MAX_WORDS) {
+        return STORM_contig_pairw_engine(bitmap, bsize, 0, n_threads, job);
+    }
+
+    job->left   = bitmap;
+    job->right  = bitmap;
+    job->func   = bitmap->intsec_func;
+    job->kernel = &STORM_tile_kernel_narrow_lut;
+    job->n_out  = 16 + STORM_narrow_lut_size(bitmap->narrow_words) / sizeof(uint32_t);
+    return STORM_run_lut(job, bitmap->n_data, n_threads);
 }
 
-void STORM_contig_free(STORM_contiguous_t* bitmap) {
-    if (bitmap == NULL) return;
-    // for (uint32_t i = 0; i < bitmap->m_conts; ++i) {
-    //     STORM_bitmap_cont_free(&bitmap->conts[i]);
-    // }
-    STORM_aligned_free(bitmap->data);
-    free(bitmap->bitmaps);
-    STORM_aligned_free(bitmap->scalar);
-    STORM_aligned_free(bitmap->n_scalar);
+uint64_t STORM_contig_pairw_intersect_cardinality_lut(STORM_contiguous_t* bitmap, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (STORM_contig_need_narrow(bitmap) < 0) return -2;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_contig_lut_engine(bitmap, STORM_NARROW_BSIZE, n_threads, &job);
 }
 
-int STORM_contig_add(STORM_contiguous_t* bitmap, const uint32_t* values, const uint32_t n_values) {
+uint64_t STORM_contig_pairw_intersect_cardinality_lut_matrix(STORM_contiguous_t* bitmap, STORM_result_matrix_t* out, uint32_t n_threads) {
     if (bitmap == NULL) return -1;
-    if (values == NULL) return -2;
-    if (n_values == 0)  return 0;
+    if (out == NULL) return -2;
+    if (out->n_rows < bitmap->n_data) return -3;
+    if (STORM_contig_need_narrow(bitmap) < 0) return -4;
 
-    // If scalar is not set then allocate some memory
-    if (bitmap->scalar == NULL) {
-        bitmap->m_scalar   = 512*32;
-        bitmap->tot_scalar = 0;
-        bitmap->scalar     = (uint32_t*)STORM_aligned_malloc(bitmap->alignment, bitmap->m_scalar*sizeof(uint32_t));
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        STORM_result_store_diagonal(out, i, bitmap->bitmaps[i].n_scalar);
     }
 
-    // If data is not set then allocate some memory
-    // Coupled with n_scalar through m_data
-    if (bitmap->data == NULL) {
-        bitmap->m_data   = 512;
-        bitmap->data     = (uint64_t*)STORM_aligned_malloc(bitmap->alignment, bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t));
-        bitmap->n_scalar = (uint32_t*)STORM_aligned_malloc(bitmap->alignment, bitmap->m_data*sizeof(uint32_t));
-        memset(bitmap->data, 0, bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t));
-        bitmap->bitmaps = (STORM_contiguous_bitmap_t*)malloc(bitmap->m_data*sizeof(STORM_contiguous_bitmap_t));
-        for (int i = 0; i < bitmap->m_data; ++i) {
-            bitmap->bitmaps[i].data     = &bitmap->data[bitmap->n_bitmaps_vector*i];
-            bitmap->bitmaps[i].scalar   = NULL;
-            bitmap->bitmaps[i].n_scalar = 0;
-        }
-    }
-
-    // If number of added values plus current values exceeds the allocated
-    // number then allocate more memory.
-    if (bitmap->tot_scalar + n_values >= bitmap->m_scalar) {
-        uint32_t add = 5*n_values < 65535 ? 65535 : 5*n_values;
-        // printf("resizing scalar: %u/%u->%u\n",bitmap->tot_scalar,bitmap->m_scalar,bitmap->m_scalar+add);
-        bitmap->m_scalar += add;
-        uint32_t* old = bitmap->scalar;
-        bitmap->scalar = (uint32_t*)STORM_aligned_malloc(bitmap->alignment, bitmap->m_scalar*sizeof(uint32_t));
-        memcpy(bitmap->scalar, old, bitmap->tot_scalar);
-        STORM_aligned_free(old);
-        // Update pointers.
-        for (int i = 0, j = 0; i < bitmap->n_data; ++i) {
-            bitmap->bitmaps[i].scalar = &bitmap->scalar[j];
-            j += bitmap->n_scalar[j] < bitmap->scalar_cutoff ? bitmap->n_scalar[j] : 0;
-        }
-    }
-
-    // If data needs resizing we will:
-    //   resize data and n_scalar
-    //   update pointer references in bitmapsto bitmaps->data, and bitmaps->n_scalar, and bitmaps->scalar
-    if (bitmap->n_data >= bitmap->m_data) {
-        // printf("realloc %u->%u\n",bitmap->m_data,bitmap->m_data+512);
-        uint64_t* old = bitmap->data;
-        uint32_t* old_n_scalar = bitmap->n_scalar;
-        bitmap->m_data += 512;
-        bitmap->data     = (uint64_t*)STORM_aligned_malloc(bitmap->alignment, bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t));
-        bitmap->n_scalar = (uint32_t*)STORM_aligned_malloc(bitmap->alignment, bitmap->m_data*sizeof(uint32_t));
-        // memset(bitmap->data, 0, bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t));
-        memcpy(bitmap->n_scalar, old_n_scalar, bitmap->n_data*sizeof(uint32_t));
-        memcpy(bitmap->data, old, bitmap->n_bitmaps_vector*bitmap->n_data*sizeof(uint64_t));
-        memset(&bitmap->data[bitmap->n_bitmaps_vector*bitmap->n_data], 0, 
-                (bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t)) - (bitmap->n_bitmaps_vector*bitmap->n_data*sizeof(uint64_t)));
-        STORM_aligned_free(old);
-        STORM_aligned_free(old_n_scalar);
-        bitmap->bitmaps = (STORM_contiguous_bitmap_t*)realloc(bitmap->bitmaps, bitmap->m_data*sizeof(STORM_contiguous_bitmap_t));
-        for (int i = 0, j = 0; i < bitmap->m_data; ++i) {
-            bitmap->bitmaps[i].data     = &bitmap->data[bitmap->n_bitmaps_vector*i];
-            bitmap->bitmaps[i].n_scalar = bitmap->n_scalar[i];
-            bitmap->bitmaps[i].scalar   = &bitmap->scalar[j];
-            // printf("loop %u/%u and %u/%u. scalar=%u\n", i, bitmap->m_data, j, bitmap->m_scalar, bitmap->n_scalar[i]);
-            j += bitmap->n_scalar[j] < bitmap->scalar_cutoff ? bitmap->n_scalar[j] : 0;
-        }
-    }
-
-    // printf("adding start with %u/%u bitmaps/vector=%u\n",bitmap->n_data,bitmap->m_data,bitmap->n_bitmaps_vector);
-    uint32_t n_values_used = n_values;
-    for (int i = 0; i < n_values; ++i) {
-        if (i != 0) {
-            if (values[i] == values[i-1]) {
-                --n_values_used;
-                continue;
-            } else {
-                // printf("%u !> %u\n", values[i], values[i-1]);
-                assert(values[i] > values[i-1]);
-            }
-        }
-        bitmap->bitmaps[bitmap->n_data].data[values[i] / 64] |= 1ULL << (values[i] % 64);
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    uint32_t bsize = STORM_NARROW_BSIZE;
+    if (bitmap->narrow_words > STORM_NARROW_LUT_MAX_WORDS) {
+        bsize = STORM_job_set_matrix(&job, out, bsize, bitmap->n_data);
+    } else {
+        // Tiles span up to STORM_NARROW_LUT_ROWS earlier rows of one block.
+        STORM_job_set_matrix(&job, out, STORM_NARROW_LUT_COLS, bitmap->n_data);
+        const uint32_t rows = bitmap->n_data < STORM_NARROW_LUT_ROWS ? bitmap->n_data : STORM_NARROW_LUT_ROWS;
+        job.n_counts = (uint64_t)rows * STORM_NARROW_LUT_COLS;
     }
+    return STORM_contig_lut_engine(bitmap, bsize, n_threads, &job);
+}
 
-    // Add scalar values if the total number of values does not exceed
-    // the threshold scalar_cutoff.
-    if (n_values_used < bitmap->scalar_cutoff) {
-        // printf("adding scalar: %u @ %u\n",n_values,bitmap->tot_scalar);
-        bitmap->bitmaps[bitmap->n_data].scalar = &bitmap->scalar[bitmap->tot_scalar];
-        bitmap->bitmaps[bitmap->n_data].scalar[0] = values[0];
-        
-        for (int i = 1; i < n_values; ++i) {
-            if (values[i] == values[i-1]) continue;
-            bitmap->bitmaps[bitmap->n_data].scalar[i] = values[i];
+/**
+ * Shared engine for the contiguous A x B entry points. Both sets must have
+ * the same vector length. The list kernel is used if either set has list
+ * rows and both sets store lists under the same scalar cutoff.
+ */
+static uint64_t STORM_contig_square_engine(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, const uint32_t bsize, const uint32_t n_threads, STORM_job_t* job) {
+    const int narrow = STORM_contig_has_narrow(bitmap1) && STORM_contig_has_narrow(bitmap2)
+                       && bitmap1->narrow_words == bitmap2->narrow_words;
+    const int use_list = (STORM_contig_has_list(bitmap1) || STORM_contig_has_list(bitmap2)) 
+                         && bitmap1->scalar != NULL && bitmap2->scalar != NULL
+                         && bitmap1->scalar_cutoff == bitmap2->scalar_cutoff && !narrow;
+
+    STORM_contig_costs_t costs;
+    memset(&costs, 0, sizeof(STORM_contig_costs_t));
+    costs.n_words = bitmap1->n_bitmaps_vector;
+    if (use_list) {
+        STORM_contig_list_sums(bitmap1, &costs.n_list, &costs.l_list);
+        STORM_contig_list_sums(bitmap2, &costs.n_list_cols, &costs.l_list_cols);
+        if (costs.n_list == NULL || costs.n_list_cols == NULL) {
+            free(costs.n_list);
+            free(costs.l_list);
+            free(costs.n_list_cols);
+            free(costs.l_list_cols);
+            memset(&costs, 0, sizeof(STORM_contig_costs_t));
+            costs.n_words = bitmap1->n_bitmaps_vector;
         }
-        bitmap->tot_scalar += n_values_used;
     }
 
-    // Store number of set bits (n_values)
-    bitmap->n_scalar[bitmap->n_data] = n_values_used;
-    bitmap->bitmaps[bitmap->n_data].n_scalar = n_values_used;
-    ++bitmap->n_data; // Advance data pointer
+    job->left      = bitmap1;
+    job->right     = bitmap2;
+    job->func      = bitmap1->intsec_func;
+    if (use_list) job->kernel = &STORM_tile_kernel_contig_list;
+    else if (narrow) job->kernel = STORM_get_narrow_kernel(bitmap1->narrow_words);
+    else if (STORM_contig_has_panels(bitmap1) && STORM_contig_has_panels(bitmap2)) job->kernel = &STORM_tile_kernel_contig_panels;
+    else job->kernel = &STORM_tile_kernel_contig;
+    job->cost      = &STORM_contig_tile_costs;
+    job->cost_data = &costs;
+
+    const uint64_t total = STORM_run_rect(job, bitmap1->n_data, bitmap2->n_data, bsize, n_threads);
+
+    free(costs.n_list);
+    free(costs.l_list);
+    free(costs.n_list_cols);
+    free(costs.l_list_cols);
+    return total;
+}
 
-    return n_values;
+uint64_t STORM_contig_intersect_cardinality_square(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2) {
+    return STORM_contig_intersect_cardinality_square_threads(bitmap1, bitmap2, 0, 1);
 }
 
-int STORM_contig_clear(STORM_contiguous_t* bitmap) {
-    if (bitmap == NULL) return -1;
-    if (bitmap->data == NULL) return 0;
-    memset(bitmap->data, 0, bitmap->n_bitmaps_vector*bitmap->m_data*sizeof(uint64_t));
-    bitmap->n_data = 0;
-    bitmap->tot_scalar = 0;
-    
-    return 1;
+uint64_t STORM_contig_intersect_cardinality_square_threads(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, uint32_t bsize, uint32_t n_threads) {
+    if (bitmap1 == NULL) return -1;
+    if (bitmap2 == NULL) return -1;
+    if (bitmap1->n_bitmaps_vector != bitmap2->n_bitmaps_vector) return -2;
+
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap1);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    return STORM_contig_square_engine(bitmap1, bitmap2, bsize, n_threads, &job);
 }
 
-uint64_t STORM_contig_pairw_intersect_cardinality(STORM_contiguous_t* bitmap) {
-    if (bitmap == NULL) return -1;
-    if (bitmap->scalar != NULL) {
-        // check list
-        uint32_t valid = 0;
-        for (int i = 0; i < bitmap->n_data; ++i) {
-            valid += bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff;
-        }
-        // printf("checking for scalar: %u<%u\n", valid, bitmap->scalar_cutoff);
-        if (valid) {
-            // printf("using scalar\n");
-            return STORM_contig_pairw_intersect_cardinality_list(bitmap);
-        }
+uint64_t STORM_contig_intersect_cardinality_square_matrix(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads) {
+    if (bitmap1 == NULL) return -1;
+    if (bitmap2 == NULL) return -1;
+    if (bitmap1->n_bitmaps_vector != bitmap2->n_bitmaps_vector) return -2;
+    if (out == NULL) return -3;
+    if (out->layout != STORM_LAYOUT_FULL) return -4;
+    if (out->n_rows < bitmap1->n_data || out->n_cols < bitmap2->n_data) return -4;
+
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap1);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_matrix_rect(&job, out, bsize, bitmap1->n_data > bitmap2->n_data ? bitmap1->n_data : bitmap2->n_data);
+    return STORM_contig_square_engine(bitmap1, bitmap2, bsize, n_threads, &job);
+}
+
+uint64_t STORM_contig_intersect_cardinality_square_visit(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads) {
+    if (bitmap1 == NULL) return -1;
+    if (bitmap2 == NULL) return -1;
+    if (bitmap1->n_bitmaps_vector != bitmap2->n_bitmaps_vector) return -2;
+    if (callback == NULL) return -3;
+
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap1);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_visitor_t visitor;
+    visitor.callback  = callback;
+    visitor.user_data = user_data;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    bsize = STORM_job_set_callback(&job, &visitor, bsize, bitmap1->n_data > bitmap2->n_data ? bitmap1->n_data : bitmap2->n_data);
+    return STORM_contig_square_engine(bitmap1, bitmap2, bsize, n_threads, &job);
+}
+
+// A view of the vectors [begin, end) of bitmap for the incremental updates.
+static STORM_contiguous_t STORM_contig_view(const STORM_contiguous_t* bitmap, const uint64_t begin, const uint64_t end) {
+    STORM_contiguous_t view = *bitmap;
+    view.data     = bitmap->data + begin * bitmap->n_bitmaps_vector;
+    view.n_scalar = bitmap->n_scalar + begin;
+    view.bitmaps  = bitmap->bitmaps + begin;
+    view.n_data   = end - begin;
+    view.m_data   = end - begin;
+    // Panels can be shared from a panel boundary on.
+    view.panels   = NULL;
+    view.n_panel_rows = 0;
+    if (STORM_contig_has_panels(bitmap) && begin % STORM_MICRO_ROWS == 0) {
+        view.panels = bitmap->panels + (begin / STORM_MICRO_ROWS) * STORM_micro_chunks(bitmap->n_bitmaps_vector) * STORM_MICRO_ROWS * STORM_MICRO_WORDS;
+        view.n_panel_rows = end - begin;
+    }
+    view.narrow = NULL;
+    view.n_narrow_rows = 0;
+    if (STORM_contig_has_narrow(bitmap)) {
+        view.narrow = bitmap->narrow + begin * bitmap->narrow_words;
+        view.n_narrow_rows = end - begin;
     }
+    return view;
+}
 
-    uint64_t total = 0;
-    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
-        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
-            total += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-            // total += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->bitmaps[i].data, &bitmap->bitmaps[j].data, bitmap->intsec_func, out);
+uint64_t STORM_contig_incremental_update(STORM_incremental_t* inc, STORM_contiguous_t* bitmap, uint32_t bsize, uint32_t n_threads) {
+    if (inc == NULL) return -1;
+    if (bitmap == NULL) return -1;
+    if (inc->n_vectors > bitmap->n_data) return -1;
+    if (inc->out != NULL && inc->out->n_rows < bitmap->n_data) return -1;
+
+    const uint32_t n_old = inc->n_vectors;
+    const uint32_t n = bitmap->n_data;
+    if (n_old == n) return inc->total;
+
+    if (bsize == 0) bsize = STORM_contig_guess_bsize(bitmap);
+    bsize = bsize < 5 ? 5 : bsize;
+
+    STORM_contiguous_t old_view = STORM_contig_view(bitmap, 0, n_old);
+    STORM_contiguous_t new_view = STORM_contig_view(bitmap, n_old, n);
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    if (inc->out != NULL) {
+        for (uint32_t i = n_old; i < n; ++i) {
+            STORM_result_store_diagonal(inc->out, i, bitmap->bitmaps[i].n_scalar);
         }
+        bsize = STORM_job_set_matrix(&job, inc->out, bsize, n);
     }
 
-    return total;
+    // inc is left unchanged if the tiles cannot be scheduled.
+    job.row_offset = n_old;
+    const uint64_t added = n_old != 0 ? STORM_contig_square_engine(&new_view, &old_view, bsize, n_threads, &job) : 0;
+    job.col_offset = n_old;
+    const uint64_t added_new = job.error ? 0 : STORM_contig_pairw_engine(&new_view, bsize, STORM_contig_has_list(bitmap), n_threads, &job);
+    if (job.error) return -1;
+    inc->total += added + added_new;
+    inc->n_vectors = n;
+    return inc->total;
 }
 
-uint64_t STORM_contig_pairw_intersect_cardinality_blocked(STORM_contiguous_t* bitmap, uint32_t bsize) {
+int STORM_contig_remove(STORM_contiguous_t* bitmap, uint32_t index) {
     if (bitmap == NULL) return -1;
+    if (index >= bitmap->n_data) return -2;
+
+    // Adopted rows are read-only: move them into our own storage first.
+    if (bitmap->own_data == 0 && STORM_contig_reserve(bitmap, bitmap->m_data + 1, 0) < 0) return -3;
+    STORM_contig_drop_packed(bitmap);
+
+    // The list of the removed vector is left in place in scalar.
+    const uint64_t last = bitmap->n_data - 1;
+    const uint64_t n_words = bitmap->n_bitmaps_vector;
+    if (index != last) {
+        memcpy(bitmap->bitmaps[index].data, bitmap->bitmaps[last].data, n_words*sizeof(uint64_t));
+        bitmap->bitmaps[index].scalar   = bitmap->bitmaps[last].scalar;
+        bitmap->bitmaps[index].n_scalar = bitmap->bitmaps[last].n_scalar;
+        bitmap->n_scalar[index] = bitmap->n_scalar[last];
+    }
+    memset(bitmap->bitmaps[last].data, 0, n_words*sizeof(uint64_t));
+    bitmap->bitmaps[last].scalar   = NULL;
+    bitmap->bitmaps[last].n_scalar = 0;
+    bitmap->n_scalar[last] = 0;
+    --bitmap->n_data;
+    return 1;
+}
 
-    if (bitmap->scalar != NULL) {
-        // check list
-        uint32_t valid = 0;
-        for (int i = 0; i < bitmap->n_data; ++i) {
-            valid += bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff;
-        }
-        // printf("checking for blocked-scalar: %u<%u\n", valid, bitmap->scalar_cutoff);
-        if (valid) {
-            // printf("using scalar\n");
-            return STORM_contig_pairw_intersect_cardinality_blocked_list(bitmap, bsize);
-        }
+uint64_t STORM_contig_incremental_remove(STORM_incremental_t* inc, STORM_contiguous_t* bitmap, uint32_t index, uint32_t n_threads) {
+    if (inc == NULL) return -1;
+    if (bitmap == NULL) return -1;
+    if (inc->n_vectors != bitmap->n_data) return -1;
+    if (index >= bitmap->n_data) return -1;
+
+    const uint32_t last = bitmap->n_data - 1;
+    if (inc->out != NULL) {
+        inc->total -= STORM_result_row_sum(inc->out, index, bitmap->n_data);
+        if (index != last) STORM_result_move(inc->out, index, last);
+    } else {
+        // The row against all vectors includes |Xk & Xk| = |Xk|.
+        STORM_contiguous_t row = STORM_contig_view(bitmap, index, index + 1);
+        STORM_job_t job;
+        memset(&job, 0, sizeof(STORM_job_t));
+        const uint64_t row_sum = STORM_contig_square_engine(&row, bitmap, STORM_contig_guess_bsize(bitmap), n_threads, &job);
+        if (job.error) return -1;
+        inc->total -= row_sum - bitmap->bitmaps[index].n_scalar;
     }
 
-    if (bsize <= 2)
-        return STORM_contig_pairw_intersect_cardinality(bitmap);
+    if (STORM_contig_remove(bitmap, index) < 0) return -1;
+    inc->n_vectors = bitmap->n_data;
+    return inc->total;
+}
 
-    // printf("running for: %u vectors\n", bitmap->n_conts);
+/* *************************************
+*  Pairwise search
+*
+*  Rows are ordered by cardinality. For row i we walk outwards from its
+*  position in that order, towards larger and towards smaller vectors.
+*  Along either direction the upper bound of the score, derived from
+*  |Xi & Xj| <= min(|Xi|, |Xj|), only decreases, so a direction is
+*  abandoned as soon as its bound can no longer beat the threshold or the
+*  worst entry of a full heap. Each row keeps its own heap and bound, so a
+*  pair that survives pruning from both sides is intersected twice.
+***************************************/
+
+typedef struct STORM_search_s STORM_search_t;
+typedef uint64_t (*STORM_search_pair_func)(const STORM_search_t* search, const uint32_t i, const uint32_t j, STORM_worker_t* worker);
+
+struct STORM_search_s {
+    const void* source;
+    STORM_search_pair_func pair;
+    STORM_compute_func func;
+    const uint64_t* card; // |Xi|
+    const uint32_t* order; // rows by descending cardinality
+    const uint32_t* rank; // position of each row in order
+    uint32_t n_rows;
+    uint32_t metric;
+    double threshold;
+    STORM_topk_t* out;
+};
+
+typedef struct STORM_search_rank_s {
+    uint64_t card;
+    uint32_t id;
+} STORM_search_rank_t;
+
+static int STORM_search_rank_cmp(const void* aa, const void* bb) {
+    const STORM_search_rank_t* a = (const STORM_search_rank_t*)aa;
+    const STORM_search_rank_t* b = (const STORM_search_rank_t*)bb;
+    if (a->card != b->card) return (a->card < b->card) - (a->card > b->card);
+    return (a->id > b->id) - (a->id < b->id);
+}
 
-    uint64_t count = 0;
-    uint32_t i = 0;
+STORM_topk_t* STORM_topk_new(uint32_t n_rows, uint32_t k) {
+    if (k == 0) return NULL;
+    STORM_topk_t* all = (STORM_topk_t*)malloc(sizeof(STORM_topk_t));
+    if (all == NULL) return NULL;
+    all->neighbors   = (STORM_neighbor_t*)malloc(((uint64_t)n_rows * k == 0 ? 1 : (uint64_t)n_rows * k) * sizeof(STORM_neighbor_t));
+    all->n_neighbors = (uint32_t*)calloc(n_rows == 0 ? 1 : n_rows, sizeof(uint32_t));
+    if (all->neighbors == NULL || all->n_neighbors == NULL) {
+        STORM_topk_free(all);
+        return NULL;
+    }
+    all->n_rows      = n_rows;
+    all->k           = k;
+    all->n_compared  = 0;
+    all->n_pruned    = 0;
+    return all;
+}
 
-    for (/**/; i + bsize <= bitmap->n_data; i += bsize) {
-        // diagonal component
-        for (uint32_t j = 0; j < bsize; ++j) {
-            for (uint32_t jj = j + 1; jj < bsize; ++jj) {
-                // count += (*func)(bitmaps[i+j].data, bitmaps[i+jj].data, n_bitmaps_sample);
-                // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i+j], &bitmap->conts[i+jj], f, out);
-                count += (*bitmap->intsec_func)(bitmap->bitmaps[i+j].data, bitmap->bitmaps[i+jj].data, bitmap->n_bitmaps_vector);
-            }
-        }
+void STORM_topk_free(STORM_topk_t* topk) {
+    if (topk == NULL) return;
+    free(topk->neighbors);
+    free(topk->n_neighbors);
+    free(topk);
+}
 
-        // square component
-        uint32_t curi = i;
-        uint32_t j = curi + bsize;
-        for (/**/; j + bsize <= bitmap->n_data; j += bsize) {
-            for (uint32_t ii = 0; ii < bsize; ++ii) {
-                for (uint32_t jj = 0; jj < bsize; ++jj) {
-                    // count += (*func)(bitmaps[curi+ii].data, bitmaps[j+jj].data, n_bitmaps_sample);
-                    // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+ii], &bitmap->conts[j+jj], f, out);
-                    count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, bitmap->n_bitmaps_vector);
-                }
-            }
-        }
+// Ordering of neighbours: higher score first, then lower id.
+static int STORM_neighbor_worse(const STORM_neighbor_t* a, const STORM_neighbor_t* b) {
+    if (a->score != b->score) return a->score < b->score;
+    return a->id > b->id;
+}
 
-        // residual
-        for (/**/; j < bitmap->n_data; ++j) {
-            for (uint32_t jj = 0; jj < bsize; ++jj) {
-                // count += (*func)(bitmaps[curi+jj].data, bitmaps[j].data, n_bitmaps_sample);
-                // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+jj], &bitmap->conts[j], f, out);
-                count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-            }
+static int STORM_neighbor_cmp(const void* aa, const void* bb) {
+    const STORM_neighbor_t* a = (const STORM_neighbor_t*)aa;
+    const STORM_neighbor_t* b = (const STORM_neighbor_t*)bb;
+    return STORM_neighbor_worse(a, b) - STORM_neighbor_worse(b, a);
+}
+
+// Pushes an entry onto a bounded heap whose root is the worst entry.
+static void STORM_heap_push(STORM_neighbor_t* heap, uint32_t* n, const uint32_t k, const STORM_neighbor_t* entry) {
+    uint32_t pos;
+    if (*n < k) {
+        pos = (*n)++;
+        while (pos > 0) {
+            const uint32_t parent = (pos - 1) / 2;
+            if (!STORM_neighbor_worse(entry, &heap[parent])) break;
+            heap[pos] = heap[parent];
+            pos = parent;
         }
+        heap[pos] = *entry;
+        return;
     }
-    // residual tail
-    for (/**/; i < bitmap->n_data; ++i) {
-        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
-            // count += (*func)(bitmaps[i].data, bitmaps[j].data, n_bitmaps_sample);
-            // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
-            count += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-        }
+
+    if (!STORM_neighbor_worse(&heap[0], entry)) return;
+    pos = 0;
+    while (1) {
+        uint32_t child = 2*pos + 1;
+        if (child >= k) break;
+        if (child + 1 < k && STORM_neighbor_worse(&heap[child + 1], &heap[child])) ++child;
+        if (!STORM_neighbor_worse(&heap[child], entry)) break;
+        heap[pos] = heap[child];
+        pos = child;
     }
+    heap[pos] = *entry;
+}
 
+static double STORM_search_score(const uint32_t metric, const uint64_t count, const uint64_t card1, const uint64_t card2) {
+    if (metric == STORM_METRIC_JACCARD) {
+        const uint64_t denom = card1 + card2 - count;
+        return denom == 0 ? 0 : (double)count / denom;
+    }
     return count;
 }
 
-uint64_t STORM_contig_pairw_intersect_cardinality_list(STORM_contiguous_t* bitmap) {
-    if (bitmap == NULL) return -1;
-    if (bitmap->scalar == NULL) return -2;
-    if (bitmap->n_scalar == NULL) return -3;
+// Largest score any pair with these cardinalities can reach.
+static double STORM_search_bound(const uint32_t metric, const uint64_t card1, const uint64_t card2) {
+    const uint64_t min = card1 < card2 ? card1 : card2;
+    const uint64_t max = card1 < card2 ? card2 : card1;
+    if (metric == STORM_METRIC_JACCARD) return max == 0 ? 0 : (double)min / max;
+    return min;
+}
 
-    // printf("using list\n");
+/**
+ * Returns non-zero if a candidate with the given upper bound and id can
+ * neither pass the threshold nor displace the worst entry of a full heap.
+ */
+static int STORM_search_prune(const STORM_search_t* search, const STORM_neighbor_t* heap, const uint32_t n, const double bound, const uint32_t id) {
+    if (bound < search->threshold || bound == 0) return 1;
+    if (n < search->out->k) return 0;
+    if (bound < heap[0].score) return 1;
+    return bound == heap[0].score && id > heap[0].id;
+}
 
-    uint64_t total = 0;
-    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
-        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
-            if (bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j].n_scalar < bitmap->scalar_cutoff) {
-                total += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->bitmaps[i].scalar, bitmap->bitmaps[j].scalar, bitmap->bitmaps[i].n_scalar, bitmap->bitmaps[j].n_scalar);
-            } else {
-                total += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-                // total += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->bitmaps[i].data, &bitmap->bitmaps[j].data, bitmap->intsec_func, out);
+// Searches the neighbours of every row in the tile and returns the number
+// of pairs that were actually compared.
+static uint64_t STORM_tile_kernel_search(const STORM_job_t* job, const STORM_tile_t* tile, STORM_worker_t* worker) {
+    const STORM_search_t* search = (const STORM_search_t*)job->left;
+    STORM_topk_t* out = search->out;
+    uint64_t n_compared = 0;
+
+    for (uint32_t i = tile->i_start; i < tile->i_end; ++i) {
+        STORM_neighbor_t* heap = &out->neighbors[(uint64_t)i * out->k];
+        uint32_t n = 0;
+        const uint32_t p = search->rank[i];
+        uint32_t up = p, down = p + 1;
+        int go_up = p > 0, go_down = down < search->n_rows;
+
+        while (go_up || go_down) {
+            for (int dir = 0; dir < 2; ++dir) {
+                uint32_t j;
+                if (dir == 0) {
+                    if (go_up == 0) continue;
+                    j = search->order[--up];
+                    go_up = up > 0;
+                } else {
+                    if (go_down == 0) continue;
+                    j = search->order[down++];
+                    go_down = down < search->n_rows;
+                }
+
+                const double bound = STORM_search_bound(search->metric, search->card[i], search->card[j]);
+                if (STORM_search_prune(search, heap, n, bound, j)) {
+                    // Bounds only decrease further along this direction.
+                    // Ties on the bound may still be won by a lower id.
+                    if (bound < search->threshold || bound == 0 || (n == out->k && bound < heap[0].score)) {
+                        if (dir == 0) go_up = 0;
+                        else go_down = 0;
+                    }
+                    continue;
+                }
+
+                const uint64_t count = (*search->pair)(search, i, j, worker);
+                ++n_compared;
+                STORM_neighbor_t entry;
+                entry.count = count;
+                entry.score = STORM_search_score(search->metric, count, search->card[i], search->card[j]);
+                entry.id    = j;
+                if (count > 0 && entry.score >= search->threshold)
+                    STORM_heap_push(heap, &n, out->k, &entry);
             }
         }
+
+        qsort(heap, n, sizeof(STORM_neighbor_t), STORM_neighbor_cmp);
+        out->n_neighbors[i] = n;
     }
+    return n_compared;
+}
 
-    return total;
+static uint64_t STORM_search_pair_storm(const STORM_search_t* search, const uint32_t i, const uint32_t j, STORM_worker_t* worker) {
+    const STORM_t* bitmap = (const STORM_t*)search->source;
+    return STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], search->func, worker->out);
 }
 
-uint64_t STORM_contig_pairw_intersect_cardinality_blocked_list(STORM_contiguous_t* bitmap, uint32_t bsize) {
-    if (bitmap == NULL) return -1;
-    if (bitmap->scalar == NULL) return -2;
-    if (bitmap->n_scalar == NULL) return -3;
+static uint64_t STORM_search_pair_contig(const STORM_search_t* search, const uint32_t i, const uint32_t j, STORM_worker_t* worker) {
+    (void)worker;
+    const STORM_contiguous_t* bitmap = (const STORM_contiguous_t*)search->source;
+    const STORM_contiguous_bitmap_t* a = &bitmap->bitmaps[i];
+    const STORM_contiguous_bitmap_t* b = &bitmap->bitmaps[j];
+    if (a->n_scalar < bitmap->scalar_cutoff || b->n_scalar < bitmap->scalar_cutoff) {
+        return STORM_intersect_bitmaps_scalar_list(a->data, b->data, a->scalar, b->scalar, a->n_scalar, b->n_scalar);
+    }
+    return (*search->func)(a->data, b->data, bitmap->n_bitmaps_vector);
+}
 
-    if (bsize <= 2)
-        return STORM_contig_pairw_intersect_cardinality_list(bitmap);
+// Number of rows per scheduled search tile.
+#ifndef STORM_SEARCH_ROWS
+#define STORM_SEARCH_ROWS 64
+#endif
+
+// Returns 1 on success or -4 if memory cannot be allocated.
+static int STORM_search_engine(STORM_search_t* search, STORM_job_t* job, const uint32_t n_threads) {
+    const uint32_t n = search->n_rows;
+    const uint32_t n_tiles = (n + STORM_SEARCH_ROWS - 1) / STORM_SEARCH_ROWS;
+    STORM_search_rank_t* ranks = (STORM_search_rank_t*)malloc((n == 0 ? 1 : n) * sizeof(STORM_search_rank_t));
+    uint32_t* order = (uint32_t*)malloc((n == 0 ? 1 : n) * sizeof(uint32_t));
+    uint32_t* rank  = (uint32_t*)malloc((n == 0 ? 1 : n) * sizeof(uint32_t));
+    STORM_tile_t* tiles = (STORM_tile_t*)malloc((n_tiles == 0 ? 1 : n_tiles) * sizeof(STORM_tile_t));
+    if (ranks == NULL || order == NULL || rank == NULL || tiles == NULL) {
+        free(ranks);
+        free(order);
+        free(rank);
+        free(tiles);
+        return -4;
+    }
 
-    // printf("using blocked-list\n");
+    for (uint32_t i = 0; i < n; ++i) {
+        ranks[i].card = search->card[i];
+        ranks[i].id   = i;
+    }
+    qsort(ranks, n, sizeof(STORM_search_rank_t), STORM_search_rank_cmp);
+    for (uint32_t i = 0; i < n; ++i) {
+        order[i] = ranks[i].id;
+        rank[ranks[i].id] = i;
+    }
+    free(ranks);
+    search->order = order;
+    search->rank  = rank;
+
+    for (uint32_t t = 0; t < n_tiles; ++t) {
+        tiles[t].i_start = t * STORM_SEARCH_ROWS;
+        tiles[t].i_end   = tiles[t].i_start + STORM_SEARCH_ROWS < n ? tiles[t].i_start + STORM_SEARCH_ROWS : n;
+        tiles[t].j_start = 0;
+        tiles[t].j_end   = n;
+        tiles[t].diag    = 0;
+        tiles[t].cost    = (uint64_t)(tiles[t].i_end - tiles[t].i_start) * n;
+    }
 
-    // printf("running for: %u vectors\n", bitmap->n_conts);
+    job->left   = search;
+    job->right  = search;
+    job->func   = search->func;
+    job->kernel = &STORM_tile_kernel_search;
 
-    uint64_t count = 0;
-    uint32_t i = 0;
+    const uint64_t n_compared = STORM_run_tiles(job, tiles, n_tiles, n_threads);
+    search->out->n_compared = n_compared;
+    search->out->n_pruned   = (uint64_t)n * (n - (n != 0)) - n_compared;
 
-    for (/**/; i + bsize <= bitmap->n_data; i += bsize) {
-        // diagonal component
-        for (uint32_t j = 0; j < bsize; ++j) {
-            for (uint32_t jj = j + 1; jj < bsize; ++jj) {
-                if (bitmap->bitmaps[i+j].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[i+jj].n_scalar < bitmap->scalar_cutoff) {
-                    count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[i+j].data, bitmap->bitmaps[i+jj].data, 
-                        bitmap->bitmaps[i+j].scalar, bitmap->bitmaps[i+jj].scalar, 
-                        bitmap->bitmaps[i+j].n_scalar, bitmap->bitmaps[i+jj].n_scalar);
-                } else {
-                    count += (*bitmap->intsec_func)(bitmap->bitmaps[i+j].data, bitmap->bitmaps[i+jj].data, bitmap->n_bitmaps_vector);
-                }
-            }
-        }
+    free(tiles);
+    free(order);
+    free(rank);
+    return job->error ? -4 : 1;
+}
 
-        // square component
-        uint32_t curi = i;
-        uint32_t j = curi + bsize;
-        for (/**/; j + bsize <= bitmap->n_data; j += bsize) {
-            for (uint32_t ii = 0; ii < bsize; ++ii) {
-                for (uint32_t jj = 0; jj < bsize; ++jj) {
-                    if (bitmap->bitmaps[curi+ii].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j+jj].n_scalar < bitmap->scalar_cutoff) {
-                        count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, 
-                            bitmap->bitmaps[curi+ii].scalar, bitmap->bitmaps[j+jj].scalar, 
-                            bitmap->bitmaps[curi+ii].n_scalar, bitmap->bitmaps[j+jj].n_scalar);
-                    } else {
-                        count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, bitmap->n_bitmaps_vector);
-                    }
-                    // count += (*func)(bitmaps[curi+ii].data, bitmaps[j+jj].data, n_bitmaps_sample);
-                    // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+ii], &bitmap->conts[j+jj], f, out);
-                    // count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+ii].data, bitmap->bitmaps[j+jj].data, bitmap->n_bitmaps_vector);
-                }
-            }
-        }
+int STORM_pairw_search(STORM_t* bitmap, STORM_topk_t* out, uint32_t metric, double threshold, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (out == NULL) return -2;
+    if (out->n_rows < bitmap->n_conts) return -3;
 
-        // residual
-        for (/**/; j < bitmap->n_data; ++j) {
-            for (uint32_t jj = 0; jj < bsize; ++jj) {
-                if (bitmap->bitmaps[curi+jj].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j].n_scalar < bitmap->scalar_cutoff) {
-                    count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, 
-                        bitmap->bitmaps[curi+jj].scalar, bitmap->bitmaps[j].scalar, 
-                        bitmap->bitmaps[curi+jj].n_scalar, bitmap->bitmaps[j].n_scalar);
-                } else {
-                    count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-                }
-                // count += (*func)(bitmaps[curi+jj].data, bitmaps[j].data, n_bitmaps_sample);
-                // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[curi+jj], &bitmap->conts[j], f, out);
-                // count += (*bitmap->intsec_func)(bitmap->bitmaps[curi+jj].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-            }
-        }
+    uint64_t* card = (uint64_t*)malloc((bitmap->n_conts == 0 ? 1 : bitmap->n_conts) * sizeof(uint64_t));
+    if (card == NULL) return -4;
+    for (uint32_t i = 0; i < bitmap->n_conts; ++i) {
+        card[i] = STORM_bitmap_cont_cardinality(&bitmap->conts[i]);
     }
-    // residual tail
-    for (/**/; i < bitmap->n_data; ++i) {
-        for (uint32_t j = i + 1; j < bitmap->n_data; ++j) {
-            if (bitmap->bitmaps[i].n_scalar < bitmap->scalar_cutoff || bitmap->bitmaps[j].n_scalar < bitmap->scalar_cutoff) {
-                count += STORM_intersect_bitmaps_scalar_list(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, 
-                    bitmap->bitmaps[i].scalar, bitmap->bitmaps[j].scalar, 
-                    bitmap->bitmaps[i].n_scalar, bitmap->bitmaps[j].n_scalar);
-            } else {
-                count += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-            }
-            // count += (*func)(bitmaps[i].data, bitmaps[j].data, n_bitmaps_sample);
-            // count += STORM_bitmap_cont_intersect_cardinality_premade(&bitmap->conts[i], &bitmap->conts[j], f, out);
-            // count += (*bitmap->intsec_func)(bitmap->bitmaps[i].data, bitmap->bitmaps[j].data, bitmap->n_bitmaps_vector);
-        }
+
+    STORM_search_t search;
+    memset(&search, 0, sizeof(STORM_search_t));
+    search.source    = bitmap;
+    search.pair      = &STORM_search_pair_storm;
+    search.func      = STORM_get_intersect_count_func(bitmap->block_size / 64);
+    search.card      = card;
+    search.n_rows    = bitmap->n_conts;
+    search.metric    = metric;
+    search.threshold = threshold;
+    search.out       = out;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+    job.n_out = 2*STORM_max_bitmaps(bitmap);
+
+    int ret = STORM_search_engine(&search, &job, n_threads);
+    free(card);
+    return ret;
+}
+
+int STORM_contig_pairw_search(STORM_contiguous_t* bitmap, STORM_topk_t* out, uint32_t metric, double threshold, uint32_t n_threads) {
+    if (bitmap == NULL) return -1;
+    if (out == NULL) return -2;
+    if (out->n_rows < bitmap->n_data) return -3;
+
+    uint64_t* card = (uint64_t*)malloc((bitmap->n_data == 0 ? 1 : bitmap->n_data) * sizeof(uint64_t));
+    if (card == NULL) return -4;
+    for (uint32_t i = 0; i < bitmap->n_data; ++i) {
+        card[i] = bitmap->bitmaps[i].n_scalar;
     }
 
-    return count;
-}
\ No newline at end of file
+    STORM_search_t search;
+    memset(&search, 0, sizeof(STORM_search_t));
+    search.source    = bitmap;
+    search.pair      = &STORM_search_pair_contig;
+    search.func      = bitmap->intsec_func;
+    search.card      = card;
+    search.n_rows    = bitmap->n_data;
+    search.metric    = metric;
+    search.threshold = threshold;
+    search.out       = out;
+
+    STORM_job_t job;
+    memset(&job, 0, sizeof(STORM_job_t));
+
+    int ret = STORM_search_engine(&search, &job, n_threads);
+    free(card);
+    return ret;
+}
@@ -33,7 +33,8 @@
 #include "libalgebra/libalgebra.h"
 
 // Default size of a memory block. This is by default set to 256kb which is what
-// most commodity processors have as L2/L3 cache.
+// most commodity processors have as L2/L3 cache. A tuning profile (see
+// STORM_set_tuning) replaces it at run time.
 #ifndef STORM_CACHE_BLOCK_SIZE
 #define STORM_CACHE_BLOCK_SIZE 256e3
 #endif
@@ -46,6 +47,21 @@
 #define STORM_DEFAULT_SCALAR_THRESHOLD 4096
 #endif
 
+// Bounds on the per-instance block size of a STORM_t: a power of two no
+// larger than the range of the 16-bit offsets stored in scalar blocks.
+#define STORM_MIN_BLOCK_SIZE 64
+#define STORM_MAX_BLOCK_SIZE 65536
+
+// Widest vector, in 64-bit words, handled by the narrow engine.
+#define STORM_NARROW_MAX_WORDS 16
+
+// Number of 64-bit words in the block-occupancy signature of a container
+// (4 or 8, i.e. 256 or 512 bits).
+#ifndef STORM_SIGNATURE_WORDS
+#define STORM_SIGNATURE_WORDS 4
+#endif
+#define STORM_SIGNATURE_BITS (64*STORM_SIGNATURE_WORDS)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -61,6 +77,98 @@ uint64_t STORM_intersect_bitmaps_scalar_list(const uint64_t* STORM_RESTRICT b1,
     const uint32_t  n1, const uint32_t  n2);
 
 
+/*======   Result matrix   ======*/
+// Packed upper triangle of XX^T including the diagonal, stored by column:
+// cell (i,j) with i <= j is found at offset j*(j+1)/2 + i.
+#define STORM_LAYOUT_PACKED 0
+// Full symmetric XX^T stored by row: cell (i,j) is at offset i*ld + j.
+#define STORM_LAYOUT_FULL   1
+
+/**
+ * Caller-supplied output buffer for the *_matrix functions. Cells are
+ * unsigned integers of width bytes (2, 4 or 8) chosen from the largest
+ * possible count with STORM_result_width. The diagonal holds |Xi|.
+ */
+typedef struct STORM_result_matrix_s {
+    void* data;
+    uint64_t ld; // leading dimension (cells per row) for STORM_LAYOUT_FULL
+    uint32_t n_rows, n_cols;
+    uint32_t width; // bytes per cell
+    uint32_t layout;
+} STORM_result_matrix_t;
+
+// Returns the smallest cell width in bytes that can hold max_count.
+uint32_t STORM_result_width(const uint64_t max_count);
+// Returns the number of bytes required for an N x N result matrix.
+uint64_t STORM_result_size(const uint32_t n_vectors, const uint32_t width, const uint32_t layout);
+int STORM_result_matrix_init(STORM_result_matrix_t* matrix, void* data, const uint32_t n_vectors, const uint64_t max_count, const uint32_t layout);
+// Initializes a full n_rows x n_cols matrix for A x B results. data must
+// hold n_rows * n_cols cells of STORM_result_width(max_count) bytes.
+int STORM_result_matrix_init_rect(STORM_result_matrix_t* matrix, void* data, const uint32_t n_rows, const uint32_t n_cols, const uint64_t max_count);
+
+/*======   Incremental updates   ======*/
+/**
+ * Running state for keeping XX^T up to date while vectors are appended or
+ * removed. total is the sum of |Xi & Xj| over all pairs i < j of the first
+ * n_vectors vectors. If out is not NULL its cells for these vectors are
+ * maintained as well; it must be square and cover all vectors before each
+ * update. Cells of the packed layout do not move as vectors are appended,
+ * so its buffer can be grown with realloc (raise n_rows and n_cols too).
+ */
+typedef struct STORM_incremental_s {
+    uint64_t total;
+    uint32_t n_vectors;
+    STORM_result_matrix_t* out; // optional
+} STORM_incremental_t;
+
+// Starts from an empty set. out may be NULL to keep only the total.
+int STORM_incremental_init(STORM_incremental_t* inc, STORM_result_matrix_t* out);
+
+/*======   Tile visitor   ======*/
+/**
+ * A finished tile of pairwise counts passed to a STORM_tile_callback. The
+ * count |Xi & Xj| for i = row_offset + r and j = col_offset + c is found at
+ * counts[r * n_cols + c]. When diag is set the tile lies on the diagonal
+ * (row_offset == col_offset) and only cells with j > i are valid.
+ */
+typedef struct STORM_tile_result_s {
+    const uint64_t* counts;
+    uint32_t row_offset, col_offset;
+    uint32_t n_rows, n_cols;
+    uint32_t diag;
+    uint32_t thread_id; // worker that produced the tile
+} STORM_tile_result_t;
+
+// Callbacks are invoked concurrently from all worker threads. Returning
+// non-zero stops the computation after the tiles currently in flight.
+typedef int (*STORM_tile_callback)(const STORM_tile_result_t* tile, void* user_data);
+
+/*======   Pairwise search   ======*/
+#define STORM_METRIC_INTERSECT 0 // score is |Xi & Xj|
+#define STORM_METRIC_JACCARD   1 // score is |Xi & Xj| / |Xi | Xj|
+
+typedef struct STORM_neighbor_s {
+    double score;
+    uint64_t count; // |Xi & Xj|
+    uint32_t id; // index j of the neighbour
+} STORM_neighbor_t;
+
+/**
+ * Up to k best neighbours for each of n_rows vectors. The neighbours of
+ * vector i are found at neighbors[i * k] and onwards, sorted by descending
+ * score (ties by ascending id), and n_neighbors[i] of them are valid.
+ */
+typedef struct STORM_topk_s {
+    STORM_neighbor_t* neighbors;
+    uint32_t* n_neighbors;
+    uint32_t n_rows, k;
+    uint64_t n_compared, n_pruned; // ordered pairs (i,j) evaluated and skipped by bounds
+} STORM_topk_t;
+
+// Returns NULL if k is 0 or memory cannot be allocated.
+STORM_topk_t* STORM_topk_new(uint32_t n_rows, uint32_t k);
+void STORM_topk_free(STORM_topk_t* topk);
+
 /*======   Wrappers   ======*/
 // Function pointer definitions.
 typedef uint64_t (*STORM_compute_lfunc)(const uint64_t*, const uint64_t*, 
@@ -130,6 +238,12 @@ uint64_t STORM_wrapper_diag_list(const uint32_t n_vectors,
                                  const STORM_compute_lfunc fl, 
                                  const uint32_t cutoff);
 
+/**
+ * Tiled version of STORM_wrapper_diag over tiles of block_size rows. Rows
+ * too wide for two tiles to fit in the cache block size are also split
+ * into word panels, with counts accumulated across panels. The contiguous
+ * blocked drivers and tile kernels split rows the same way.
+ */
 uint64_t STORM_wrapper_diag_blocked(const uint32_t n_vectors, 
                                     const uint64_t* vals, 
                                     const uint32_t n_ints, 
@@ -147,12 +261,122 @@ uint64_t STORM_wrapper_diag_list_blocked(const uint32_t n_vectors,
                              const uint32_t cutoff,
                              uint32_t block_size);
 
+/**
+ * Blocked and multithreaded wrappers that additionally write every count
+ * |Xi & Xj| into the result matrix out. Tiles are computed into a per-thread
+ * buffer and then flushed into out. A block_size of 0 picks a tile size
+ * from STORM_get_cache_block_size and n_threads = 0 uses all available cores.
+ * 
+ * @return uint64_t Returns the sum total POPCNT(A & B), -1 if vals or f (or
+ *                  fl, alt_positions or alt_offsets of the list version) is
+ *                  NULL or the tiles cannot be allocated, -2 if out is NULL
+ *                  and -3 if out has fewer than n_vectors rows.
+ */
+uint64_t STORM_wrapper_diag_matrix(const uint32_t n_vectors, 
+                                   const uint64_t* vals, 
+                                   const uint32_t n_ints, 
+                                   const STORM_compute_func f,
+                                   uint32_t block_size,
+                                   STORM_result_matrix_t* out,
+                                   const uint32_t n_threads);
+
+uint64_t STORM_wrapper_diag_list_matrix(const uint32_t n_vectors, 
+                                        const uint64_t* STORM_RESTRICT vals,
+                                        const uint32_t n_ints,
+                                        const uint32_t* STORM_RESTRICT n_alts,
+                                        const uint32_t* STORM_RESTRICT alt_positions,
+                                        const uint32_t* STORM_RESTRICT alt_offsets, 
+                                        const STORM_compute_func f, 
+                                        const STORM_compute_lfunc fl, 
+                                        const uint32_t cutoff,
+                                        uint32_t block_size,
+                                        STORM_result_matrix_t* out,
+                                        const uint32_t n_threads);
+
+/*======   Threading   ======*/
+// Returns the number of online processors.
+uint32_t STORM_get_n_threads(void);
+
+/*======   Tuning   ======*/
+// Vectors of n 64-bit words fall in width class floor(log2(n)), and the
+// widest class holds everything wider.
+#define STORM_TUNING_WIDTHS 16
+
+/**
+ * Machine-specific parameters of the blocked drivers. A profile is only
+ * valid on machines with the same runtime SIMD bits (cpuid) and data
+ * cache sizes as the one it was measured on. Entries of 0 mean not tuned:
+ * block_size falls back to cache_block_size and scalar_cutoff to the
+ * default rule of STORM_contig_new.
+ */
+typedef struct STORM_tuning_s {
+    uint32_t cpuid;
+    uint64_t l1_size, l2_size, l3_size; // bytes per core (L3 shared), 0 if unknown
+    uint64_t cache_block_size; // bytes of a tile, replaces STORM_CACHE_BLOCK_SIZE
+    uint64_t block_size[STORM_TUNING_WIDTHS]; // bytes of a tile by width class
+    uint32_t scalar_cutoff[STORM_TUNING_WIDTHS]; // by width class
+} STORM_tuning_t;
+
+/**
+ * Reads the L1 data, L2 and L3 cache sizes from sysfs or, where that is
+ * not available, from cpuid. Sizes that cannot be found are set to 0.
+ *
+ * @return int Returns 1 if at least one size was found or 0 otherwise.
+ */
+int STORM_detect_cache_sizes(uint64_t* l1_size, uint64_t* l2_size, uint64_t* l3_size);
+// Initializes an untuned profile for this machine that uses
+// STORM_CACHE_BLOCK_SIZE everywhere.
+void STORM_tuning_init(STORM_tuning_t* tuning);
+/**
+ * Measures tile sizes around the detected cache sizes with short runs of
+ * STORM_contig_pairw_intersect_cardinality_blocked over random vectors
+ * of every other width class, and the scalar cutoffs from the cost of
+ * a bitmap intersection relative to a list probe. Takes a few seconds.
+ * The active profile is restored afterwards.
+ *
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_tune(STORM_tuning_t* tuning);
+/**
+ * Profiles are stored as text with one section per machine type, so that
+ * a file can be shared between different machines. Saving replaces the
+ * section of the same machine type and keeps the others. The new file is
+ * written next to the old one and renamed over it.
+ *
+ * STORM_tuning_load returns 1 if the file holds a section for this
+ * machine, 0 if it does not and a negative value on error (-2 if the file
+ * cannot be opened, -3 if it is malformed). STORM_tuning_save returns 1
+ * on success or a negative value on error.
+ */
+int STORM_tuning_load(STORM_tuning_t* tuning, const char* path);
+int STORM_tuning_save(const STORM_tuning_t* tuning, const char* path);
+/**
+ * Loads the profile for this machine from path, or tunes and adds it to
+ * the file if there is none, and makes it the active profile.
+ *
+ * @return int Returns 1 if the profile was loaded, 2 if it was tuned and
+ *             saved, 3 if it was tuned but could not be saved or a
+ *             negative value on error.
+ */
+int STORM_tune_profile(const char* path);
+// Sets the profile used by all drivers, or the untuned profile if tuning
+// is NULL. Not safe to call while drivers are running.
+void STORM_set_tuning(const STORM_tuning_t* tuning);
+const STORM_tuning_t* STORM_get_tuning(void);
+// Bytes of a tile for vectors of n_words 64-bit words (0 if not known)
+// under the active profile.
+uint64_t STORM_get_cache_block_size(const uint32_t n_words);
+// Default scalar_cutoff of contiguous bitmaps of vector_length bits.
+uint32_t STORM_get_scalar_cutoff(const uint64_t vector_length);
+
 /*======   Canonical representation   ======*/
 typedef struct STORM_bitmap_s STORM_bitmap_t;
 typedef struct STORM_bitmap_cont_s STORM_bitmap_cont_t;
 typedef struct STORM_s STORM_t;
 typedef struct STORM_contiguous_bitmap_s STORM_contiguous_bitmap_t;
 typedef struct STORM_contiguous_s STORM_contiguous_t;
+typedef struct STORM_transposer_s STORM_transposer_t;
+typedef struct STORM_arena_s STORM_arena_t;
 
 // Storm bitmaps
 struct STORM_bitmap_s {
@@ -162,19 +386,29 @@ struct STORM_bitmap_s {
     uint32_t n_bits_set;
     uint32_t n_scalar: 31, n_scalar_set: 1, n_missing;
     uint32_t m_scalar;
+    uint32_t n_runs; // run-encoded block: scalar holds [start, length-1] pairs
     uint32_t id; // block id
+    uint32_t block_size; // values per block
 };
 
 struct STORM_bitmap_cont_s {
     STORM_bitmap_t* bitmaps; // bitmaps array
     uint32_t* block_ids; // block ids (redundant but better data locality)
+    uint64_t signature[STORM_SIGNATURE_WORDS]; // block occupancy, ids above STORM_SIGNATURE_BITS are folded by hashing
     uint32_t n_bitmaps, m_bitmaps;
     uint32_t prev_inserted_value;
+    uint32_t block_size; // values per block
+    uint32_t scalar_threshold; // blocks with fewer values are stored as lists
 };
 
 struct STORM_s {
     STORM_bitmap_cont_t* conts;
     uint32_t n_conts, m_conts;
+    void* map; // read-only file mapping backing the containers (if any)
+    uint64_t map_size;
+    STORM_arena_t* arena; // allocator for block payloads (if any)
+    uint32_t block_size; // values per block of every container
+    uint32_t scalar_threshold; // blocks with fewer values are stored as lists
 };
 
 // Contiguous memory bitmaps
@@ -197,6 +431,12 @@ struct STORM_contiguous_s {
     STORM_compute_func intsec_func; // determined during ctor
     uint32_t alignment; // determined during ctor
     uint32_t scalar_cutoff; // cutoff for storing scalars
+    int own_data; // data is released by us, not adopted from the caller
+    uint64_t* panels; // rows interleaved in panels for the micro-kernel (see STORM_contig_pack_panels)
+    uint64_t n_panel_rows; // rows held in panels
+    uint64_t* narrow; // rows packed to narrow_words words (see STORM_contig_pack_narrow)
+    uint64_t n_narrow_rows; // rows held in narrow
+    uint32_t narrow_words; // 1, 2, 4, 8 or 16
 };
 
 // implementation ----->
@@ -206,6 +446,7 @@ void STORM_bitmap_free(STORM_bitmap_t* bitmap);
 int STORM_bitmap_add(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values);
 int STORM_bitmap_add_with_scalar(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values);
 int STORM_bitmap_add_scalar_only(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values);
+int STORM_bitmap_add_runs(STORM_bitmap_t* bitmap, const uint32_t* values, const uint32_t n_values);
 uint64_t STORM_bitmap_intersect_cardinality(STORM_bitmap_t* STORM_RESTRICT bitmap1, STORM_bitmap_t* STORM_RESTRICT bitmap2);
 uint64_t STORM_bitmap_intersect_cardinality_func(STORM_bitmap_t* STORM_RESTRICT bitmap1, STORM_bitmap_t* STORM_RESTRICT bitmap2, const STORM_compute_func func);
 int STORM_bitmap_clear(STORM_bitmap_t* bitmap);
@@ -216,31 +457,371 @@ STORM_bitmap_cont_t* STORM_bitmap_cont_new();
 void STORM_bitmap_cont_init(STORM_bitmap_cont_t* bitmap);
 void STORM_bitmap_cont_free(STORM_bitmap_cont_t* bitmap);
 int STORM_bitmap_cont_add(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values);
+// Same as STORM_bitmap_cont_add but values may be in any order and contain
+// duplicates. Values must lie beyond the blocks already in the container.
+int STORM_bitmap_cont_add_unsorted(STORM_bitmap_cont_t* bitmap, const uint32_t* values, const uint32_t n_values);
 int STORM_bitmap_cont_clear(STORM_bitmap_cont_t* bitmap);
 uint64_t STORM_bitmap_cont_intersect_cardinality(const STORM_bitmap_cont_t* STORM_RESTRICT bitmap1, const STORM_bitmap_cont_t* STORM_RESTRICT bitmap2);
 uint64_t STORM_bitmap_cont_intersect_cardinality_premade(const STORM_bitmap_cont_t* STORM_RESTRICT bitmap1, const STORM_bitmap_cont_t* STORM_RESTRICT bitmap2, const STORM_compute_func func, uint32_t* out);
 uint32_t STORM_bitmap_cont_serialized_size(STORM_bitmap_cont_t* bitmap);
+uint64_t STORM_bitmap_cont_cardinality(const STORM_bitmap_cont_t* bitmap);
 
 // container
 STORM_t* STORM_new();
+/**
+ * Same as STORM_new but the dense blocks and scalar arrays of all added
+ * vectors are bump-allocated from 64-byte aligned slabs of slab_size bytes
+ * owned by the returned object, instead of one allocation per block. The
+ * slabs are released in bulk by STORM_clear and STORM_free.
+ *
+ * @param slab_size Bytes per slab, or 0 for STORM_ARENA_SLAB_SIZE (1 MB)
+ * @return STORM_t* Returns NULL if the allocation failed.
+ */
+STORM_t* STORM_new_arena(uint64_t slab_size);
+/**
+ * Sets the number of values per block and the number of values below which
+ * a block is stored as a list instead of a dense bitmap. Small blocks suit
+ * narrow universes, where a 65536-value dense block would be mostly empty.
+ * Can only be changed while bitmap holds no vectors.
+ *
+ * @param bitmap
+ * @param block_size Power of two in [STORM_MIN_BLOCK_SIZE, STORM_MAX_BLOCK_SIZE], or 0 for STORM_DEFAULT_BLOCK_SIZE
+ * @param scalar_threshold Values per block, or 0 to scale STORM_DEFAULT_SCALAR_THRESHOLD with the block size
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_set_block_size(STORM_t* bitmap, uint32_t block_size, uint32_t scalar_threshold);
 void STORM_free(STORM_t* bitmap);
 int STORM_add(STORM_t* bitmap, const uint32_t* values, const uint32_t n_values);
+/**
+ * Same as STORM_add but values may be in any order and contain duplicates.
+ * Values are bucketed by block with a radix pass and deduplicated while
+ * their bits are set, so callers do not need to sort beforehand.
+ *
+ * @param bitmap
+ * @param values Unsorted input values
+ * @param n_values Number of input values
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_add_unsorted(STORM_t* bitmap, const uint32_t* values, const uint32_t n_values);
+/**
+ * Adds n_vectors vectors at once from a CSR-style layout: the sorted
+ * values of vector i are values[offsets[i]] to values[offsets[i+1]-1].
+ * Storage is sized in a single pass and the vectors are then built in
+ * parallel. The result is identical to calling STORM_add for each vector
+ * in order.
+ *
+ * @param bitmap    Target STORM model
+ * @param offsets   n_vectors + 1 offsets into values
+ * @param values    Concatenated sorted values
+ * @param n_vectors Number of vectors to add
+ * @param n_threads Number of worker threads, or 0 to use all available cores
+ * @return int      Returns 1 on success or a negative value on error.
+ */
+int STORM_add_batch(STORM_t* bitmap, const uint64_t* offsets, const uint32_t* values, const uint32_t n_vectors, uint32_t n_threads);
 int STORM_clear(STORM_t* bitmap);
 uint64_t STORM_pairw_intersect_cardinality(STORM_t* bitmap);
+/**
+ * Total-only version of STORM_pairw_intersect_cardinality. The sum over all
+ * pairs equals sum_k C(c_k, 2), where c_k is the number of vectors holding
+ * value k, so it is computed from the column counts in a single pass over
+ * the data without any pairwise comparisons.
+ *
+ * @param bitmap Input STORM model
+ * @return uint64_t Returns the total or -1 on error.
+ */
+uint64_t STORM_pairw_intersect_cardinality_total(STORM_t* bitmap);
+/**
+ * Computes the weighted degree of every vector in the co-occurrence graph,
+ * out[i] = sum_{j != i} |Xi & Xj|: the row sums of XX^T without the
+ * diagonal. With c_k the number of vectors holding value k this equals
+ * sum_{k in Xi} c_k - |Xi|, so no pairs are compared.
+ *
+ * @param bitmap    Input STORM model
+ * @param out       Output array of n_conts degrees
+ * @param n_threads Number of worker threads, or 0 to use all available cores
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_row_degrees(STORM_t* bitmap, uint64_t* out, uint32_t n_threads);
 uint64_t STORM_pairw_intersect_cardinality_blocked(STORM_t* bitmap, uint32_t bsize);
+/**
+ * Multithreaded version of STORM_pairw_intersect_cardinality_blocked. The
+ * upper triangle is broken into bsize x bsize tiles that are scheduled over
+ * n_threads workers using work-stealing queues. The result is identical to
+ * the serial path.
+ *
+ * @param bitmap    Input STORM model
+ * @param bsize     Number of containers per tile, or 0 to guess from cache size
+ * @param n_threads Number of worker threads, or 0 to use all available cores
+ * @return uint64_t Returns the sum total POPCNT(A & B) or -1 if the tiles or
+ *                  worker buffers cannot be allocated.
+ */
+uint64_t STORM_pairw_intersect_cardinality_blocked_threads(STORM_t* bitmap, uint32_t bsize, uint32_t n_threads);
+// Largest |Xi| over all vectors: use with STORM_result_width.
+uint64_t STORM_max_cardinality(const STORM_t* bitmap);
+// Same as STORM_pairw_intersect_cardinality_blocked_threads but also writes
+// all pairwise counts into out. Like the visitors below, it caps the tile
+// side so that each thread's tile of counts fits in about an eighth of L2.
+uint64_t STORM_pairw_intersect_cardinality_matrix(STORM_t* bitmap, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads);
+/**
+ * Streams every finished tile of pairwise counts to callback while the
+ * tile is still in cache. Tiles are at most bsize x bsize and their side
+ * is capped so that the counts fit in about an eighth of the L2 cache.
+ * Memory use is O(bsize^2) per thread instead of O(N^2) for the full
+ * matrix.
+ * 
+ * @return uint64_t Returns the sum total POPCNT(A & B) of the visited tiles.
+ */
+uint64_t STORM_pairw_intersect_cardinality_visit(STORM_t* bitmap, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads);
+/**
+ * Finds the out->k highest-scoring neighbours of every vector among all
+ * other vectors, keeping only pairs with a non-zero intersection and a
+ * score of at least threshold. Pairs whose cardinality bound
+ * min(|Xi|,|Xj|) cannot reach the threshold or beat the current k-th
+ * best neighbour are never intersected. Every vector is searched on its
+ * own, so a pair that is not pruned from either side is intersected twice:
+ * without pruning the search costs N(N-1) intersections, twice as many as
+ * STORM_pairw_intersect_cardinality. n_compared + n_pruned = N(N-1).
+ *
+ * @param bitmap    Input STORM model
+ * @param out       Result allocated with STORM_topk_new for at least n_conts vectors
+ * @param metric    STORM_METRIC_INTERSECT or STORM_METRIC_JACCARD
+ * @param threshold Minimum score of reported neighbours
+ * @param n_threads Number of worker threads, or 0 to use all available cores
+ * @return int      Returns 1 on success, -4 if memory cannot be allocated or
+ *                  another negative value on error.
+ */
+int STORM_pairw_search(STORM_t* bitmap, STORM_topk_t* out, uint32_t metric, double threshold, uint32_t n_threads);
+/**
+ * Computes |Ai & Bj| for every vector Ai of bitmap1 against every vector Bj
+ * of bitmap2, for example a query batch against a reference panel. The
+ * bitmap1->n_conts x bitmap2->n_conts rectangle is broken into bsize x
+ * bsize tiles and scheduled like STORM_pairw_intersect_cardinality_blocked_threads.
+ * STORM_intersect_cardinality_square runs on a single thread with a guessed
+ * tile size. Tiles passed to callback have row offsets into bitmap1 and
+ * column offsets into bitmap2 and are never diagonal.
+ *
+ * @param bitmap1   Row set A
+ * @param bitmap2   Column set B
+ * @param bsize     Number of containers per tile, or 0 to guess from cache size
+ * @param n_threads Number of worker threads, or 0 to use all available cores
+ * @return uint64_t Returns the sum total POPCNT(A & B) or -1 on error.
+ */
 uint64_t STORM_intersect_cardinality_square(const STORM_t* STORM_RESTRICT bitmap1, const STORM_t* STORM_RESTRICT bitmap2);
+uint64_t STORM_intersect_cardinality_square_threads(const STORM_t* bitmap1, const STORM_t* bitmap2, uint32_t bsize, uint32_t n_threads);
+// out must be a full matrix of at least n_conts(A) x n_conts(B) cells.
+uint64_t STORM_intersect_cardinality_square_matrix(const STORM_t* bitmap1, const STORM_t* bitmap2, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads);
+uint64_t STORM_intersect_cardinality_square_visit(const STORM_t* bitmap1, const STORM_t* bitmap2, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads);
+/**
+ * Accounts for the vectors appended to bitmap since the last update by
+ * computing only the new x old and new x new pairs. Vectors already
+ * accounted for must not have changed.
+ *
+ * @param inc       Incremental state for bitmap
+ * @param bitmap    Input STORM model
+ * @param bsize     Number of containers per tile, or 0 to guess from cache size
+ * @param n_threads Number of worker threads, or 0 to use all available cores
+ * @return uint64_t Returns the updated inc->total, or -1 on error in which
+ *                  case inc is unchanged.
+ */
+uint64_t STORM_incremental_update(STORM_incremental_t* inc, STORM_t* bitmap, uint32_t bsize, uint32_t n_threads);
+// Removes vector index by moving the last vector into its position.
+int STORM_remove(STORM_t* bitmap, uint32_t index);
+/**
+ * Removes vector index with STORM_remove and subtracts its pairs from
+ * inc->total. The row sum is read from inc->out if present and computed
+ * otherwise. inc must be up to date with bitmap.
+ *
+ * @return uint64_t Returns the updated inc->total, or -1 on error in which
+ *                  case neither inc nor bitmap is changed.
+ */
+uint64_t STORM_incremental_remove(STORM_incremental_t* inc, STORM_t* bitmap, uint32_t index, uint32_t n_threads);
 uint64_t STORM_serialized_size(const STORM_t* bitmap);
 
+/**
+ * Versioned on-disk format. All records and payloads are 64-byte aligned so
+ * that STORM_mmap_file can point the bitmaps straight into a read-only
+ * mapping of the file (own_data = own_scalar = 0). The mapping is released
+ * by STORM_clear or STORM_free. STORM_serialize writes the same bytes as
+ * STORM_write_file into dst, which must hold STORM_file_size bytes.
+ */
+uint64_t STORM_file_size(const STORM_t* bitmap);
+int STORM_serialize(const STORM_t* bitmap, uint8_t* dst);
+// Returns 1 on success or a negative value on error (-4 on I/O errors and
+// -5 if memory cannot be allocated), in which case path is removed.
+int STORM_write_file(const STORM_t* bitmap, const char* path);
+// Returns NULL if the file cannot be mapped or is not a valid STORM file.
+STORM_t* STORM_mmap_file(const char* path);
+/**
+ * Out-of-core version of STORM_pairw_intersect_cardinality_visit for files
+ * written by STORM_write_file that do not fit in memory. Rows are read in
+ * panels of about memory_budget / 3 bytes and the next panel is read while
+ * the current pair of panels is being compared. Tiles passed to callback
+ * carry global row and column offsets; callback may be NULL.
+ *
+ * @param path          STORM file
+ * @param memory_budget Bytes available for panel buffers
+ * @param bsize         Number of containers per tile, or 0 to guess from cache size
+ * @param callback      Optional tile consumer
+ * @param user_data     Passed through to callback
+ * @param n_threads     Number of worker threads, or 0 to use all available cores
+ * @return uint64_t     Returns the sum total POPCNT(A & B) or -1 on I/O or
+ *                      allocation errors.
+ */
+uint64_t STORM_pairw_intersect_cardinality_file(const char* path, uint64_t memory_budget, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads);
+
 // contig
 STORM_contiguous_t* STORM_contig_new(size_t vector_length);
 void STORM_contig_free(STORM_contiguous_t* bitmap);
 int STORM_contig_add(STORM_contiguous_t* bitmap, const uint32_t* values, const uint32_t n_values);
+// Same as STORM_contig_add but values may be in any order and contain
+// duplicates.
+int STORM_contig_add_unsorted(STORM_contiguous_t* bitmap, const uint32_t* values, const uint32_t n_values);
+// Same as STORM_add_batch for contiguous bitmaps. Unlike STORM_contig_add,
+// empty vectors are kept so that vector i lands at position n_data + i.
+int STORM_contig_add_batch(STORM_contiguous_t* bitmap, const uint64_t* offsets, const uint32_t* values, const uint32_t n_vectors, uint32_t n_threads);
+/**
+ * Adds n_rows vectors from a packed row-major bit matrix: bit j of row i is
+ * bit j % 64 of data[i*stride + j / 64]. Bits at or past vector_length must
+ * be zero. Per-row counts are computed with STORM_popcnt and scalar lists
+ * are built only for rows with fewer than scalar_cutoff bits set.
+ *
+ * If adopt is non-zero, the bitmap is empty, stride equals n_bitmaps_vector
+ * and data is aligned to the bitmap alignment, the rows are used in place
+ * without copying. The caller then keeps ownership of data and must keep
+ * it alive and unchanged until the bitmap is cleared or freed, or until
+ * the next add, which copies the rows into storage owned by the bitmap.
+ * Otherwise the rows are copied.
+ *
+ * @param bitmap
+ * @param data Packed rows of 64-bit words
+ * @param n_rows Number of rows
+ * @param stride Words between the starts of consecutive rows; at least n_bitmaps_vector
+ * @param adopt Use data in place when possible
+ * @return int Returns the number of rows added or a negative value on error.
+ */
+int STORM_contig_add_matrix(STORM_contiguous_t* bitmap, const uint64_t* data, const uint64_t n_rows, const uint64_t stride, const int adopt);
 int STORM_contig_clear(STORM_contiguous_t* bitmap);
+
+// column-stream transposer
+/**
+ * Creates a transposer that builds n_rows new vectors of bitmap from a
+ * stream of columns: column j holds bit r if value j belongs to vector r.
+ * The rows are appended after the existing vectors and are complete once
+ * STORM_transposer_finish returns; nothing else may be added to bitmap in
+ * the meantime.
+ *
+ * @param bitmap Target
+ * @param n_rows Number of vectors to build
+ * @return STORM_transposer_t* Returns NULL if the allocation failed.
+ */
+STORM_transposer_t* STORM_transposer_new(STORM_t* bitmap, const uint64_t n_rows);
+// Same as STORM_transposer_new for contiguous bitmaps. At most
+// vector_length columns can be added.
+STORM_transposer_t* STORM_transposer_new_contig(STORM_contiguous_t* bitmap, const uint64_t n_rows);
+/**
+ * Adds the next column as a packed bitmap of n_rows bits. Columns are
+ * buffered and transposed in 64x64 tiles.
+ *
+ * @param t
+ * @param column ceil(n_rows / 64) words
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_transposer_add_column(STORM_transposer_t* t, const uint64_t* column);
+// Same as STORM_transposer_add_column with the column given as a list of
+// row indices.
+int STORM_transposer_add_column_rows(STORM_transposer_t* t, const uint32_t* rows, const uint32_t n_values);
+// Flushes the buffered columns and completes the rows in the target.
+int STORM_transposer_finish(STORM_transposer_t* t);
+void STORM_transposer_free(STORM_transposer_t* t);
 uint64_t STORM_contig_pairw_intersect_cardinality(STORM_contiguous_t* bitmap);
+/**
+ * Total-only version of STORM_contig_pairw_intersect_cardinality computed
+ * from the column counts (see STORM_pairw_intersect_cardinality_total).
+ *
+ * @param bitmap Input contiguous bitmaps
+ * @return uint64_t Returns the total or -1 on error.
+ */
+uint64_t STORM_contig_pairw_intersect_cardinality_total(STORM_contiguous_t* bitmap);
+/**
+ * Counts, for every column k < vector_length, the number of vectors with
+ * bit k set.
+ *
+ * @param bitmap Input contiguous bitmaps
+ * @param counts Output array of vector_length counts
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_contig_column_counts(const STORM_contiguous_t* bitmap, uint64_t* counts);
+// Contiguous version of STORM_row_degrees: out holds n_data degrees.
+int STORM_contig_row_degrees(STORM_contiguous_t* bitmap, uint64_t* out, uint32_t n_threads);
+/**
+ * Copies the vectors into an interleaved layout of panels of four rows,
+ * where the rows of a panel alternate every 512 bits. The blocked drivers
+ * then compute 4 x 4 blocks of pairs in a single pass over two panels
+ * instead of reading every row once per partner. Costs a second copy of
+ * the data; any change to the vectors drops the panels again.
+ *
+ * @param bitmap Input contiguous bitmaps
+ * @return int Returns 1 on success or a negative value on error.
+ */
+int STORM_contig_pack_panels(STORM_contiguous_t* bitmap);
+/**
+ * Packs vectors of at most STORM_NARROW_MAX_WORDS words (1024 bits) into
+ * rows of 1, 2, 4, 8 or 16 words. The pairwise and A x B drivers then use
+ * kernels specialised for that width that keep a row in registers instead
+ * of calling intsec_func per pair. Any change to the vectors drops the
+ * packed rows again.
+ *
+ * @param bitmap Input contiguous bitmaps
+ * @return int Returns 1 on success, -2 if the vectors are too wide or
+ *             another negative value on error.
+ */
+int STORM_contig_pack_narrow(STORM_contiguous_t* bitmap);
 uint64_t STORM_contig_pairw_intersect_cardinality_blocked(STORM_contiguous_t* bitmap, uint32_t bsize);
 uint64_t STORM_contig_pairw_intersect_cardinality_list(STORM_contiguous_t* bitmap);
 uint64_t STORM_contig_pairw_intersect_cardinality_blocked_list(STORM_contiguous_t* bitmap, uint32_t bsize);
 
+/**
+ * Multithreaded versions of the contiguous pairwise functions above. All
+ * workers share the same read-only STORM_contiguous_t. Tiles are balanced
+ * by their estimated work (words intersected and scalar probes) rather
+ * than by row index. Passing n_threads = 0 uses all available cores and
+ * bsize = 0 guesses the tile size from the cache size, like
+ * STORM_pairw_intersect_cardinality_blocked_threads. They return -1 if the
+ * tiles or worker buffers cannot be allocated.
+ */
+uint64_t STORM_contig_pairw_intersect_cardinality_threads(STORM_contiguous_t* bitmap, uint32_t n_threads);
+uint64_t STORM_contig_pairw_intersect_cardinality_blocked_threads(STORM_contiguous_t* bitmap, uint32_t bsize, uint32_t n_threads);
+uint64_t STORM_contig_pairw_intersect_cardinality_list_threads(STORM_contiguous_t* bitmap, uint32_t n_threads);
+uint64_t STORM_contig_pairw_intersect_cardinality_blocked_list_threads(STORM_contiguous_t* bitmap, uint32_t bsize, uint32_t n_threads);
+uint64_t STORM_contig_max_cardinality(const STORM_contiguous_t* bitmap);
+uint64_t STORM_contig_pairw_intersect_cardinality_matrix(STORM_contiguous_t* bitmap, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads);
+uint64_t STORM_contig_pairw_intersect_cardinality_visit(STORM_contiguous_t* bitmap, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads);
+/**
+ * Four-Russians versions of the pairwise sum and matrix drivers for narrow
+ * vectors. For each block of 32 vectors a table holds the 32 counts for
+ * every value of every byte position, and each other vector then adds one
+ * table row per byte instead of counting the 32 pairs. Packs the vectors
+ * with STORM_contig_pack_narrow if needed. Vectors wider than 4 words use
+ * the specialised narrow kernels instead as the tables outgrow the cache.
+ * Both return -1 if the tiles or worker buffers cannot be allocated.
+ */
+uint64_t STORM_contig_pairw_intersect_cardinality_lut(STORM_contiguous_t* bitmap, uint32_t n_threads);
+uint64_t STORM_contig_pairw_intersect_cardinality_lut_matrix(STORM_contiguous_t* bitmap, STORM_result_matrix_t* out, uint32_t n_threads);
+// Same as STORM_pairw_search for contiguous bitmaps.
+int STORM_contig_pairw_search(STORM_contiguous_t* bitmap, STORM_topk_t* out, uint32_t metric, double threshold, uint32_t n_threads);
+// A x B versions of STORM_intersect_cardinality_square* for contiguous
+// bitmaps. Both sets must have the same vector length.
+uint64_t STORM_contig_intersect_cardinality_square(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2);
+uint64_t STORM_contig_intersect_cardinality_square_threads(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, uint32_t bsize, uint32_t n_threads);
+uint64_t STORM_contig_intersect_cardinality_square_matrix(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, uint32_t bsize, STORM_result_matrix_t* out, uint32_t n_threads);
+uint64_t STORM_contig_intersect_cardinality_square_visit(const STORM_contiguous_t* bitmap1, const STORM_contiguous_t* bitmap2, uint32_t bsize, STORM_tile_callback callback, void* user_data, uint32_t n_threads);
+// Contiguous versions of STORM_incremental_update, STORM_remove and
+// STORM_incremental_remove. The list of a removed vector stays allocated
+// until the bitmap is cleared.
+uint64_t STORM_contig_incremental_update(STORM_incremental_t* inc, STORM_contiguous_t* bitmap, uint32_t bsize, uint32_t n_threads);
+int STORM_contig_remove(STORM_contiguous_t* bitmap, uint32_t index);
+uint64_t STORM_contig_incremental_remove(STORM_incremental_t* inc, STORM_contiguous_t* bitmap, uint32_t index, uint32_t n_threads);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif